@@ -0,0 +1,147 @@
+/*
+ * Per-cpu software submission queues for bio based drivers
+ *
+ * A driver that sets up its queue with blk_queue_swq() gets bios in
+ * batches. Bios submitted on a cpu are collected on that cpu's software
+ * queue while the submitter is plugged, and handed to the driver together
+ * when the plug is flushed or the batch is full. Unplugged bios are
+ * passed on at once. Each software queue has its own lock, only taken
+ * by another cpu when a plugged task migrated before flushing, so
+ * submitters on different cpus do not contend with each other.
+ *
+ * The batch is dispatched from the submitting task, normally on the cpu
+ * it was queued on, so drivers that complete I/O from their dispatch
+ * function or from per-cpu state complete it on the submitting cpu too.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+
+#include "blk.h"
+
+struct blk_swq_ctx {
+	spinlock_t		lock;
+	struct bio_list		bios;
+	unsigned int		nr_bios;
+	struct request_queue	*q;
+};
+
+struct blk_swq_plug_cb {
+	struct blk_plug_cb	cb;
+	struct blk_swq_ctx	*ctx;
+};
+
+static void blk_swq_run(struct blk_swq_ctx *ctx)
+{
+	struct bio_list bios;
+
+	spin_lock(&ctx->lock);
+	bios = ctx->bios;
+	bio_list_init(&ctx->bios);
+	ctx->nr_bios = 0;
+	spin_unlock(&ctx->lock);
+
+	if (!bio_list_empty(&bios))
+		ctx->q->swq_fn(ctx->q, &bios);
+}
+
+static void blk_swq_unplug(struct blk_plug_cb *cb)
+{
+	struct blk_swq_plug_cb *swcb = container_of(cb, struct blk_swq_plug_cb,
+						    cb);
+
+	blk_swq_run(swcb->ctx);
+	kfree(swcb);
+}
+
+/*
+ * Make sure that flushing the current task's plug dispatches ctx.
+ * Returns false if the task is not plugged or we ran out of memory,
+ * then the caller dispatches at once.
+ */
+static bool blk_swq_check_plugged(struct blk_swq_ctx *ctx)
+{
+	struct blk_plug *plug = current->plug;
+	struct blk_swq_plug_cb *swcb;
+
+	if (!plug)
+		return false;
+
+	list_for_each_entry(swcb, &plug->cb_list, cb.list)
+		if (swcb->cb.callback == blk_swq_unplug && swcb->ctx == ctx)
+			return true;
+
+	swcb = kmalloc(sizeof(*swcb), GFP_ATOMIC);
+	if (!swcb)
+		return false;
+
+	swcb->ctx = ctx;
+	swcb->cb.callback = blk_swq_unplug;
+	list_add(&swcb->cb.list, &plug->cb_list);
+	return true;
+}
+
+static int blk_swq_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct blk_swq_ctx *ctx;
+	bool plugged;
+
+	ctx = per_cpu_ptr(q->swq_ctx, get_cpu());
+	plugged = blk_swq_check_plugged(ctx);
+
+	spin_lock(&ctx->lock);
+	bio_list_add(&ctx->bios, bio);
+	if (++ctx->nr_bios < BLK_MAX_REQUEST_COUNT && plugged) {
+		spin_unlock(&ctx->lock);
+		put_cpu();
+		return 0;
+	}
+	spin_unlock(&ctx->lock);
+	put_cpu();
+
+	blk_swq_run(ctx);
+	return 0;
+}
+
+/**
+ * blk_queue_swq - set up a bio based queue with per-cpu submission
+ * @q:  the request queue for the device to be affected
+ * @fn: the function to pass batches of bios to
+ *
+ * Description:
+ *    Like blk_queue_make_request(), but @fn is given a list of one or more
+ *    bios submitted on one cpu, see the top of this file. Nothing is
+ *    guaranteed about the order of bios submitted on different cpus. The
+ *    software queues are freed with the queue.
+ *
+ *    Returns 0 on success or -ENOMEM.
+ */
+int blk_queue_swq(struct request_queue *q, swq_request_fn *fn)
+{
+	int cpu;
+
+	q->swq_ctx = alloc_percpu(struct blk_swq_ctx);
+	if (!q->swq_ctx)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_swq_ctx *ctx = per_cpu_ptr(q->swq_ctx, cpu);
+
+		spin_lock_init(&ctx->lock);
+		bio_list_init(&ctx->bios);
+		ctx->q = q;
+	}
+
+	q->swq_fn = fn;
+	blk_queue_make_request(q, blk_swq_make_request);
+	return 0;
+}
+EXPORT_SYMBOL(blk_queue_swq);
+
+void blk_swq_exit(struct request_queue *q)
+{
+	free_percpu(q->swq_ctx);
+}
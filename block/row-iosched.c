@@ -26,6 +26,9 @@
 #include <linux/compiler.h>
 #include <linux/blktrace_api.h>
 #include <linux/jiffies.h>
+#include <linux/rcupdate.h>
+
+#include "blk-cgroup.h"
 
 /*
  * enum row_queue_prio - Priorities of the ROW queues
@@ -84,6 +87,14 @@ static const int queue_quantum[] = {
 #define ROW_IDLE_TIME_MSEC 5
 #define ROW_READ_FREQ_MSEC 20
 
+/*
+ * Default blkio cgroup weights at or above which requests go to the HIGH
+ * queues, and at or below which they go to the LOW queues. Requests from
+ * groups of the default weight use the REG queues.
+ */
+#define ROW_HP_GROUP_WEIGHT (BLKIO_WEIGHT_DEFAULT + 1)
+#define ROW_LP_GROUP_WEIGHT (BLKIO_WEIGHT_DEFAULT - 1)
+
 /**
  * struct rowq_idling_data -  parameters for idling on the queue
  * @last_insert_time:	time the last request was inserted
@@ -147,6 +158,10 @@ struct idling_data {
  *			scheduler, nr_reqs[1] holds the number of all WRITE
  *			requests in scheduler
  * @cycle_flags:	used for marking unserved queueus
+ * @hp_group_weight:	blkio cgroup weight from which requests are
+ *			queued as high priority
+ * @lp_group_weight:	blkio cgroup weight up to which requests are
+ *			queued as low priority
  *
  */
 struct row_data {
@@ -163,6 +178,9 @@ struct row_data {
 	unsigned int			nr_reqs[2];
 
 	unsigned int			cycle_flags;
+
+	int				hp_group_weight;
+	int				lp_group_weight;
 };
 
 #define RQ_ROWQ(rq) ((struct row_queue *) ((rq)->elevator_private[0]))
@@ -551,6 +569,9 @@ static void *row_init_queue(struct request_queue *q)
 
 	rdata->nr_reqs[READ] = rdata->nr_reqs[WRITE] = 0;
 
+	rdata->hp_group_weight = ROW_HP_GROUP_WEIGHT;
+	rdata->lp_group_weight = ROW_LP_GROUP_WEIGHT;
+
 	return rdata;
 }
 
@@ -588,27 +609,73 @@ static void row_merged_requests(struct request_queue *q, struct request *rq,
 	rqueue->rdata->nr_reqs[rq_data_dir(rq)]--;
 }
 
+/*
+ * row_group_weight() - blkio cgroup weight of the submitting task
+ *
+ * Returns BLKIO_WEIGHT_DEFAULT if blkio cgroups are not available, and
+ * for tasks in the root group. The root group is weighted twice the
+ * default and holds every task until a hierarchy is set up, so its
+ * weight says nothing about the task.
+ */
+static int row_group_weight(void)
+{
+#if defined(CONFIG_BLK_CGROUP) || defined(CONFIG_BLK_CGROUP_MODULE)
+	struct blkio_cgroup *blkcg;
+	int weight;
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+	weight = blkcg == &blkio_root_cgroup ? BLKIO_WEIGHT_DEFAULT :
+		 blkcg->weight;
+	rcu_read_unlock();
+
+	return weight;
+#else
+	return BLKIO_WEIGHT_DEFAULT;
+#endif
+}
+
 /*
  * get_queue_type() - Get queue type for a given request
+ * @rd:	pointer to struct row_data
+ * @rq:	the request
  *
  * This is a helping function which purpose is to determine what
  * ROW queue the given request should be added to (and
  * dispatched from leter on)
  *
- * TODO: Right now only 3 queues are used REG_READ, REG_WRITE
- * and REG_SWRITE
+ * READ and sync WRITE requests are queued by the blkio cgroup weight of
+ * the submitting task: groups weighted above the default (foreground)
+ * use the HIGH queues, groups weighted below it (background) use the LOW
+ * queues, which get a small dispatch quantum and no idling. The root
+ * group uses the REG queues whatever its weight. Async WRITE
+ * requests are submitted by the flusher threads and always use REG_WRITE.
  */
-static enum row_queue_prio get_queue_type(struct request *rq)
+static enum row_queue_prio get_queue_type(struct row_data *rd,
+					  struct request *rq)
 {
 	const int data_dir = rq_data_dir(rq);
 	const bool is_sync = rq_is_sync(rq);
+	int weight;
 
-	if (data_dir == READ)
-		return ROWQ_PRIO_REG_READ;
-	else if (is_sync)
-		return ROWQ_PRIO_REG_SWRITE;
-	else
+	if (data_dir != READ && !is_sync)
 		return ROWQ_PRIO_REG_WRITE;
+
+	weight = row_group_weight();
+
+	if (data_dir == READ) {
+		if (weight >= rd->hp_group_weight)
+			return ROWQ_PRIO_HIGH_READ;
+		if (weight <= rd->lp_group_weight)
+			return ROWQ_PRIO_LOW_READ;
+		return ROWQ_PRIO_REG_READ;
+	}
+
+	if (weight >= rd->hp_group_weight)
+		return ROWQ_PRIO_HIGH_SWRITE;
+	if (weight <= rd->lp_group_weight)
+		return ROWQ_PRIO_LOW_SWRITE;
+	return ROWQ_PRIO_REG_SWRITE;
 }
 
 /*
@@ -622,11 +689,11 @@ static int
 row_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
 {
 	struct row_data *rd = (struct row_data *)q->elevator->elevator_data;
+	enum row_queue_prio prio = get_queue_type(rd, rq);
 	unsigned long flags;
 
 	spin_lock_irqsave(q->queue_lock, flags);
-	rq->elevator_private[0] =
-		(void *)(&rd->row_queues[get_queue_type(rq)]);
+	rq->elevator_private[0] = (void *)(&rd->row_queues[prio]);
 	spin_unlock_irqrestore(q->queue_lock, flags);
 
 	return 0;
@@ -671,6 +738,8 @@ SHOW_FUNCTION(row_lp_swrite_quantum_show,
 	rowd->row_queues[ROWQ_PRIO_LOW_SWRITE].disp_quantum, 0);
 SHOW_FUNCTION(row_read_idle_show, rowd->read_idle.idle_time, 1);
 SHOW_FUNCTION(row_read_idle_freq_show, rowd->read_idle.freq, 0);
+SHOW_FUNCTION(row_hp_group_weight_show, rowd->hp_group_weight, 0);
+SHOW_FUNCTION(row_lp_group_weight_show, rowd->lp_group_weight, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -711,6 +780,10 @@ STORE_FUNCTION(row_lp_swrite_quantum_store,
 			1, INT_MAX, 1);
 STORE_FUNCTION(row_read_idle_store, &rowd->read_idle.idle_time, 1, INT_MAX, 1);
 STORE_FUNCTION(row_read_idle_freq_store, &rowd->read_idle.freq, 1, INT_MAX, 0);
+STORE_FUNCTION(row_hp_group_weight_store, &rowd->hp_group_weight,
+			0, INT_MAX, 0);
+STORE_FUNCTION(row_lp_group_weight_store, &rowd->lp_group_weight,
+			0, INT_MAX, 0);
 
 #undef STORE_FUNCTION
 
@@ -728,6 +801,8 @@ static struct elv_fs_entry row_attrs[] = {
 	ROW_ATTR(lp_swrite_quantum),
 	ROW_ATTR(read_idle),
 	ROW_ATTR(read_idle_freq),
+	ROW_ATTR(hp_group_weight),
+	ROW_ATTR(lp_group_weight),
 	__ATTR_NULL
 };
 
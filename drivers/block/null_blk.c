@@ -0,0 +1,343 @@
+/*
+ * Null block device driver.
+ *
+ * Completes every request without moving any data, so that the cost of
+ * the block layer itself can be measured. Devices can be driven through
+ * the bio-based path, which runs without any queue lock, through per-cpu
+ * software queues that hand bios over in batches, or through the request
+ * path with an elevator, and complete I/O inline, from the block softirq
+ * or from a per-cpu timer to emulate device latency.
+ *
+ * See Documentation/block/null_blk.txt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+
+enum {
+	NULL_Q_BIO	= 0,
+	NULL_Q_RQ	= 1,
+	NULL_Q_SWQ	= 2,
+};
+
+enum {
+	NULL_IRQ_NONE		= 0,
+	NULL_IRQ_SOFTIRQ	= 1,
+	NULL_IRQ_TIMER		= 2,
+};
+
+struct nullb {
+	struct list_head list;
+	unsigned int index;
+	struct request_queue *q;
+	struct gendisk *disk;
+	spinlock_t lock;
+};
+
+/*
+ * I/O completed from the timer is queued on the cpu that submitted it and
+ * completed there, so that completions are spread like submissions.
+ */
+struct completion_queue {
+	struct bio_list bios;
+	struct list_head rqs;
+	struct hrtimer timer;
+};
+
+static DEFINE_PER_CPU(struct completion_queue, completion_queues);
+
+static LIST_HEAD(nullb_list);
+static int null_major;
+static int nullb_indexes;
+
+static int queue_mode = NULL_Q_BIO;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "Block interface to use (0=bio,1=rq,2=swq)");
+
+static int gb = 250;
+module_param(gb, int, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size in GB");
+
+static int bs = 512;
+module_param(bs, int, S_IRUGO);
+MODULE_PARM_DESC(bs, "Block size (in bytes)");
+
+static int nr_devices = 2;
+module_param(nr_devices, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices to register");
+
+static int irqmode = NULL_IRQ_SOFTIRQ;
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "IRQ completion handler. 0-none, 1-softirq, 2-timer");
+
+static int completion_nsec = 10000;
+module_param(completion_nsec, int, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Time in ns to complete a request in hardware. Default: 10,000ns");
+
+static enum hrtimer_restart null_cmd_timer_expired(struct hrtimer *timer)
+{
+	struct completion_queue *cq =
+		container_of(timer, struct completion_queue, timer);
+	struct bio_list bios;
+	struct bio *bio;
+	LIST_HEAD(rqs);
+
+	/* Runs with interrupts off on the cpu that queued the I/O */
+	bio_list_init(&bios);
+	bio_list_merge(&bios, &cq->bios);
+	bio_list_init(&cq->bios);
+	list_splice_init(&cq->rqs, &rqs);
+
+	while ((bio = bio_list_pop(&bios)))
+		bio_endio(bio, 0);
+
+	while (!list_empty(&rqs)) {
+		struct request *rq = list_first_entry(&rqs, struct request,
+						      queuelist);
+
+		list_del_init(&rq->queuelist);
+		blk_end_request_all(rq, 0);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+static void null_cmd_end_timer(struct bio_list *bios, struct request *rq)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+	bool idle;
+
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+	idle = bio_list_empty(&cq->bios) && list_empty(&cq->rqs);
+
+	if (bios)
+		bio_list_merge(&cq->bios, bios);
+	else
+		list_add_tail(&rq->queuelist, &cq->rqs);
+
+	if (idle)
+		hrtimer_start(&cq->timer, ktime_set(0, completion_nsec),
+			      HRTIMER_MODE_REL_PINNED);
+	local_irq_restore(flags);
+}
+
+static void null_softirq_done_fn(struct request *rq)
+{
+	blk_end_request_all(rq, 0);
+}
+
+static void null_swq_request(struct request_queue *q, struct bio_list *bios)
+{
+	struct bio *bio;
+
+	if (irqmode == NULL_IRQ_TIMER) {
+		null_cmd_end_timer(bios, NULL);
+		return;
+	}
+
+	while ((bio = bio_list_pop(bios)))
+		bio_endio(bio, 0);
+}
+
+static int null_queue_bio(struct request_queue *q, struct bio *bio)
+{
+	struct bio_list bios;
+
+	bio_list_init(&bios);
+	bio_list_add(&bios, bio);
+	null_swq_request(q, &bios);
+
+	return 0;
+}
+
+static void null_request_fn(struct request_queue *q)
+{
+	struct request *rq;
+
+	while ((rq = blk_fetch_request(q)) != NULL) {
+		switch (irqmode) {
+		case NULL_IRQ_NONE:
+			__blk_end_request_all(rq, 0);
+			break;
+		case NULL_IRQ_SOFTIRQ:
+			blk_complete_request(rq);
+			break;
+		case NULL_IRQ_TIMER:
+			null_cmd_end_timer(NULL, rq);
+			break;
+		}
+	}
+}
+
+static int null_open(struct block_device *bdev, fmode_t mode)
+{
+	return 0;
+}
+
+static int null_release(struct gendisk *disk, fmode_t mode)
+{
+	return 0;
+}
+
+static const struct block_device_operations null_fops = {
+	.owner =	THIS_MODULE,
+	.open =		null_open,
+	.release =	null_release,
+};
+
+static void null_del_dev(struct nullb *nullb)
+{
+	list_del_init(&nullb->list);
+
+	del_gendisk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+	put_disk(nullb->disk);
+	kfree(nullb);
+}
+
+static int null_add_dev(void)
+{
+	struct gendisk *disk;
+	struct nullb *nullb;
+	sector_t size;
+
+	nullb = kzalloc(sizeof(*nullb), GFP_KERNEL);
+	if (!nullb)
+		return -ENOMEM;
+
+	spin_lock_init(&nullb->lock);
+
+	if (queue_mode == NULL_Q_BIO) {
+		nullb->q = blk_alloc_queue(GFP_KERNEL);
+		if (!nullb->q)
+			goto out_free_nullb;
+		blk_queue_make_request(nullb->q, null_queue_bio);
+	} else if (queue_mode == NULL_Q_SWQ) {
+		nullb->q = blk_alloc_queue(GFP_KERNEL);
+		if (!nullb->q)
+			goto out_free_nullb;
+		if (blk_queue_swq(nullb->q, null_swq_request))
+			goto out_cleanup_queue;
+	} else {
+		nullb->q = blk_init_queue(null_request_fn, &nullb->lock);
+		if (!nullb->q)
+			goto out_free_nullb;
+		blk_queue_softirq_done(nullb->q, null_softirq_done_fn);
+	}
+
+	nullb->q->queuedata = nullb;
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, nullb->q);
+
+	disk = nullb->disk = alloc_disk(1);
+	if (!disk)
+		goto out_cleanup_queue;
+
+	nullb->index = nullb_indexes++;
+	list_add_tail(&nullb->list, &nullb_list);
+
+	blk_queue_logical_block_size(nullb->q, bs);
+	blk_queue_physical_block_size(nullb->q, bs);
+
+	size = gb * 1024 * 1024 * 1024ULL;
+	sector_div(size, bs);
+	set_capacity(disk, size * (bs >> 9));
+
+	disk->flags |= GENHD_FL_EXT_DEVT | GENHD_FL_SUPPRESS_PARTITION_INFO;
+	disk->major		= null_major;
+	disk->first_minor	= nullb->index;
+	disk->fops		= &null_fops;
+	disk->private_data	= nullb;
+	disk->queue		= nullb->q;
+	sprintf(disk->disk_name, "nullb%d", nullb->index);
+	add_disk(disk);
+	return 0;
+
+out_cleanup_queue:
+	blk_cleanup_queue(nullb->q);
+out_free_nullb:
+	kfree(nullb);
+	return -ENOMEM;
+}
+
+static int __init null_init(void)
+{
+	unsigned int i;
+
+	if (bs > PAGE_SIZE || bs < 512 || !is_power_of_2(bs)) {
+		pr_warn("null_blk: invalid block size\n");
+		pr_warn("null_blk: defaults block size to 512\n");
+		bs = 512;
+	}
+
+	if (queue_mode < NULL_Q_BIO || queue_mode > NULL_Q_SWQ) {
+		pr_warn("null_blk: invalid queue_mode, using bio\n");
+		queue_mode = NULL_Q_BIO;
+	}
+
+	if (irqmode < NULL_IRQ_NONE || irqmode > NULL_IRQ_TIMER) {
+		pr_warn("null_blk: invalid irqmode, using softirq\n");
+		irqmode = NULL_IRQ_SOFTIRQ;
+	}
+
+	for_each_possible_cpu(i) {
+		struct completion_queue *cq = &per_cpu(completion_queues, i);
+
+		bio_list_init(&cq->bios);
+		INIT_LIST_HEAD(&cq->rqs);
+		hrtimer_init(&cq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		cq->timer.function = null_cmd_timer_expired;
+	}
+
+	null_major = register_blkdev(0, "nullb");
+	if (null_major < 0)
+		return null_major;
+
+	for (i = 0; i < nr_devices; i++) {
+		if (null_add_dev()) {
+			while (!list_empty(&nullb_list))
+				null_del_dev(list_entry(nullb_list.next,
+							struct nullb, list));
+			unregister_blkdev(null_major, "nullb");
+			return -EINVAL;
+		}
+	}
+
+	pr_info("null: module loaded\n");
+	return 0;
+}
+
+static void __exit null_exit(void)
+{
+	struct nullb *nullb;
+	unsigned int i;
+
+	unregister_blkdev(null_major, "nullb");
+
+	while (!list_empty(&nullb_list)) {
+		nullb = list_entry(nullb_list.next, struct nullb, list);
+		null_del_dev(nullb);
+	}
+
+	for_each_possible_cpu(i)
+		hrtimer_cancel(&per_cpu(completion_queues, i).timer);
+}
+
+module_init(null_init);
+module_exit(null_exit);
+
+MODULE_LICENSE("GPL");
@@ -30,6 +30,7 @@
 #include <linux/kthread.h>
 #include <linux/slab.h>
 #include <linux/input.h>
+#include <linux/notifier.h>
 #include <asm/cputime.h>
 
 #define CREATE_TRACE_POINTS
@@ -123,6 +124,14 @@ static u64 boostpulse_endtime;
 #define DEFAULT_TIMER_SLACK (4 * DEFAULT_TIMER_RATE)
 static int timer_slack_val = DEFAULT_TIMER_SLACK;
 
+/*
+ * Use the scheduler's view of the load as well as the sampled busy time:
+ * scale the sampled load by the average number of runnable tasks when
+ * tasks are queueing, and raise speed as soon as work is woken onto a
+ * busy CPU or migrates from a faster one, instead of at the next sample.
+ */
+static int use_sched_load_val;
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -311,6 +320,19 @@ static void cpufreq_interactive_timer(unsigned long data)
 
 	do_div(cputime_speedadj, delta_time);
 	loadadjfreq = (unsigned int)cputime_speedadj * 100;
+
+	if (use_sched_load_val) {
+		/*
+		 * More than one runnable task on average means the CPU was
+		 * busy and work was still waiting: predict the load needed
+		 * to serve the whole queue.
+		 */
+		unsigned long nr = avg_nr_running_cpu(data);
+
+		if (nr > FIXED_1)
+			loadadjfreq = min_t(u64, (u64)loadadjfreq * nr >> FSHIFT,
+					    UINT_MAX);
+	}
 	cpu_load = loadadjfreq / pcpu->target_freq;
 	boosted = boost_val || now < boostpulse_endtime;
 
@@ -559,6 +581,103 @@ static void cpufreq_interactive_boost(void)
 		wake_up_process(speedchange_task);
 }
 
+/*
+ * A task was woken on hint->dest_cpu. Raise that CPU to hispeed_freq right
+ * away if the task has to queue behind other work, or to the speed of the
+ * CPU it came from if it migrated from a faster one. Called from the
+ * waker's context, which may be atomic.
+ */
+static int cpufreq_interactive_sched_wake(
+	struct notifier_block *nb, unsigned long val, void *data)
+{
+	struct sched_wake_hint *hint = data;
+	struct cpufreq_interactive_cpuinfo *pcpu;
+	unsigned int new_freq = 0;
+	unsigned long flags;
+	u64 now;
+
+	if (!use_sched_load_val || hint->task == speedchange_task)
+		return NOTIFY_DONE;
+
+	pcpu = &per_cpu(cpuinfo, hint->dest_cpu);
+	if (!down_read_trylock(&pcpu->enable_sem))
+		return NOTIFY_DONE;
+	if (!pcpu->governor_enabled)
+		goto exit;
+
+	if (nr_running_cpu(hint->dest_cpu) > 1)
+		new_freq = hispeed_freq;
+
+	if (hint->src_cpu != hint->dest_cpu) {
+		unsigned int src_freq =
+			per_cpu(cpuinfo, hint->src_cpu).target_freq;
+
+		if (src_freq > new_freq)
+			new_freq = src_freq;
+	}
+
+	if (new_freq > pcpu->policy->max)
+		new_freq = pcpu->policy->max;
+	if (new_freq <= pcpu->target_freq)
+		goto exit;
+
+	now = ktime_to_us(ktime_get());
+	trace_cpufreq_interactive_target(hint->dest_cpu, 0, pcpu->target_freq,
+					 pcpu->policy->cur, new_freq);
+
+	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
+	pcpu->target_freq = new_freq;
+	pcpu->hispeed_validate_time = now;
+	pcpu->floor_freq = new_freq;
+	pcpu->floor_validate_time = now;
+	cpumask_set_cpu(hint->dest_cpu, &speedchange_cpumask);
+	spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+	wake_up_process(speedchange_task);
+
+exit:
+	up_read(&pcpu->enable_sem);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block cpufreq_interactive_sched_wake_nb = {
+	.notifier_call = cpufreq_interactive_sched_wake,
+};
+
+/*
+ * The wakeup hook costs a notifier call in every try_to_wake_up(), so it
+ * is only registered while the governor is running with use_sched_load
+ * set. This has its own lock rather than gov_lock, which is held while
+ * the sysfs group holding use_sched_load is removed.
+ */
+static DEFINE_MUTEX(sched_wake_lock);
+static bool sched_wake_gov_active;
+static bool sched_wake_registered;
+
+/* Called with sched_wake_lock held */
+static void cpufreq_interactive_sched_wake_update(void)
+{
+	bool want = sched_wake_gov_active && use_sched_load_val;
+
+	if (want == sched_wake_registered)
+		return;
+
+	if (want)
+		atomic_notifier_chain_register(&sched_wake_notifier_head,
+					&cpufreq_interactive_sched_wake_nb);
+	else
+		atomic_notifier_chain_unregister(&sched_wake_notifier_head,
+					&cpufreq_interactive_sched_wake_nb);
+	sched_wake_registered = want;
+}
+
+static void cpufreq_interactive_sched_wake_enable(bool active)
+{
+	mutex_lock(&sched_wake_lock);
+	sched_wake_gov_active = active;
+	cpufreq_interactive_sched_wake_update();
+	mutex_unlock(&sched_wake_lock);
+}
+
 static int cpufreq_interactive_notifier(
 	struct notifier_block *nb, unsigned long val, void *data)
 {
@@ -987,6 +1106,32 @@ static ssize_t store_boostpulse_duration(
 
 define_one_global_rw(boostpulse_duration);
 
+static ssize_t show_use_sched_load(
+	struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", use_sched_load_val);
+}
+
+static ssize_t store_use_sched_load(
+	struct kobject *kobj, struct attribute *attr, const char *buf,
+	size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&sched_wake_lock);
+	use_sched_load_val = !!val;
+	cpufreq_interactive_sched_wake_update();
+	mutex_unlock(&sched_wake_lock);
+	return count;
+}
+
+define_one_global_rw(use_sched_load);
+
 static struct attribute *interactive_attributes[] = {
 	&target_loads_attr.attr,
 	&hispeed_freq_attr.attr,
@@ -999,6 +1144,7 @@ static struct attribute *interactive_attributes[] = {
 	&boost.attr,
 	&boostpulse.attr,
 	&boostpulse_duration.attr,
+	&use_sched_load.attr,
 	NULL,
 };
 
@@ -1094,6 +1240,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 				__func__);
 
 		idle_notifier_register(&cpufreq_interactive_idle_nb);
+		cpufreq_interactive_sched_wake_enable(true);
 		cpufreq_register_notifier(
 			&cpufreq_notifier_block, CPUFREQ_TRANSITION_NOTIFIER);
 		mutex_unlock(&gov_lock);
@@ -1119,6 +1266,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 
 		cpufreq_unregister_notifier(
 			&cpufreq_notifier_block, CPUFREQ_TRANSITION_NOTIFIER);
+		cpufreq_interactive_sched_wake_enable(false);
 		idle_notifier_unregister(&cpufreq_interactive_idle_nb);
 		input_unregister_handler(&cpufreq_interactive_input_handler);
 		sysfs_remove_group(cpufreq_global_kobject,
@@ -108,16 +108,35 @@ struct tap_filter {
 	unsigned char	addr[FLT_EXACT_COUNT][ETH_ALEN];
 };
 
+/* Maximum number of queues a multiqueue (IFF_MULTI_QUEUE) device can have */
+#define MAX_TAP_QUEUES	8
+
+/* NAPI weight of the per-queue receive context (IFF_NAPI) */
+#define TUN_NAPI_WEIGHT	64
+
+/* A tun_file is one queue of a device.  Its socket carries the queue's
+ * read queue and send buffer accounting, and is what tun_get_socket()
+ * hands out.  tun is protected by RCU and the RTNL lock; it is NULL
+ * while the file is not attached.
+ */
 struct tun_file {
-	atomic_t count;
-	struct tun_struct *tun;
-	struct net *net;
+	struct sock		sk;
+	struct socket		socket;
+	struct socket_wq	wq;
+	struct tun_struct __rcu	*tun;
+	struct net		*net;
+	struct fasync_struct	*fasync;
+	/* only TUN_FASYNC, TUN_NAPI and TUN_MULTI_FRAME are used */
+	unsigned int		flags;
+	u16			queue_index;
+	struct napi_struct	napi;
 };
 
 struct tun_sock;
 
 struct tun_struct {
-	struct tun_file		*tfile;
+	struct tun_file __rcu	*tfiles[MAX_TAP_QUEUES];
+	unsigned int		numqueues;
 	unsigned int 		flags;
 	uid_t			owner;
 	gid_t			group;
@@ -126,13 +145,14 @@ struct tun_struct {
 	u32			set_features;
 #define TUN_USER_FEATURES (NETIF_F_HW_CSUM|NETIF_F_TSO_ECN|NETIF_F_TSO| \
 			  NETIF_F_TSO6|NETIF_F_UFO)
-	struct fasync_struct	*fasync;
 
 	struct tap_filter       txflt;
-	struct socket		socket;
-	struct socket_wq	wq;
+	/* Device-wide socket: carries the security label and frees the
+	 * net device when the last reference goes away. */
+	struct sock		*sk;
 
 	int			vnet_hdr_sz;
+	int			sndbuf;
 
 #ifdef TUN_DEBUG
 	int debug;
@@ -149,81 +169,161 @@ static inline struct tun_sock *tun_sk(struct sock *sk)
 	return container_of(sk, struct tun_sock, sk);
 }
 
-static int tun_attach(struct tun_struct *tun, struct file *file)
+static void tun_set_real_num_queues(struct tun_struct *tun)
+{
+	/* The core does not allow zero queues; a device without any
+	 * attached queue simply keeps the last count and drops. */
+	if (!tun->numqueues)
+		return;
+
+	netif_set_real_num_tx_queues(tun->dev, tun->numqueues);
+	netif_set_real_num_rx_queues(tun->dev, tun->numqueues);
+}
+
+static int tun_napi_poll(struct napi_struct *napi, int budget);
+
+static void tun_napi_init(struct tun_struct *tun, struct tun_file *tfile)
+{
+	netif_napi_add(tun->dev, &tfile->napi, tun_napi_poll,
+		       TUN_NAPI_WEIGHT);
+	napi_enable(&tfile->napi);
+}
+
+/* Called once the queue is no longer reachable from the xmit path. */
+static void tun_queue_purge(struct tun_file *tfile)
+{
+	if (tfile->flags & TUN_NAPI) {
+		napi_disable(&tfile->napi);
+		netif_napi_del(&tfile->napi);
+	}
+
+	skb_queue_purge(&tfile->sk.sk_receive_queue);
+	skb_queue_purge(&tfile->sk.sk_write_queue);
+}
+
+static int tun_attach(struct tun_struct *tun, struct file *file,
+		      bool napi, bool multi_frame)
 {
 	struct tun_file *tfile = file->private_data;
 	int err;
 
 	ASSERT_RTNL();
 
-	netif_tx_lock_bh(tun->dev);
-
 	err = -EINVAL;
-	if (tfile->tun)
+	if (rtnl_dereference(tfile->tun))
 		goto out;
 
 	err = -EBUSY;
-	if (tun->tfile)
+	if (!(tun->flags & TUN_TAP_MQ) && tun->numqueues == 1)
+		goto out;
+
+	err = -E2BIG;
+	if (tun->numqueues == tun->dev->num_tx_queues)
 		goto out;
 
 	err = 0;
-	tfile->tun = tun;
-	tun->tfile = tfile;
-	tun->socket.file = file;
+	tfile->queue_index = tun->numqueues;
+	tfile->sk.sk_sndbuf = tun->sndbuf;
+
+	tfile->flags &= ~(TUN_NAPI | TUN_MULTI_FRAME);
+	if (napi) {
+		tfile->flags |= TUN_NAPI;
+		tun_napi_init(tun, tfile);
+	}
+	if (multi_frame)
+		tfile->flags |= TUN_MULTI_FRAME;
+
+	rcu_assign_pointer(tfile->tun, tun);
+	rcu_assign_pointer(tun->tfiles[tun->numqueues], tfile);
+	tun->numqueues++;
+	tun_set_real_num_queues(tun);
+
 	netif_carrier_on(tun->dev);
-	dev_hold(tun->dev);
-	sock_hold(tun->socket.sk);
-	atomic_inc(&tfile->count);
 
 out:
-	netif_tx_unlock_bh(tun->dev);
 	return err;
 }
 
-static void __tun_detach(struct tun_struct *tun)
+static void __tun_detach(struct tun_file *tfile)
 {
-	/* Detach from net device */
-	netif_tx_lock_bh(tun->dev);
-	netif_carrier_off(tun->dev);
-	tun->tfile = NULL;
-	tun->socket.file = NULL;
-	netif_tx_unlock_bh(tun->dev);
+	struct tun_struct *tun = rtnl_dereference(tfile->tun);
+	struct tun_file *ntfile;
+	struct net_device *dev;
+	u16 index;
+
+	if (!tun)
+		return;
 
-	/* Drop read queue */
-	skb_queue_purge(&tun->socket.sk->sk_receive_queue);
+	dev = tun->dev;
+	index = tfile->queue_index;
+	BUG_ON(index >= tun->numqueues);
+
+	/* Move the last queue into the hole left by this one */
+	ntfile = rtnl_dereference(tun->tfiles[tun->numqueues - 1]);
+	rcu_assign_pointer(tun->tfiles[index], ntfile);
+	ntfile->queue_index = index;
+	--tun->numqueues;
+	RCU_INIT_POINTER(tun->tfiles[tun->numqueues], NULL);
+	RCU_INIT_POINTER(tfile->tun, NULL);
+
+	synchronize_net();
+	tun_queue_purge(tfile);
+
+	if (tun->numqueues) {
+		tun_set_real_num_queues(tun);
+		/* A moved queue may have been left stopped */
+		if (netif_running(dev))
+			netif_tx_wake_all_queues(dev);
+	} else {
+		netif_carrier_off(dev);
 
-	/* Drop the extra count on the net device */
-	dev_put(tun->dev);
+		/* If desirable, unregister the netdevice. */
+		if (!(tun->flags & TUN_PERSIST) &&
+		    dev->reg_state == NETREG_REGISTERED)
+			unregister_netdevice(dev);
+	}
 }
 
-static void tun_detach(struct tun_struct *tun)
+/* Detach every queue; called when the net device goes away. */
+static void tun_detach_all(struct net_device *dev)
 {
-	rtnl_lock();
-	__tun_detach(tun);
-	rtnl_unlock();
+	struct tun_struct *tun = netdev_priv(dev);
+	struct tun_file *tfile;
+	unsigned int i, n = tun->numqueues;
+
+	for (i = 0; i < n; i++) {
+		tfile = rtnl_dereference(tun->tfiles[i]);
+		BUG_ON(!tfile);
+		/* Inform the methods they need to stop using the dev. */
+		wake_up_all(&tfile->wq.wait);
+		RCU_INIT_POINTER(tfile->tun, NULL);
+	}
+	tun->numqueues = 0;
+
+	synchronize_net();
+	for (i = 0; i < n; i++) {
+		tfile = rtnl_dereference(tun->tfiles[i]);
+		tun_queue_purge(tfile);
+		RCU_INIT_POINTER(tun->tfiles[i], NULL);
+	}
 }
 
 static struct tun_struct *__tun_get(struct tun_file *tfile)
 {
-	struct tun_struct *tun = NULL;
+	struct tun_struct *tun;
 
-	if (atomic_inc_not_zero(&tfile->count))
-		tun = tfile->tun;
+	rcu_read_lock();
+	tun = rcu_dereference(tfile->tun);
+	if (tun)
+		dev_hold(tun->dev);
+	rcu_read_unlock();
 
 	return tun;
 }
 
-static struct tun_struct *tun_get(struct file *file)
-{
-	return __tun_get(file->private_data);
-}
-
 static void tun_put(struct tun_struct *tun)
 {
-	struct tun_file *tfile = tun->tfile;
-
-	if (atomic_dec_and_test(&tfile->count))
-		tun_detach(tfile->tun);
+	dev_put(tun->dev);
 }
 
 /* TAP filtering */
@@ -343,36 +443,27 @@ static const struct ethtool_ops tun_ethtool_ops;
 /* Net device detach from fd. */
 static void tun_net_uninit(struct net_device *dev)
 {
-	struct tun_struct *tun = netdev_priv(dev);
-	struct tun_file *tfile = tun->tfile;
-
-	/* Inform the methods they need to stop using the dev.
-	 */
-	if (tfile) {
-		wake_up_all(&tun->wq.wait);
-		if (atomic_dec_and_test(&tfile->count))
-			__tun_detach(tun);
-	}
+	tun_detach_all(dev);
 }
 
 static void tun_free_netdev(struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
 
-	sock_put(tun->socket.sk);
+	sock_put(tun->sk);
 }
 
 /* Net device open. */
 static int tun_net_open(struct net_device *dev)
 {
-	netif_start_queue(dev);
+	netif_tx_start_all_queues(dev);
 	return 0;
 }
 
 /* Net device close. */
 static int tun_net_close(struct net_device *dev)
 {
-	netif_stop_queue(dev);
+	netif_tx_stop_all_queues(dev);
 	return 0;
 }
 
@@ -380,11 +471,17 @@ static int tun_net_close(struct net_device *dev)
 static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
+	unsigned int numqueues = ACCESS_ONCE(tun->numqueues);
+	int txq = skb->queue_mapping;
+	struct tun_file *tfile;
+
+	rcu_read_lock();
+	tfile = rcu_dereference(tun->tfiles[txq]);
 
 	tun_debug(KERN_INFO, tun, "tun_net_xmit %d\n", skb->len);
 
 	/* Drop packet if interface is not attached */
-	if (!tun->tfile)
+	if (!tfile || txq >= numqueues)
 		goto drop;
 
 	/* Drop if the filter does not like it.
@@ -393,15 +490,17 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	if (!check_filter(&tun->txflt, skb))
 		goto drop;
 
-	if (tun->socket.sk->sk_filter &&
-	    sk_filter(tun->socket.sk, skb))
+	if (tfile->socket.sk->sk_filter &&
+	    sk_filter(tfile->socket.sk, skb))
 		goto drop;
 
-	if (skb_queue_len(&tun->socket.sk->sk_receive_queue) >= dev->tx_queue_len) {
+	/* The read queue length is shared out between the queues */
+	if (skb_queue_len(&tfile->socket.sk->sk_receive_queue) >=
+	    dev->tx_queue_len / numqueues) {
 		if (!(tun->flags & TUN_ONE_QUEUE)) {
 			/* Normal queueing mode. */
 			/* Packet scheduler handles dropping of further packets. */
-			netif_stop_queue(dev);
+			netif_tx_stop_queue(netdev_get_tx_queue(dev, txq));
 
 			/* We won't see all dropped packets individually, so overrun
 			 * error is more appropriate. */
@@ -418,21 +517,44 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	skb_orphan(skb);
 
 	/* Enqueue packet */
-	skb_queue_tail(&tun->socket.sk->sk_receive_queue, skb);
+	skb_queue_tail(&tfile->socket.sk->sk_receive_queue, skb);
 
 	/* Notify and wake up reader process */
-	if (tun->flags & TUN_FASYNC)
-		kill_fasync(&tun->fasync, SIGIO, POLL_IN);
-	wake_up_interruptible_poll(&tun->wq.wait, POLLIN |
+	if (tfile->flags & TUN_FASYNC)
+		kill_fasync(&tfile->fasync, SIGIO, POLL_IN);
+	wake_up_interruptible_poll(&tfile->wq.wait, POLLIN |
 				   POLLRDNORM | POLLRDBAND);
+
+	rcu_read_unlock();
 	return NETDEV_TX_OK;
 
 drop:
 	dev->stats.tx_dropped++;
 	kfree_skb(skb);
+	rcu_read_unlock();
 	return NETDEV_TX_OK;
 }
 
+/* Spread flows over the attached queues by their hash, so that each
+ * reader thread sees whole flows. */
+static u16 tun_select_queue(struct net_device *dev, struct sk_buff *skb)
+{
+	struct tun_struct *tun = netdev_priv(dev);
+	u32 numqueues = ACCESS_ONCE(tun->numqueues);
+	u32 txq;
+
+	if (numqueues <= 1)
+		return 0;
+
+	txq = skb_get_rxhash(skb);
+	if (txq)
+		txq = ((u64)txq * numqueues) >> 32;
+	else if (skb_rx_queue_recorded(skb))
+		txq = skb_get_rx_queue(skb) % numqueues;
+
+	return txq;
+}
+
 static void tun_net_mclist(struct net_device *dev)
 {
 	/*
@@ -482,6 +604,7 @@ static const struct net_device_ops tun_netdev_ops = {
 	.ndo_open		= tun_net_open,
 	.ndo_stop		= tun_net_close,
 	.ndo_start_xmit		= tun_net_xmit,
+	.ndo_select_queue	= tun_select_queue,
 	.ndo_change_mtu		= tun_net_change_mtu,
 	.ndo_fix_features	= tun_net_fix_features,
 #ifdef CONFIG_NET_POLL_CONTROLLER
@@ -494,6 +617,7 @@ static const struct net_device_ops tap_netdev_ops = {
 	.ndo_open		= tun_net_open,
 	.ndo_stop		= tun_net_close,
 	.ndo_start_xmit		= tun_net_xmit,
+	.ndo_select_queue	= tun_select_queue,
 	.ndo_change_mtu		= tun_net_change_mtu,
 	.ndo_fix_features	= tun_net_fix_features,
 	.ndo_set_multicast_list	= tun_net_mclist,
@@ -550,11 +674,11 @@ static unsigned int tun_chr_poll(struct file *file, poll_table * wait)
 	if (!tun)
 		return POLLERR;
 
-	sk = tun->socket.sk;
+	sk = tfile->socket.sk;
 
 	tun_debug(KERN_INFO, tun, "tun_chr_poll\n");
 
-	poll_wait(file, &tun->wq.wait, wait);
+	poll_wait(file, &tfile->wq.wait, wait);
 
 	if (!skb_queue_empty(&sk->sk_receive_queue))
 		mask |= POLLIN | POLLRDNORM;
@@ -573,11 +697,11 @@ static unsigned int tun_chr_poll(struct file *file, poll_table * wait)
 
 /* prepad is the amount to reserve at front.  len is length after that.
  * linear is a hint as to how much to copy (usually headers). */
-static struct sk_buff *tun_alloc_skb(struct tun_struct *tun,
+static struct sk_buff *tun_alloc_skb(struct tun_file *tfile,
 				     size_t prepad, size_t len,
 				     size_t linear, int noblock)
 {
-	struct sock *sk = tun->socket.sk;
+	struct sock *sk = tfile->socket.sk;
 	struct sk_buff *skb;
 	int err;
 
@@ -600,10 +724,69 @@ static struct sk_buff *tun_alloc_skb(struct tun_struct *tun,
 	return skb;
 }
 
-/* Get packet from user space buffer */
-static ssize_t tun_get_user(struct tun_struct *tun,
+/* Per-queue NAPI context: frames written by user space are queued on
+ * the socket's (otherwise unused) write queue and fed to GRO from here.
+ */
+static int tun_napi_receive(struct napi_struct *napi, int budget)
+{
+	struct tun_file *tfile = container_of(napi, struct tun_file, napi);
+	struct sk_buff_head *queue = &tfile->sk.sk_write_queue;
+	struct sk_buff_head process_queue;
+	struct sk_buff *skb;
+	int received = 0;
+
+	__skb_queue_head_init(&process_queue);
+
+	spin_lock(&queue->lock);
+	skb_queue_splice_tail_init(queue, &process_queue);
+	spin_unlock(&queue->lock);
+
+	while (received < budget && (skb = __skb_dequeue(&process_queue))) {
+		napi_gro_receive(napi, skb);
+		++received;
+	}
+
+	if (!skb_queue_empty(&process_queue)) {
+		spin_lock(&queue->lock);
+		skb_queue_splice(&process_queue, queue);
+		spin_unlock(&queue->lock);
+	}
+
+	return received;
+}
+
+static int tun_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct tun_file *tfile = container_of(napi, struct tun_file, napi);
+	int received;
+
+	received = tun_napi_receive(napi, budget);
+	if (received < budget) {
+		napi_complete(napi);
+		/* A writer may have queued a frame after we emptied the
+		 * queue but before NAPI_STATE_SCHED was cleared, in which
+		 * case its napi_schedule() was a no-op. */
+		smp_mb();
+		if (!skb_queue_empty(&tfile->sk.sk_write_queue))
+			napi_reschedule(napi);
+	}
+
+	return received;
+}
+
+static void tun_napi_schedule(struct tun_file *tfile)
+{
+	local_bh_disable();
+	napi_schedule(&tfile->napi);
+	local_bh_enable();
+}
+
+/* Get packet from user space buffer.  If more is set the caller is going
+ * to hand us further frames right away, so the NAPI context is only kicked
+ * once a full budget is pending. */
+static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 			    const struct iovec *iv, size_t count,
-			    int noblock)
+			    int noblock, bool more)
 {
 	struct tun_pi pi = { 0, cpu_to_be16(ETH_P_IP) };
 	struct sk_buff *skb;
@@ -643,7 +826,7 @@ static ssize_t tun_get_user(struct tun_struct *tun,
 			return -EINVAL;
 	}
 
-	skb = tun_alloc_skb(tun, align, len, gso.hdr_len, noblock);
+	skb = tun_alloc_skb(tfile, align, len, gso.hdr_len, noblock);
 	if (IS_ERR(skb)) {
 		if (PTR_ERR(skb) != -EAGAIN)
 			tun->dev->stats.rx_dropped++;
@@ -724,19 +907,74 @@ static ssize_t tun_get_user(struct tun_struct *tun,
 		skb_shinfo(skb)->gso_segs = 0;
 	}
 
-	netif_rx_ni(skb);
+	skb_record_rx_queue(skb, tfile->queue_index);
 
 	tun->dev->stats.rx_packets++;
 	tun->dev->stats.rx_bytes += len;
 
+	if (tfile->flags & TUN_NAPI) {
+		struct sk_buff_head *queue = &tfile->sk.sk_write_queue;
+		int queue_len;
+
+		/* GRO only coalesces segments with a verified checksum;
+		 * the data is still hot from the copy above. */
+		if (skb->ip_summed == CHECKSUM_NONE) {
+			skb->csum = skb_checksum(skb, 0, skb->len, 0);
+			skb->ip_summed = CHECKSUM_COMPLETE;
+		}
+
+		spin_lock_bh(&queue->lock);
+		__skb_queue_tail(queue, skb);
+		queue_len = skb_queue_len(queue);
+		spin_unlock(&queue->lock);
+
+		if (!more || queue_len > TUN_NAPI_WEIGHT)
+			napi_schedule(&tfile->napi);
+
+		local_bh_enable();
+	} else
+		netif_rx_ni(skb);
+
 	return count;
 }
 
+/* IFF_MULTI_FRAME: every iovec segment is a complete frame, including its
+ * tun_pi and virtio_net_hdr if enabled.  Returns the number of bytes of
+ * the frames that were accepted, or the error of the first one.
+ */
+static ssize_t tun_get_user_frames(struct tun_struct *tun,
+				   struct tun_file *tfile,
+				   const struct iovec *iv, unsigned long count,
+				   int noblock)
+{
+	ssize_t total = 0, ret = 0;
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		if (!iv[i].iov_len)
+			continue;
+
+		ret = tun_get_user(tun, tfile, &iv[i], iv[i].iov_len,
+				   noblock, true);
+		if (ret < 0)
+			break;
+		total += ret;
+	}
+
+	if ((tfile->flags & TUN_NAPI) &&
+	    !skb_queue_empty(&tfile->sk.sk_write_queue))
+		tun_napi_schedule(tfile);
+
+	return total ? total : ret;
+}
+
 static ssize_t tun_chr_aio_write(struct kiocb *iocb, const struct iovec *iv,
 			      unsigned long count, loff_t pos)
 {
 	struct file *file = iocb->ki_filp;
-	struct tun_struct *tun = tun_get(file);
+	struct tun_file *tfile = file->private_data;
+	struct tun_struct *tun = __tun_get(tfile);
+	int noblock = file->f_flags & O_NONBLOCK;
 	ssize_t result;
 
 	if (!tun)
@@ -744,8 +982,11 @@ static ssize_t tun_chr_aio_write(struct kiocb *iocb, const struct iovec *iv,
 
 	tun_debug(KERN_INFO, tun, "tun_chr_write %ld\n", count);
 
-	result = tun_get_user(tun, iv, iov_length(iv, count),
-			      file->f_flags & O_NONBLOCK);
+	if (tfile->flags & TUN_MULTI_FRAME)
+		result = tun_get_user_frames(tun, tfile, iv, count, noblock);
+	else
+		result = tun_get_user(tun, tfile, iv, iov_length(iv, count),
+				      noblock, false);
 
 	tun_put(tun);
 	return result;
@@ -832,7 +1073,7 @@ static ssize_t tun_put_user(struct tun_struct *tun,
 	return total;
 }
 
-static ssize_t tun_do_read(struct tun_struct *tun,
+static ssize_t tun_do_read(struct tun_struct *tun, struct tun_file *tfile,
 			   struct kiocb *iocb, const struct iovec *iv,
 			   ssize_t len, int noblock)
 {
@@ -843,12 +1084,12 @@ static ssize_t tun_do_read(struct tun_struct *tun,
 	tun_debug(KERN_INFO, tun, "tun_chr_read\n");
 
 	if (unlikely(!noblock))
-		add_wait_queue(&tun->wq.wait, &wait);
+		add_wait_queue(&tfile->wq.wait, &wait);
 	while (len) {
 		current->state = TASK_INTERRUPTIBLE;
 
 		/* Read frames from the queue */
-		if (!(skb=skb_dequeue(&tun->socket.sk->sk_receive_queue))) {
+		if (!(skb=skb_dequeue(&tfile->socket.sk->sk_receive_queue))) {
 			if (noblock) {
 				ret = -EAGAIN;
 				break;
@@ -866,7 +1107,7 @@ static ssize_t tun_do_read(struct tun_struct *tun,
 			schedule();
 			continue;
 		}
-		netif_wake_queue(tun->dev);
+		netif_wake_subqueue(tun->dev, tfile->queue_index);
 
 		ret = tun_put_user(tun, skb, iv, len);
 		kfree_skb(skb);
@@ -875,7 +1116,7 @@ static ssize_t tun_do_read(struct tun_struct *tun,
 
 	current->state = TASK_RUNNING;
 	if (unlikely(!noblock))
-		remove_wait_queue(&tun->wq.wait, &wait);
+		remove_wait_queue(&tfile->wq.wait, &wait);
 
 	return ret;
 }
@@ -896,7 +1137,8 @@ static ssize_t tun_chr_aio_read(struct kiocb *iocb, const struct iovec *iv,
 		goto out;
 	}
 
-	ret = tun_do_read(tun, iocb, iv, len, file->f_flags & O_NONBLOCK);
+	ret = tun_do_read(tun, tfile, iocb, iv, len,
+			  file->f_flags & O_NONBLOCK);
 	ret = min_t(ssize_t, ret, len);
 out:
 	tun_put(tun);
@@ -931,7 +1173,7 @@ static struct rtnl_link_ops tun_link_ops __read_mostly = {
 
 static void tun_sock_write_space(struct sock *sk)
 {
-	struct tun_struct *tun;
+	struct tun_file *tfile;
 	wait_queue_head_t *wqueue;
 
 	if (!sock_writeable(sk))
@@ -945,8 +1187,8 @@ static void tun_sock_write_space(struct sock *sk)
 		wake_up_interruptible_sync_poll(wqueue, POLLOUT |
 						POLLWRNORM | POLLWRBAND);
 
-	tun = tun_sk(sk)->tun;
-	kill_fasync(&tun->fasync, SIGIO, POLL_OUT);
+	tfile = container_of(sk, struct tun_file, sk);
+	kill_fasync(&tfile->fasync, SIGIO, POLL_OUT);
 }
 
 static void tun_sock_destruct(struct sock *sk)
@@ -957,25 +1199,42 @@ static void tun_sock_destruct(struct sock *sk)
 static int tun_sendmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *m, size_t total_len)
 {
-	struct tun_struct *tun = container_of(sock, struct tun_struct, socket);
-	return tun_get_user(tun, m->msg_iov, total_len,
-			    m->msg_flags & MSG_DONTWAIT);
+	struct tun_file *tfile = container_of(sock, struct tun_file, socket);
+	struct tun_struct *tun = __tun_get(tfile);
+	int ret;
+
+	if (!tun)
+		return -EBADFD;
+	ret = tun_get_user(tun, tfile, m->msg_iov, total_len,
+			   m->msg_flags & MSG_DONTWAIT,
+			   m->msg_flags & MSG_MORE);
+	tun_put(tun);
+	return ret;
 }
 
 static int tun_recvmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *m, size_t total_len,
 		       int flags)
 {
-	struct tun_struct *tun = container_of(sock, struct tun_struct, socket);
+	struct tun_file *tfile = container_of(sock, struct tun_file, socket);
+	struct tun_struct *tun = __tun_get(tfile);
 	int ret;
-	if (flags & ~(MSG_DONTWAIT|MSG_TRUNC))
-		return -EINVAL;
-	ret = tun_do_read(tun, iocb, m->msg_iov, total_len,
+
+	if (!tun)
+		return -EBADFD;
+
+	if (flags & ~(MSG_DONTWAIT|MSG_TRUNC)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = tun_do_read(tun, tfile, iocb, m->msg_iov, total_len,
 			  flags & MSG_DONTWAIT);
 	if (ret > total_len) {
 		m->msg_flags |= MSG_TRUNC;
 		ret = flags & MSG_TRUNC ? ret : total_len;
 	}
+out:
+	tun_put(tun);
 	return ret;
 }
 
@@ -991,6 +1250,12 @@ static struct proto tun_proto = {
 	.obj_size	= sizeof(struct tun_sock),
 };
 
+static struct proto tun_file_proto = {
+	.name		= "tun_file",
+	.owner		= THIS_MODULE,
+	.obj_size	= sizeof(struct tun_file),
+};
+
 static int tun_flags(struct tun_struct *tun)
 {
 	int flags = 0;
@@ -1009,6 +1274,9 @@ static int tun_flags(struct tun_struct *tun)
 	if (tun->flags & TUN_VNET_HDR)
 		flags |= IFF_VNET_HDR;
 
+	if (tun->flags & TUN_TAP_MQ)
+		flags |= IFF_MULTI_QUEUE;
+
 	return flags;
 }
 
@@ -1057,21 +1325,27 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		else
 			return -EINVAL;
 
+		if (!!(ifr->ifr_flags & IFF_MULTI_QUEUE) !=
+		    !!(tun->flags & TUN_TAP_MQ))
+			return -EINVAL;
+
 		if (((tun->owner != -1 && cred->euid != tun->owner) ||
 		     (tun->group != -1 && !in_egroup_p(tun->group))) &&
 		    !capable(CAP_NET_ADMIN))
 			return -EPERM;
-		err = security_tun_dev_attach(tun->socket.sk);
+		err = security_tun_dev_attach(tun->sk);
 		if (err < 0)
 			return err;
 
-		err = tun_attach(tun, file);
+		err = tun_attach(tun, file, ifr->ifr_flags & IFF_NAPI,
+				 ifr->ifr_flags & IFF_MULTI_FRAME);
 		if (err < 0)
 			return err;
 	}
 	else {
 		char *name;
 		unsigned long flags = 0;
+		unsigned int queues = 1;
 
 		if (!capable(CAP_NET_ADMIN))
 			return -EPERM;
@@ -1094,8 +1368,13 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		if (*ifr->ifr_name)
 			name = ifr->ifr_name;
 
-		dev = alloc_netdev(sizeof(struct tun_struct), name,
-				   tun_setup);
+		if (ifr->ifr_flags & IFF_MULTI_QUEUE) {
+			flags |= TUN_TAP_MQ;
+			queues = MAX_TAP_QUEUES;
+		}
+
+		dev = alloc_netdev_mqs(sizeof(struct tun_struct), name,
+				       tun_setup, queues, queues);
 		if (!dev)
 			return -ENOMEM;
 
@@ -1107,19 +1386,15 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		tun->flags = flags;
 		tun->txflt.count = 0;
 		tun->vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+		tun->sndbuf = INT_MAX;
 
 		err = -ENOMEM;
 		sk = sk_alloc(net, AF_UNSPEC, GFP_KERNEL, &tun_proto);
 		if (!sk)
 			goto err_free_dev;
 
-		tun->socket.wq = &tun->wq;
-		init_waitqueue_head(&tun->wq.wait);
-		tun->socket.ops = &tun_socket_ops;
-		sock_init_data(&tun->socket, sk);
-		sk->sk_write_space = tun_sock_write_space;
-		sk->sk_sndbuf = INT_MAX;
-
+		sock_init_data(NULL, sk);
+		tun->sk = sk;
 		tun_sk(sk)->tun = tun;
 
 		security_tun_dev_post_create(sk);
@@ -1141,7 +1416,8 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 
 		sk->sk_destruct = tun_sock_destruct;
 
-		err = tun_attach(tun, file);
+		err = tun_attach(tun, file, ifr->ifr_flags & IFF_NAPI,
+				 ifr->ifr_flags & IFF_MULTI_FRAME);
 		if (err < 0)
 			goto failed;
 	}
@@ -1167,7 +1443,7 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 	 * xoff state.
 	 */
 	if (netif_running(tun->dev))
-		netif_wake_queue(tun->dev);
+		netif_tx_wake_all_queues(tun->dev);
 
 	strcpy(ifr->ifr_name, tun->dev->name);
 	return 0;
@@ -1181,7 +1457,7 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 }
 
 static int tun_get_iff(struct net *net, struct tun_struct *tun,
-		       struct ifreq *ifr)
+		       struct tun_file *tfile, struct ifreq *ifr)
 {
 	tun_debug(KERN_INFO, tun, "tun_get_iff\n");
 
@@ -1189,9 +1465,26 @@ static int tun_get_iff(struct net *net, struct tun_struct *tun,
 
 	ifr->ifr_flags = tun_flags(tun);
 
+	/* These are properties of the queue, not of the device */
+	if (tfile->flags & TUN_NAPI)
+		ifr->ifr_flags |= IFF_NAPI;
+	if (tfile->flags & TUN_MULTI_FRAME)
+		ifr->ifr_flags |= IFF_MULTI_FRAME;
+
 	return 0;
 }
 
+static void tun_set_sndbuf(struct tun_struct *tun)
+{
+	struct tun_file *tfile;
+	unsigned int i;
+
+	for (i = 0; i < tun->numqueues; i++) {
+		tfile = rtnl_dereference(tun->tfiles[i]);
+		tfile->socket.sk->sk_sndbuf = tun->sndbuf;
+	}
+}
+
 /* This is like a cut-down ethtool ops, except done via tun fd so no
  * privs required. */
 static int set_offload(struct tun_struct *tun, unsigned long arg)
@@ -1258,7 +1551,8 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		 * This is needed because we never checked for invalid flags on
 		 * TUNSETIFF. */
 		return put_user(IFF_TUN | IFF_TAP | IFF_NO_PI | IFF_ONE_QUEUE |
-				IFF_VNET_HDR,
+				IFF_VNET_HDR | IFF_MULTI_QUEUE | IFF_NAPI |
+				IFF_MULTI_FRAME,
 				(unsigned int __user*)argp);
 	}
 
@@ -1287,7 +1581,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 	ret = 0;
 	switch (cmd) {
 	case TUNGETIFF:
-		ret = tun_get_iff(current->nsproxy->net_ns, tun, &ifr);
+		ret = tun_get_iff(current->nsproxy->net_ns, tun, tfile, &ifr);
 		if (ret)
 			break;
 
@@ -1376,7 +1670,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		break;
 
 	case TUNGETSNDBUF:
-		sndbuf = tun->socket.sk->sk_sndbuf;
+		sndbuf = tfile->socket.sk->sk_sndbuf;
 		if (copy_to_user(argp, &sndbuf, sizeof(sndbuf)))
 			ret = -EFAULT;
 		break;
@@ -1387,7 +1681,8 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 			break;
 		}
 
-		tun->socket.sk->sk_sndbuf = sndbuf;
+		tun->sndbuf = sndbuf;
+		tun_set_sndbuf(tun);
 		break;
 
 	case TUNGETVNETHDRSZ:
@@ -1418,7 +1713,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		if (copy_from_user(&fprog, argp, sizeof(fprog)))
 			break;
 
-		ret = sk_attach_filter(&fprog, tun->socket.sk);
+		ret = sk_attach_filter(&fprog, tfile->socket.sk);
 		break;
 
 	case TUNDETACHFILTER:
@@ -1426,7 +1721,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		ret = -EINVAL;
 		if ((tun->flags & TUN_TYPE_MASK) != TUN_TAP_DEV)
 			break;
-		ret = sk_detach_filter(tun->socket.sk);
+		ret = sk_detach_filter(tfile->socket.sk);
 		break;
 
 	default:
@@ -1478,7 +1773,8 @@ static long tun_chr_compat_ioctl(struct file *file,
 
 static int tun_chr_fasync(int fd, struct file *file, int on)
 {
-	struct tun_struct *tun = tun_get(file);
+	struct tun_file *tfile = file->private_data;
+	struct tun_struct *tun = __tun_get(tfile);
 	int ret;
 
 	if (!tun)
@@ -1486,16 +1782,16 @@ static int tun_chr_fasync(int fd, struct file *file, int on)
 
 	tun_debug(KERN_INFO, tun, "tun_chr_fasync %d\n", on);
 
-	if ((ret = fasync_helper(fd, file, on, &tun->fasync)) < 0)
+	if ((ret = fasync_helper(fd, file, on, &tfile->fasync)) < 0)
 		goto out;
 
 	if (on) {
 		ret = __f_setown(file, task_pid(current), PIDTYPE_PID, 0);
 		if (ret)
 			goto out;
-		tun->flags |= TUN_FASYNC;
+		tfile->flags |= TUN_FASYNC;
 	} else
-		tun->flags &= ~TUN_FASYNC;
+		tfile->flags &= ~TUN_FASYNC;
 	ret = 0;
 out:
 	tun_put(tun);
@@ -1504,16 +1800,27 @@ out:
 
 static int tun_chr_open(struct inode *inode, struct file * file)
 {
+	struct net *net = current->nsproxy->net_ns;
 	struct tun_file *tfile;
 
 	DBG1(KERN_INFO, "tunX: tun_chr_open\n");
 
-	tfile = kmalloc(sizeof(*tfile), GFP_KERNEL);
+	tfile = (struct tun_file *)sk_alloc(net, AF_UNSPEC, GFP_KERNEL,
+					    &tun_file_proto);
 	if (!tfile)
 		return -ENOMEM;
-	atomic_set(&tfile->count, 0);
-	tfile->tun = NULL;
-	tfile->net = get_net(current->nsproxy->net_ns);
+	RCU_INIT_POINTER(tfile->tun, NULL);
+	tfile->net = get_net(net);
+	tfile->flags = 0;
+
+	tfile->socket.wq = &tfile->wq;
+	init_waitqueue_head(&tfile->wq.wait);
+	tfile->socket.file = file;
+	tfile->socket.ops = &tun_socket_ops;
+	sock_init_data(&tfile->socket, &tfile->sk);
+	tfile->sk.sk_write_space = tun_sock_write_space;
+	tfile->sk.sk_sndbuf = INT_MAX;
+
 	file->private_data = tfile;
 	return 0;
 }
@@ -1521,31 +1828,18 @@ static int tun_chr_open(struct inode *inode, struct file * file)
 static int tun_chr_close(struct inode *inode, struct file *file)
 {
 	struct tun_file *tfile = file->private_data;
-	struct tun_struct *tun;
-
-	tun = __tun_get(tfile);
-	if (tun) {
-		struct net_device *dev = tun->dev;
-
-		tun_debug(KERN_INFO, tun, "tun_chr_close\n");
 
-		__tun_detach(tun);
+	DBG1(KERN_INFO, "tunX: tun_chr_close\n");
 
-		/* If desirable, unregister the netdevice. */
-		if (!(tun->flags & TUN_PERSIST)) {
-			rtnl_lock();
-			if (dev->reg_state == NETREG_REGISTERED)
-				unregister_netdevice(dev);
-			rtnl_unlock();
-		}
-	}
+	rtnl_lock();
+	__tun_detach(tfile);
+	rtnl_unlock();
 
-	tun = tfile->tun;
-	if (tun)
-		sock_put(tun->socket.sk);
+	/* A writer racing with tun_detach_all() may have queued more */
+	skb_queue_purge(&tfile->sk.sk_write_queue);
 
 	put_net(tfile->net);
-	kfree(tfile);
+	sock_put(&tfile->sk);
 
 	return 0;
 }
@@ -1673,14 +1967,16 @@ static void tun_cleanup(void)
  * holding a reference to the file for as long as the socket is in use. */
 struct socket *tun_get_socket(struct file *file)
 {
+	struct tun_file *tfile;
 	struct tun_struct *tun;
 	if (file->f_op != &tun_fops)
 		return ERR_PTR(-EINVAL);
-	tun = tun_get(file);
+	tfile = file->private_data;
+	tun = __tun_get(tfile);
 	if (!tun)
 		return ERR_PTR(-EBADFD);
 	tun_put(tun);
-	return &tun->socket;
+	return &tfile->socket;
 }
 EXPORT_SYMBOL_GPL(tun_get_socket);
 
@@ -25,44 +25,72 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * struct logger_cpu_buf - one CPU's part of a log
+ *
+ * Only the owning CPU writes to the buffer, with preemption disabled, so
+ * writers on different CPUs never share a lock or a cache line. Positions
+ * increase monotonically (and wrap); the offset into 'buffer' is
+ * pos & (size - 1). Entries in [head, w_pos) are readable. The writer
+ * moves 'head' forward before overwriting old entries and 'w_pos' after
+ * writing a new one, so readers need no lock: they copy an entry out and
+ * then check that 'head' did not pass it meanwhile. 'flushed' is set by
+ * LOGGER_FLUSH_LOG and hides everything before it.
+ */
+struct logger_cpu_buf {
+	unsigned char 		*buffer;/* the ring buffer itself */
+	size_t			size;	/* size of the buffer */
+	unsigned long		head;	/* oldest entry */
+	unsigned long		w_pos;	/* current write position */
+	unsigned long		flushed;/* readers start no earlier than this */
+} ____cacheline_aligned_in_smp;
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
  */
 struct logger_log {
-	unsigned char 		*buffer;/* the ring buffer itself */
+	struct logger_cpu_buf __percpu *cpu_bufs; /* per-CPU ring buffers */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
-	size_t			size;	/* size of the log */
+	size_t			size;	/* size of the log, all CPUs together */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by its mutex.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads of this file */
+	unsigned long		*r_pos;	/* read position in each CPU buffer */
+	struct logger_entry	*entry;	/* the entry being read */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
 };
 
-/* logger_offset - returns index 'n' into the log via (optimized) modulus */
-#define logger_offset(n)	((n) & (log->size - 1))
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
+/* Smallest per-CPU buffer, which must hold a few maximum sized entries */
+#define LOGGER_CPU_BUF_MIN	(16 * 1024)
+
+/* logger_before - is position 'a' before 'b', allowing for wrap? */
+static inline bool logger_before(unsigned long a, unsigned long b)
+{
+	return (long)(a - b) < 0;
+}
 
 /*
  * file_get_log - Given a file structure, return the associated log
@@ -88,39 +116,100 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * logger_start - returns the position of the oldest entry of 'b' that
+ * readers may see.
+ */
+static unsigned long logger_start(struct logger_cpu_buf *b)
+{
+	unsigned long head = ACCESS_ONCE(b->head);
+	unsigned long flushed = ACCESS_ONCE(b->flushed);
+
+	return logger_before(head, flushed) ? flushed : head;
+}
+
+/*
+ * logger_fetch - copies 'len' bytes at position 'pos' of 'b' to 'dst'.
+ * Returns false if the writer overwrote them while we were copying.
+ */
+static bool logger_fetch(struct logger_cpu_buf *b, unsigned long pos,
+			 void *dst, size_t len)
+{
+	size_t off = pos & (b->size - 1);
+	size_t n = min(len, b->size - off);
+
+	memcpy(dst, b->buffer + off, n);
+	if (n != len)
+		memcpy(dst + n, b->buffer, len - n);
+
+	/* pairs with the smp_wmb() in logger_make_room() */
+	smp_rmb();
+	return !logger_before(pos, ACCESS_ONCE(b->head));
+}
+
+/*
+ * logger_peek - finds the next entry of CPU 'cpu' readable by 'reader',
+ * skipping entries of other users, and copies its header to 'hdr'.
+ * Returns false if there is none.
  */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
+static bool logger_peek(struct logger_reader *reader, int cpu,
+			struct logger_entry *hdr)
 {
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
+	struct logger_cpu_buf *b = per_cpu_ptr(reader->log->cpu_bufs, cpu);
+	unsigned long *r_pos = &reader->r_pos[cpu];
+	unsigned long w_pos, start;
+
+	while (1) {
+		w_pos = ACCESS_ONCE(b->w_pos);
+		/* pairs with the smp_wmb() in logger_write_entry() */
+		smp_rmb();
+
+		/* pull the reader forward if the writer lapped it */
+		start = logger_start(b);
+		if (logger_before(*r_pos, start))
+			*r_pos = start;
+		if (*r_pos == w_pos)
+			return false;
+
+		if (!logger_fetch(b, *r_pos, hdr, sizeof(*hdr)))
+			continue;
+
+		if (reader->r_all || hdr->euid == current_euid())
+			return true;
+
+		*r_pos += sizeof(struct logger_entry) + hdr->len;
 	}
+}
 
-	return (struct logger_entry *) (log->buffer + off);
+/* logger_entry_before - was 'a' logged before 'b'? */
+static bool logger_entry_before(struct logger_entry *a, struct logger_entry *b)
+{
+	if (a->sec != b->sec)
+		return a->sec < b->sec;
+	return a->nsec < b->nsec;
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
+ * logger_next - finds the oldest entry readable by 'reader' across all CPU
+ * buffers and copies its header to 'hdr'. Returns the CPU whose buffer
+ * holds it, or -1 if there is nothing to read.
  *
- * Caller needs to hold log->mutex.
+ * Caller must hold reader->mutex.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static int logger_next(struct logger_reader *reader, struct logger_entry *hdr)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct logger_entry next;
+	int cpu, found = -1;
+
+	for_each_possible_cpu(cpu) {
+		if (!logger_peek(reader, cpu, &next))
+			continue;
+		if (found < 0 || logger_entry_before(&next, hdr)) {
+			*hdr = next;
+			found = cpu;
+		}
+	}
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	return found;
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -156,78 +245,42 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * logger_wait - waits until 'reader' has something to read, and returns the
+ * CPU buffer holding the next entry, whose header is copied to 'hdr'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex, which is dropped while sleeping.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static int logger_wait(struct file *file, struct logger_reader *reader,
+		       struct logger_entry *hdr)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-	size_t len;
-	size_t msg_start;
-
-	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
-	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
-		return -EFAULT;
-
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
-
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
-		return -EFAULT;
-
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
-
-	reader->r_off = logger_offset(reader->r_off +
-		sizeof(struct logger_entry) + count);
+	struct logger_log *log = reader->log;
+	DEFINE_WAIT(wait);
+	int cpu;
 
-	return count + get_user_hdr_len(reader->r_ver);
-}
+	while (1) {
+		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-/*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
- */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
-{
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
+		cpu = logger_next(reader, hdr);
+		if (cpu >= 0)
+			break;
 
-		entry = get_entry_header(log, off, &scratch);
+		if (file->f_flags & O_NONBLOCK) {
+			cpu = -EAGAIN;
+			break;
+		}
 
-		if (entry->euid == euid)
-			return off;
+		if (signal_pending(current)) {
+			cpu = -EINTR;
+			break;
+		}
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(off + next_len);
+		mutex_unlock(&reader->mutex);
+		schedule();
+		mutex_lock(&reader->mutex);
 	}
 
-	return off;
+	finish_wait(&log->wq, &wait);
+	return cpu;
 }
 
 /*
@@ -238,6 +291,7 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
  * 	- Atomically reads exactly one log entry
+ * 	- Entries from all CPUs are returned in timestamp order
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -246,189 +300,200 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
-	struct logger_log *log = reader->log;
+	struct logger_entry hdr;
+	struct logger_cpu_buf *b;
+	size_t hdr_len;
 	ssize_t ret;
-	DEFINE_WAIT(wait);
-
-start:
-	while (1) {
-		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
+	int cpu;
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
-			break;
+	mutex_lock(&reader->mutex);
+	hdr_len = get_user_hdr_len(reader->r_ver);
 
-		if (file->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			break;
+	do {
+		cpu = logger_wait(file, reader, &hdr);
+		if (cpu < 0) {
+			ret = cpu;
+			goto out;
 		}
 
-		if (signal_pending(current)) {
-			ret = -EINTR;
-			break;
+		/* get the size of the next entry */
+		ret = hdr_len + hdr.len;
+		if (count < ret) {
+			ret = -EINVAL;
+			goto out;
 		}
 
-		schedule();
-	}
-
-	finish_wait(&log->wq, &wait);
-	if (ret)
-		return ret;
-
-	mutex_lock(&log->mutex);
+		/* copy it out, unless the writer lapped us meanwhile */
+		b = per_cpu_ptr(reader->log->cpu_bufs, cpu);
+	} while (!logger_fetch(b, reader->r_pos[cpu], reader->entry,
+			       sizeof(struct logger_entry) + hdr.len));
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
+	if (copy_header_to_user(reader->r_ver, reader->entry, buf) ||
+	    copy_to_user(buf + hdr_len, reader->entry->msg, hdr.len)) {
+		ret = -EFAULT;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	reader->r_pos[cpu] += sizeof(struct logger_entry) + hdr.len;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_make_room - moves the head of 'b' forward until 'len' more bytes
+ * fit without overwriting readable entries.
  *
- * Caller must hold log->mutex.
+ * Must be called on the CPU owning 'b' with preemption disabled.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void logger_make_room(struct logger_cpu_buf *b, size_t len)
 {
-	size_t count = 0;
+	unsigned long head = b->head;
+	struct logger_entry hdr;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	while (b->w_pos + len - head > b->size) {
+		logger_fetch(b, head, &hdr, sizeof(hdr));
+		head += sizeof(struct logger_entry) + hdr.len;
+	}
 
-	return off;
+	if (head != b->head) {
+		ACCESS_ONCE(b->head) = head;
+		/* readers must see the new head before the data is clobbered */
+		smp_wmb();
+	}
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_copy_in - writes 'count' bytes at position 'pos' of 'b', either
+ * from the kernel buffer 'kbuf' or, if that is NULL, from the user-space
+ * buffer 'ubuf' without sleeping.
+ *
+ * Returns 0 on success, -EFAULT if the user page is not resident.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static int logger_copy_in(struct logger_cpu_buf *b, unsigned long pos,
+			  const void *kbuf, const void __user *ubuf,
+			  size_t count)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	size_t off = pos & (b->size - 1);
+	size_t len = min(count, b->size - off);
+
+	if (kbuf) {
+		memcpy(b->buffer + off, kbuf, len);
+		if (count != len)
+			memcpy(b->buffer, kbuf + len, count - len);
+		return 0;
 	}
 
+	if (len && __copy_from_user_inatomic(b->buffer + off, ubuf, len))
+		return -EFAULT;
+
+	if (count != len)
+		if (__copy_from_user_inatomic(b->buffer, ubuf + len,
+					      count - len))
+			return -EFAULT;
+
+#ifdef CONFIG_ANDROID_LOGGER_TO_KMSG
+	pr_info("[log] %.*s%.*s\n", len, b->buffer + off, count - len, b->buffer );
+#endif
+
 	return 0;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * logger_write_entry - appends one entry to this CPU's buffer of 'log',
+ * taking its payload from 'kbuf' or, if that is NULL, from 'iov'.
  *
- * The caller needs to hold log->mutex.
+ * Must be called with preemption and, for user copies, page faults
+ * disabled. Returns the payload length, or -EFAULT if a user page was not
+ * resident, in which case nothing was published.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static ssize_t logger_write_entry(struct logger_log *log,
+				  struct logger_entry *header,
+				  const struct iovec *iov,
+				  unsigned long nr_segs, const void *kbuf)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	struct logger_cpu_buf *b = this_cpu_ptr(log->cpu_bufs);
+	unsigned long pos = b->w_pos;
+	ssize_t ret = 0;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	/*
+	 * Move the head past the entries we are about to overwrite now,
+	 * since if we partially fail we may already have clobbered them.
+	 */
+	logger_make_room(b, sizeof(struct logger_entry) + header->len);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
-}
+	logger_copy_in(b, pos, header, NULL, sizeof(struct logger_entry));
+	pos += sizeof(struct logger_entry);
 
-/*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
- */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
-{
-	size_t len;
+	if (kbuf) {
+		logger_copy_in(b, pos, kbuf, NULL, header->len);
+		ret = header->len;
+	} else {
+		while (nr_segs-- > 0) {
+			size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+			/* figure out how much of this vector we can keep */
+			len = min_t(size_t, iov->iov_len, header->len - ret);
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+			/* write out this segment's payload */
+			if (logger_copy_in(b, pos + ret, NULL, iov->iov_base,
+					   len))
+				return -EFAULT;
+
+			iov++;
+			ret += len;
+		}
+	}
 
-	log->w_off = logger_offset(log->w_off + count);
+	/* publish the entry only once it is complete */
+	smp_wmb();
+	ACCESS_ONCE(b->w_pos) = pos + ret;
 
+	return ret;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * logger_copy_iov - gathers the first 'len' bytes of 'iov' into 'kbuf'.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int logger_copy_iov(void *kbuf, const struct iovec *iov,
+			   unsigned long nr_segs, size_t len)
 {
-	size_t len;
+	size_t done = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0 && done < len) {
+		size_t n = min_t(size_t, iov->iov_len, len - done);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (copy_from_user(kbuf + done, iov->iov_base, n))
 			return -EFAULT;
+		done += n;
+		iov++;
+	}
 
-#ifdef CONFIG_ANDROID_LOGGER_TO_KMSG
-	pr_info("[log] %.*s%.*s\n", len, log->buffer + log->w_off, count - len, log->buffer );
-#endif
-
-	log->w_off = logger_offset(log->w_off + count);
-
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is copied straight from userspace into this CPU's buffer with
+ * preemption disabled. If the payload is not resident, it is faulted into a
+ * bounce buffer first and the write retried from there.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	void *kbuf;
+	ssize_t ret;
 
-	now = current_kernel_time();
+	/* entries from different CPUs are merged by time, so be precise */
+	getnstimeofday(&now);
 
 	header.pid = current->tgid;
 	header.tid = current->pid;
@@ -442,41 +507,32 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	preempt_disable();
+	pagefault_disable();
+	ret = logger_write_entry(log, &header, iov, nr_segs, NULL);
+	pagefault_enable();
+	preempt_enable();
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+	if (unlikely(ret == -EFAULT)) {
+		kbuf = kmalloc(header.len, GFP_KERNEL);
+		if (!kbuf)
+			return -ENOMEM;
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		ret = logger_copy_iov(kbuf, iov, nr_segs, header.len);
+		if (!ret) {
+			preempt_disable();
+			ret = logger_write_entry(log, &header, NULL, 0, kbuf);
+			preempt_enable();
 		}
-
-		iov++;
-		ret += nr;
+		kfree(kbuf);
+		if (ret < 0)
+			return ret;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/* wake up any blocked readers; pairs with prepare_to_wait() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -503,22 +559,31 @@ static int logger_open(struct inode *inode, struct file *file)
 
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader;
+		int cpu;
 
 		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
 		if (!reader)
 			return -ENOMEM;
 
+		reader->r_pos = kcalloc(nr_cpu_ids, sizeof(unsigned long),
+					GFP_KERNEL);
+		reader->entry = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->r_pos || !reader->entry) {
+			kfree(reader->entry);
+			kfree(reader->r_pos);
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
 		reader->r_ver = 1;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
+		mutex_init(&reader->mutex);
 
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		for_each_possible_cpu(cpu)
+			reader->r_pos[cpu] =
+				logger_start(per_cpu_ptr(log->cpu_bufs, cpu));
 
 		file->private_data = reader;
 	} else
@@ -536,7 +601,8 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
+		kfree(reader->entry);
+		kfree(reader->r_pos);
 		kfree(reader);
 	}
 
@@ -556,6 +622,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry hdr;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -566,14 +633,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (logger_next(reader, &hdr) >= 0)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -591,44 +654,69 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/* logger_len - bytes 'reader' has not read yet, all CPUs together */
+static long logger_len(struct logger_reader *reader)
+{
+	struct logger_cpu_buf *b;
+	unsigned long start;
+	long len = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(reader->log->cpu_bufs, cpu);
+		start = logger_start(b);
+		if (logger_before(start, reader->r_pos[cpu]))
+			start = reader->r_pos[cpu];
+		len += ACCESS_ONCE(b->w_pos) - start;
+	}
+
+	return len;
+}
+
+/* logger_flush - hides everything written so far from all readers */
+static void logger_flush(struct logger_log *log)
+{
+	struct logger_cpu_buf *b;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(log->cpu_bufs, cpu);
+		ACCESS_ONCE(b->flushed) = ACCESS_ONCE(b->w_pos);
+	}
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
-	struct logger_reader *reader;
+	struct logger_reader *reader = NULL;
+	struct logger_entry hdr;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
+	if (file->f_mode & FMODE_READ) {
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+	}
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
 		break;
 	case LOGGER_GET_LOG_LEN:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = logger_len(reader);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (logger_next(reader, &hdr) >= 0)
+			ret = get_user_hdr_len(reader->r_ver) + hdr.len;
 		else
 			ret = 0;
 		break;
@@ -637,30 +725,27 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		logger_flush(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = reader->r_ver;
 		break;
 	case LOGGER_SET_VERSION:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	if (reader)
+		mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -678,13 +763,10 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * is split between the possible CPUs when the log is registered.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -692,10 +774,6 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
 	.size = SIZE, \
 };
 
@@ -717,10 +795,52 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * alloc_log_buffers - gives each possible CPU a power of two sized share of
+ * the log, but at least LOGGER_CPU_BUF_MIN bytes.
+ */
+static int __init alloc_log_buffers(struct logger_log *log)
+{
+	struct logger_cpu_buf *b;
+	size_t size;
+	int cpu;
+
+	size = rounddown_pow_of_two(log->size / num_possible_cpus());
+	size = max_t(size_t, size, LOGGER_CPU_BUF_MIN);
+
+	log->cpu_bufs = alloc_percpu(struct logger_cpu_buf);
+	if (!log->cpu_bufs)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(log->cpu_bufs, cpu);
+		b->buffer = vmalloc(size);
+		if (!b->buffer)
+			goto fail;
+		b->size = size;
+	}
+	log->size = size * num_possible_cpus();
+
+	return 0;
+
+fail:
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(log->cpu_bufs, cpu)->buffer);
+	free_percpu(log->cpu_bufs);
+	return -ENOMEM;
+}
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	ret = alloc_log_buffers(log);
+	if (unlikely(ret)) {
+		printk(KERN_ERR "logger: failed to allocate buffers "
+		       "for log '%s'!\n", log->misc.name);
+		return ret;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
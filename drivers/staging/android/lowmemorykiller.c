@@ -16,6 +16,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * The current reclaim pressure (see mm/vmpressure.c) is published in
+ * /sys/kernel/mm/lowmemorykiller/pressure_level, which can be polled. Write 1
+ * to /sys/module/lowmemorykiller/parameters/vmpressure_kill to also kill one
+ * oom_adj level early while reclaim is failing to free memory. stall_stats in
+ * the same directory compares time spent in direct reclaim and kills made in
+ * either mode.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -37,6 +44,12 @@
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
 #include <linux/compaction.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/vmpressure.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -57,8 +70,28 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/* Latest reclaim pressure, see lowmem_vmpressure_notify() */
+static bool lowmem_vmpressure_kill;
+static unsigned long lowmem_pressure;
+static int lowmem_level;
+static struct kobject *lowmem_kobj;
+
+static atomic_t lowmem_kills_threshold = ATOMIC_INIT(0);
+static atomic_t lowmem_kills_vmpressure = ATOMIC_INIT(0);
+
 extern int compact_nodes(bool sync);
 
+/*
+ * Thread groups indexed by oom_adj, so that a kill only looks at the
+ * highest populated levels instead of every task in the system. RSS
+ * changes without notice, so the largest task is still found by
+ * scanning its level. Zero-initialized hlists are valid, which lets
+ * tasks forked before lowmem_init() be indexed too.
+ */
+#define LOWMEM_ADJ_LEVELS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct hlist_head lowmem_adj_lists[LOWMEM_ADJ_LEVELS];
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -83,17 +116,148 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * Called after task->signal->oom_adj changes and when a thread group
+ * is created. Must not be called with task_lock(), siglock or
+ * tasklist_lock held, since lowmem_shrink() takes task_lock() under
+ * lowmem_adj_lock.
+ */
+void lowmem_adj_update(struct task_struct *task)
+{
+	struct signal_struct *sig = task->signal;
+	int adj;
+
+	spin_lock(&lowmem_adj_lock);
+	hlist_del_init(&sig->lmk_node);
+	/* Don't let a late oom_adj write resurrect an exited group */
+	if (atomic_read(&sig->live)) {
+		adj = clamp(sig->oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+		hlist_add_head(&sig->lmk_node,
+			       &lowmem_adj_lists[adj - OOM_DISABLE]);
+	}
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/* Called once the last thread of the group has started exiting */
+void lowmem_adj_remove(struct signal_struct *sig)
+{
+	spin_lock(&lowmem_adj_lock);
+	hlist_del_init(&sig->lmk_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+static int lowmem_deathpending_active(void)
+{
+	return lowmem_deathpending &&
+	       time_before_eq(jiffies, lowmem_deathpending_timeout);
+}
+
+/*
+ * Returns the lowest oom_adj that may be killed with this much free
+ * memory, or OOM_ADJUST_MAX + 1 if none. With shift, each oom_adj
+ * level is compared against the minfree of the next one, so that
+ * kills happen one level early.
+ */
+static int lowmem_min_adj(int other_free, int other_file, int shift,
+			  int *minfree)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int i, j;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		j = min(i + shift, array_size - 1);
+		if (other_free < lowmem_minfree[j] &&
+		    other_file < lowmem_minfree[j]) {
+			*minfree = lowmem_minfree[j];
+			return lowmem_adj[i];
+		}
+	}
+
+	return OOM_ADJUST_MAX + 1;
+}
+
+/* Kill the largest task of the highest oom_adj >= min_adj, return its size */
+static int lowmem_kill(int min_adj, int minfree, int other_free,
+		       int other_file, int pressure)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	struct signal_struct *sig;
+	struct hlist_node *pos;
 	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
+	int adj;
+	int scanned = 0;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int selected_oom_adj = min_adj;
+	u64 start = local_clock();
+
+	rcu_read_lock();
+	spin_lock(&lowmem_adj_lock);
+	/* The first level with a candidate holds the victim */
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		hlist_for_each_entry(sig, pos,
+				     &lowmem_adj_lists[adj - OOM_DISABLE],
+				     lmk_node) {
+			struct task_struct *p;
+			int oom_adj;
+
+			tsk = pid_task(sig->leader_pid, PIDTYPE_PID);
+			if (!tsk || tsk->flags & PF_KTHREAD)
+				continue;
+
+			scanned++;
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
+
+			oom_adj = p->signal->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected && tasksize <= selected_tasksize)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
+		}
+	}
+	spin_unlock(&lowmem_adj_lock);
+
+	trace_lowmem_select(selected, selected_oom_adj, selected_tasksize,
+			    min_adj, minfree, other_free, other_file, pressure,
+			    scanned, local_clock() - start);
+	if (selected) {
+		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+			     selected->pid, selected->comm,
+			     selected_oom_adj, selected_tasksize);
+		lowmem_deathpending = selected;
+		lowmem_deathpending_timeout = jiffies + HZ;
+		send_sig(SIGKILL, selected, 0);
+	}
+	rcu_read_unlock();
+
+	if (selected)
+		compact_nodes(false);
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
+	int tasksize;
+	int min_adj;
+	int minfree = 0;
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
@@ -105,21 +269,10 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	 * this pass.
 	 *
 	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	if (lowmem_deathpending_active())
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
-		}
-	}
+	min_adj = lowmem_min_adj(other_free, other_file, 0, &minfree);
 	if (sc->nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
 			     sc->nr_to_scan, sc->gfp_mask, other_free, other_file,
@@ -133,59 +286,113 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		oom_adj = p->signal->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		rem -= selected_tasksize;
+	tasksize = lowmem_kill(min_adj, minfree, other_free, other_file, -1);
+	if (tasksize) {
+		atomic_inc(&lowmem_kills_threshold);
+		rem -= tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
-    if (selected)
-        compact_nodes(false);
 	return rem;
 }
 
+static const char * const lowmem_level_names[] = {
+	"low", "medium", "critical",
+};
+
+static int lowmem_pressure_level(unsigned long pressure)
+{
+	if (pressure >= VMPRESSURE_LEVEL_CRITICAL)
+		return 2;
+	if (pressure >= VMPRESSURE_LEVEL_MED)
+		return 1;
+	return 0;
+}
+
+/*
+ * Called with the pressure of each window of reclaim. Publish the
+ * level to userspace and, in vmpressure_kill mode, kill one oom_adj
+ * level early while reclaim is barely making progress instead of
+ * waiting for free memory to drop below minfree.
+ */
+static int lowmem_vmpressure_notify(struct notifier_block *nb,
+				    unsigned long pressure, void *data)
+{
+	int level = lowmem_pressure_level(pressure);
+	int min_adj;
+	int minfree = 0;
+	int other_free, other_file;
+
+	lowmem_pressure = pressure;
+	if (level != lowmem_level) {
+		lowmem_level = level;
+		if (lowmem_kobj)
+			sysfs_notify(lowmem_kobj, NULL, "pressure_level");
+	}
+
+	if (!lowmem_vmpressure_kill || pressure < VMPRESSURE_LEVEL_CRITICAL ||
+	    lowmem_deathpending_active())
+		return NOTIFY_OK;
+
+	other_free = global_page_state(NR_FREE_PAGES);
+	other_file = global_page_state(NR_FILE_PAGES) -
+					global_page_state(NR_SHMEM);
+	min_adj = lowmem_min_adj(other_free, other_file, 1, &minfree);
+	if (min_adj == OOM_ADJUST_MAX + 1)
+		return NOTIFY_OK;
+
+	lowmem_print(3, "lowmem_vmpressure %lu, ofree %d %d, ma %d\n",
+		     pressure, other_free, other_file, min_adj);
+	if (lowmem_kill(min_adj, minfree, other_free, other_file, pressure))
+		atomic_inc(&lowmem_kills_vmpressure);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call	= lowmem_vmpressure_notify,
+};
+
+static ssize_t pressure_level_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", lowmem_level_names[lowmem_level]);
+}
+static struct kobj_attribute pressure_level_attr = __ATTR_RO(pressure_level);
+
+static ssize_t pressure_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", lowmem_pressure);
+}
+static struct kobj_attribute pressure_attr = __ATTR_RO(pressure);
+
+static ssize_t stall_stats_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	struct vmpressure_stall_stats st;
+
+	vmpressure_get_stall_stats(&st);
+	return sprintf(buf, "stalls %llu\nstall_ns %llu\nmax_stall_ns %llu\n"
+		       "kills_threshold %d\nkills_vmpressure %d\n",
+		       st.stalls, st.stall_ns, st.max_stall_ns,
+		       atomic_read(&lowmem_kills_threshold),
+		       atomic_read(&lowmem_kills_vmpressure));
+}
+static struct kobj_attribute stall_stats_attr = __ATTR_RO(stall_stats);
+
+static struct attribute *lowmem_attrs[] = {
+	&pressure_level_attr.attr,
+	&pressure_attr.attr,
+	&stall_stats_attr.attr,
+	NULL,
+};
+
+static struct attribute_group lowmem_attr_group = {
+	.attrs = lowmem_attrs,
+};
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -195,11 +402,27 @@ static int __init lowmem_init(void)
 {
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+
+	/* /sys/kernel/mm/lowmemorykiller */
+	lowmem_kobj = kobject_create_and_add("lowmemorykiller", mm_kobj);
+	if (lowmem_kobj && sysfs_create_group(lowmem_kobj,
+					      &lowmem_attr_group)) {
+		kobject_put(lowmem_kobj);
+		lowmem_kobj = NULL;
+	}
+	if (!lowmem_kobj)
+		pr_err("lowmemorykiller: failed to create sysfs files\n");
+	vmpressure_register_notifier(&lowmem_vmpressure_nb);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	vmpressure_unregister_notifier(&lowmem_vmpressure_nb);
+	if (lowmem_kobj) {
+		sysfs_remove_group(lowmem_kobj, &lowmem_attr_group);
+		kobject_put(lowmem_kobj);
+	}
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
 }
@@ -210,6 +433,8 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_kill, lowmem_vmpressure_kill, bool,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -23,11 +23,17 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/cpumask.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
@@ -37,48 +43,17 @@
 
 #include "zram_drv.h"
 
-#if defined(CONFIG_ZRAM_LZO)
-#include <linux/lzo.h>
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(s, sl, d, dl, wm)	\
-	lzo1x_1_compress(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	lzo1x_decompress_safe(s, sl, d, dl)
-#elif defined(CONFIG_ZRAM_SNAPPY)
-#include "../snappy/csnappy.h" /* if built in drivers/staging */
-#define WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
-#define WMSIZE		(1 << WMSIZE_ORDER)
-static int
-snappy_compress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len,
-	void *workmem)
-{
-	const unsigned char *end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, WMSIZE_ORDER);
-	*dst_len = end - dst;
-	return 0;
-}
-static int
-snappy_decompress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len)
-{
-	uint32_t dst_len_ = (uint32_t)*dst_len;
-	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
-	*dst_len = (size_t)dst_len_;
-	return ret;
-}
-#define COMPRESS(s, sl, d, dl, wm)	\
-	snappy_compress_(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	snappy_decompress_(s, sl, d, dl)
+/* Compressors selectable through comp_algorithm */
+const char * const zram_comp_algs[ZRAM_NR_COMP_ALGS] = {
+	[ZRAM_COMP_LZO]		= "lzo",
+	[ZRAM_COMP_DEFLATE]	= "deflate",
+	[ZRAM_COMP_SNAPPY]	= "snappy",
+};
+
+#ifdef CONFIG_ZRAM_SNAPPY
+#define ZRAM_DEFAULT_COMP	ZRAM_COMP_SNAPPY
 #else
-#error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
+#define ZRAM_DEFAULT_COMP	ZRAM_COMP_LZO
 #endif
 
 /* Globals */
@@ -88,14 +63,14 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -117,6 +92,21 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/*
+ * Each table entry is protected by a bit spinlock in its flags word.
+ * The other flag bits are only modified with the slot lock held, so
+ * the non-atomic helpers below cannot corrupt the lock bit.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_slot_unlock(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -135,6 +125,415 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
+/*
+ * A write holds ZRAM_WRITE from before it reads the old contents of a
+ * partially written page until it has installed the merged page, so
+ * that two writes to the same slot cannot both merge with the old
+ * contents and lose one update. Unlike the slot lock this one may be
+ * held while sleeping.
+ */
+static int zram_write_wait(void *word)
+{
+	schedule();
+	return 0;
+}
+
+static void zram_slot_write_begin(struct zram *zram, u32 index)
+{
+	while (1) {
+		zram_slot_lock(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_WRITE)) {
+			zram_set_flag(zram, index, ZRAM_WRITE);
+			zram_slot_unlock(zram, index);
+			return;
+		}
+		zram_slot_unlock(zram, index);
+
+		wait_on_bit(&zram->table[index].flags, ZRAM_WRITE,
+			    zram_write_wait, TASK_UNINTERRUPTIBLE);
+	}
+}
+
+static void zram_slot_write_end(struct zram *zram, u32 index)
+{
+	zram_slot_lock(zram, index);
+	zram_clear_flag(zram, index, ZRAM_WRITE);
+	zram_slot_unlock(zram, index);
+
+	smp_mb();
+	wake_up_bit(&zram->table[index].flags, ZRAM_WRITE);
+}
+
+static void zram_comp_strm_free(struct zram_comp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zram_comp_strm *zram_comp_strm_alloc(enum zram_comp_alg alg,
+						   gfp_t flags)
+{
+	struct zram_comp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), flags);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(zram_comp_algs[alg], 0, 0);
+	/* Compression can expand the data, so use two pages */
+	zstrm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zram_comp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle compression stream, sleeping until another writer
+ * releases one if all are in use. Must not be called with a slot
+ * locked.
+ */
+static struct zram_comp_strm *zram_comp_strm_find(struct zram_comp *comp)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->lock);
+		if (!list_empty(&comp->idle)) {
+			zstrm = list_first_entry(&comp->idle,
+					struct zram_comp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->lock);
+
+		wait_event(comp->wait, !list_empty(&comp->idle));
+	}
+}
+
+static void zram_comp_strm_release(struct zram_comp *comp,
+				   struct zram_comp_strm *zstrm)
+{
+	spin_lock(&comp->lock);
+	list_add(&zstrm->list, &comp->idle);
+	spin_unlock(&comp->lock);
+	wake_up(&comp->wait);
+}
+
+/*
+ * Grow or shrink the stream pool while the device is being
+ * initialized or reset, with init_lock held for writing so no stream
+ * is in use. The device cannot be swapped to yet, so allocating here
+ * cannot recurse into it through reclaim.
+ */
+static int __zram_comp_set_streams(struct zram_comp *comp, int num_strm)
+{
+	struct zram_comp_strm *zstrm;
+
+	while (comp->avail_strm < num_strm) {
+		zstrm = zram_comp_strm_alloc(comp->alg, GFP_KERNEL);
+		if (!zstrm)
+			return -ENOMEM;
+		list_add(&zstrm->list, &comp->idle);
+		comp->avail_strm++;
+	}
+
+	while (comp->avail_strm > num_strm) {
+		zstrm = list_first_entry(&comp->idle,
+				struct zram_comp_strm, list);
+		list_del(&zstrm->list);
+		zram_comp_strm_free(zstrm);
+		comp->avail_strm--;
+	}
+
+	return 0;
+}
+
+/*
+ * Change the size of the stream pool of a live device. Reclaim may be
+ * writing to this device, and zram_make_request() would block behind
+ * a writer of init_lock, so new streams are allocated with GFP_NOIO
+ * before taking the lock and only spliced in under it.
+ */
+int zram_comp_set_max_streams(struct zram *zram, int num_strm)
+{
+	struct zram_comp *comp = &zram->comp;
+	struct zram_comp_strm *zstrm, *tmp;
+	enum zram_comp_alg alg;
+	LIST_HEAD(spare);
+	int init, nr_new, ret;
+
+again:
+	ret = 0;
+	down_read(&zram->init_lock);
+	init = zram->init_done;
+	alg = comp->alg;
+	nr_new = init ? num_strm - comp->avail_strm : 0;
+	up_read(&zram->init_lock);
+
+	for (; nr_new > 0; nr_new--) {
+		zstrm = zram_comp_strm_alloc(alg, GFP_NOIO);
+		if (!zstrm) {
+			ret = -ENOMEM;
+			break;
+		}
+		list_add(&zstrm->list, &spare);
+	}
+
+	down_write(&zram->init_lock);
+	if (zram->init_done && (!init || comp->alg != alg)) {
+		/* (Re)initialized meanwhile, perhaps with another compressor */
+		up_write(&zram->init_lock);
+		list_for_each_entry_safe(zstrm, tmp, &spare, list)
+			zram_comp_strm_free(zstrm);
+		INIT_LIST_HEAD(&spare);
+		goto again;
+	}
+
+	ret = 0;
+	if (zram->init_done) {
+		while (comp->avail_strm < num_strm && !list_empty(&spare)) {
+			list_move(spare.next, &comp->idle);
+			comp->avail_strm++;
+		}
+		while (comp->avail_strm > num_strm) {
+			list_move(comp->idle.next, &spare);
+			comp->avail_strm--;
+		}
+		/* On failure keep the streams we could allocate */
+		if (comp->avail_strm < num_strm)
+			ret = -ENOMEM;
+	}
+	comp->max_strm = ret ? comp->avail_strm : num_strm;
+	up_write(&zram->init_lock);
+
+	list_for_each_entry_safe(zstrm, tmp, &spare, list)
+		zram_comp_strm_free(zstrm);
+
+	return ret;
+}
+
+static void zram_comp_destroy(struct zram_comp *comp)
+{
+	int cpu;
+
+	__zram_comp_set_streams(comp, 0);
+
+	if (!comp->dtfm)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct crypto_comp *tfm = *per_cpu_ptr(comp->dtfm, cpu);
+
+		if (tfm)
+			crypto_free_comp(tfm);
+	}
+	free_percpu(comp->dtfm);
+	comp->dtfm = NULL;
+}
+
+/* Called with init_lock held for writing, see zram_comp_destroy() */
+static int zram_comp_create(struct zram_comp *comp)
+{
+	int cpu;
+
+	comp->dtfm = alloc_percpu(struct crypto_comp *);
+	if (!comp->dtfm)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct crypto_comp *tfm;
+
+		tfm = crypto_alloc_comp(zram_comp_algs[comp->alg], 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+		*per_cpu_ptr(comp->dtfm, cpu) = tfm;
+	}
+
+	return __zram_comp_set_streams(comp, comp->max_strm);
+}
+
+static void zram_comp_stat_add(struct zram *zram, u64 *pages, u64 *ns,
+			       u64 start)
+{
+	u64 delta = local_clock() - start;
+
+	spin_lock(&zram->stat64_lock);
+	*pages = *pages + 1;
+	*ns = *ns + delta;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static int zram_compress(struct zram *zram, struct zram_comp_strm *zstrm,
+			 const unsigned char *src, size_t *dst_len)
+{
+	struct zram_comp_stats *cs = &zram->comp_stats[zram->comp.alg];
+	unsigned int len = 2 * PAGE_SIZE;
+	u64 start = local_clock();
+	int ret;
+
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				   zstrm->buffer, &len);
+	zram_comp_stat_add(zram, &cs->comp_pages, &cs->comp_ns, start);
+
+	*dst_len = len;
+	return ret;
+}
+
+/*
+ * Called with a slot or hash bucket locked, which also keeps us on
+ * this CPU
+ */
+static int zram_decompress(struct zram *zram, const unsigned char *src,
+			   size_t src_len, unsigned char *dst)
+{
+	struct zram_comp_stats *cs = &zram->comp_stats[zram->comp.alg];
+	struct crypto_comp *tfm = *this_cpu_ptr(zram->comp.dtfm);
+	unsigned int len = PAGE_SIZE;
+	u64 start = local_clock();
+	int ret;
+
+	ret = crypto_comp_decompress(tfm, src, src_len, dst, &len);
+	zram_comp_stat_add(zram, &cs->decomp_pages, &cs->decomp_ns, start);
+
+	if (!ret && len != PAGE_SIZE)
+		ret = -EINVAL;
+	return ret;
+}
+
+static struct kmem_cache *zram_entry_cache;
+
+static unsigned long zram_entry_handle(struct zram *zram, u32 index)
+{
+	return ((struct zram_entry *)zram->table[index].handle)->handle;
+}
+
+static u32 zram_checksum(const unsigned char *mem)
+{
+	return jhash2((const u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct zram_hash *zram_hash_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & zram->hash_mask];
+}
+
+/* Allocate about one hash bucket per four pages of disk */
+static int zram_hash_create(struct zram *zram, size_t num_pages)
+{
+	unsigned long i, nr_buckets;
+
+	nr_buckets = roundup_pow_of_two(max_t(size_t, num_pages / 4, 1));
+	zram->hash = vmalloc(nr_buckets * sizeof(*zram->hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_buckets; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		INIT_HLIST_HEAD(&zram->hash[i].head);
+	}
+	zram->hash_mask = nr_buckets - 1;
+
+	return 0;
+}
+
+static void zram_hash_destroy(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_mask = 0;
+}
+
+/* Wrap a new zsmalloc object in an entry holding one reference */
+static struct zram_entry *zram_entry_alloc(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum)
+{
+	struct zram_entry *entry;
+	struct zram_hash *bucket;
+
+	entry = kmem_cache_alloc(zram_entry_cache, GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	INIT_HLIST_NODE(&entry->node);
+	entry->handle = handle;
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->refcount = 1;
+
+	if (zram->hash) {
+		bucket = zram_hash_bucket(zram, checksum);
+		spin_lock(&bucket->lock);
+		hlist_add_head(&entry->node, &bucket->head);
+		spin_unlock(&bucket->lock);
+	}
+
+	return entry;
+}
+
+/* Drop a reference; returns true if that freed the object */
+static bool zram_entry_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *bucket = NULL;
+	bool last;
+
+	if (zram->hash) {
+		bucket = zram_hash_bucket(zram, entry->checksum);
+		spin_lock(&bucket->lock);
+	}
+	last = !--entry->refcount;
+	if (last && !hlist_unhashed(&entry->node))
+		hlist_del(&entry->node);
+	if (bucket)
+		spin_unlock(&bucket->lock);
+
+	if (!last)
+		return false;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kmem_cache_free(zram_entry_cache, entry);
+	return true;
+}
+
+/*
+ * Find a stored object with the same contents as mem and take a
+ * reference on it. Objects with a matching checksum are decompressed
+ * into buf and compared, so a collision never shares different data.
+ */
+static struct zram_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, u32 checksum, unsigned char *buf)
+{
+	struct zram_hash *bucket = zram_hash_bucket(zram, checksum);
+	struct zram_entry *entry;
+	struct hlist_node *pos;
+	unsigned char *cmem;
+	int ret;
+
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(entry, pos, &bucket->head, node) {
+		if (entry->checksum != checksum)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		ret = zram_decompress(zram, cmem, entry->len, buf);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (!ret && !memcmp(mem, buf, PAGE_SIZE)) {
+			entry->refcount++;
+			spin_unlock(&bucket->lock);
+			return entry;
+		}
+	}
+	spin_unlock(&bucket->lock);
+
+	return NULL;
+}
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -178,15 +577,253 @@ static void setup_swap_header(struct zram *zram, union swap_header *s)
 }
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_touch(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = jiffies;
+}
+
+/* Returns a free block of the backing device, or 0 if it is full */
+static unsigned long zram_bd_alloc_blk(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bd_bitmap_lock);
+	blk = find_next_zero_bit(zram->bd_bitmap, zram->bd_nr_pages, 1);
+	if (blk < zram->bd_nr_pages)
+		__set_bit(blk, zram->bd_bitmap);
+	else
+		blk = 0;
+	spin_unlock(&zram->bd_bitmap_lock);
+
+	return blk;
+}
+
+/*
+ * A read of a backing device block without the slot lock held. The
+ * block stays allocated until the read is done, even if the slot is
+ * freed meanwhile, so it cannot be reused and overwritten under us.
+ */
+struct zram_bd_ref {
+	struct list_head list;
+	unsigned long blk;
+	bool freed;		/* the slot let go of the block */
+};
+
+/* Called with bd_bitmap_lock held */
+static bool zram_bd_blk_pinned(struct zram *zram, unsigned long blk,
+			       bool mark_freed)
+{
+	struct zram_bd_ref *ref;
+	bool pinned = false;
+
+	list_for_each_entry(ref, &zram->bd_reads, list) {
+		if (ref->blk != blk)
+			continue;
+		if (mark_freed)
+			ref->freed = true;
+		pinned = true;
+	}
+
+	return pinned;
+}
+
+static void zram_bd_free_blk(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bd_bitmap_lock);
+	if (!zram_bd_blk_pinned(zram, blk, true))
+		WARN_ON(!__test_and_clear_bit(blk, zram->bd_bitmap));
+	spin_unlock(&zram->bd_bitmap_lock);
+}
+
+/* Called with the slot holding blk locked */
+static void zram_bd_get_blk(struct zram *zram, struct zram_bd_ref *ref,
+			    unsigned long blk)
+{
+	ref->blk = blk;
+	ref->freed = false;
+
+	spin_lock(&zram->bd_bitmap_lock);
+	list_add(&ref->list, &zram->bd_reads);
+	spin_unlock(&zram->bd_bitmap_lock);
+}
+
+static void zram_bd_put_blk(struct zram *zram, struct zram_bd_ref *ref)
+{
+	spin_lock(&zram->bd_bitmap_lock);
+	list_del(&ref->list);
+	/* The last reader of a freed block releases it */
+	if (ref->freed && !zram_bd_blk_pinned(zram, ref->blk, false))
+		WARN_ON(!__test_and_clear_bit(ref->blk, zram->bd_bitmap));
+	spin_unlock(&zram->bd_bitmap_lock);
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronously read or write one page of the backing device */
+static int zram_bd_rw_page(struct zram *zram, unsigned long blk,
+			   struct page *page, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bd_work {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long blk;
+	struct page *page;
+	int ret;
+};
+
+static void zram_bd_read_work(struct work_struct *work)
+{
+	struct zram_bd_work *bw = container_of(work, struct zram_bd_work,
+					       work);
+
+	bw->ret = zram_bd_rw_page(bw->zram, bw->blk, bw->page, READ);
+}
+
+/*
+ * Read a page back from the backing device. This runs from
+ * zram_make_request(), where bios we submit are only dispatched once
+ * we return (see current->bio_list), so let a worker do the I/O.
+ */
+static int zram_bd_read(struct zram *zram, unsigned long blk,
+			struct page *page)
+{
+	struct zram_bd_work bw;
+	u64 start = local_clock();
+
+	bw.zram = zram;
+	bw.blk = blk;
+	bw.page = page;
+	INIT_WORK_ONSTACK(&bw.work, zram_bd_read_work);
+	queue_work(system_unbound_wq, &bw.work);
+	flush_work(&bw.work);
+	destroy_work_on_stack(&bw.work);
+
+	if (!bw.ret) {
+		zram_stat64_add(zram, &zram->stats.bd_reads, PAGE_SIZE);
+		zram_stat64_add(zram, &zram->stats.bd_read_ns,
+				local_clock() - start);
+	}
+
+	return bw.ret;
+}
+
+/*
+ * Read the page that slot index holds on the backing device into a
+ * newly allocated page, which the caller copies from and frees. Called
+ * with the slot locked; the lock is dropped before anything that may
+ * sleep. Like any block device, zram does not order the read against a
+ * concurrent write or discard of that sector, but the block is pinned
+ * so we never return another slot's data.
+ */
+static struct page *zram_bd_read_slot(struct zram *zram, u32 index)
+{
+	struct zram_bd_ref ref;
+	struct page *page;
+	int ret;
+
+	zram_bd_get_blk(zram, &ref, zram->table[index].handle);
+	zram_slot_unlock(zram, index);
+
+	page = alloc_page(GFP_NOIO);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = zram_bd_read(zram, ref.blk, page);
+	if (ret) {
+		__free_page(page);
+		page = NULL;
+	}
+out:
+	zram_bd_put_blk(zram, &ref);
+	return ret ? ERR_PTR(ret) : page;
+}
+
+/* Called with the slot locked */
+static void zram_bd_free_page(struct zram *zram, size_t index)
+{
+	zram_bd_free_blk(zram, zram->table[index].handle);
+	zram_clear_flag(zram, index, ZRAM_WB);
+	zram_stat64_sub(zram, &zram->stats.bd_pages, 1);
+	zram_stat_dec(&zram->stats.pages_stored);
+
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
+}
+
+/* Called after storing an incompressible page */
+static void zram_bd_kick(struct zram *zram)
+{
+	if (zram->bdev &&
+	    atomic_inc_return(&zram->wb_huge_pending) >= ZRAM_WB_HUGE_BATCH)
+		schedule_delayed_work(&zram->wb_work, ZRAM_WB_HUGE_DELAY);
+}
+#else
+static void zram_touch(struct zram *zram, u32 index)
+{
+}
+
+static struct page *zram_bd_read_slot(struct zram *zram, u32 index)
+{
+	zram_slot_unlock(zram, index);
+	return ERR_PTR(-EIO);
+}
+
+static void zram_bd_free_page(struct zram *zram, size_t index)
+{
+}
+
+static void zram_bd_kick(struct zram *zram)
+{
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
+/* Called with the slot locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+
+	/* Tell a racing zram_writeback() that this copy is stale */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_bd_free_page(zram, index);
+		return;
+	}
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -200,26 +837,28 @@ static void zram_free_page(struct zram *zram, size_t index)
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	/* Other slots still share the object */
+	if (!zram_entry_put(zram, (struct zram_entry *)handle)) {
+		zram_stat64_sub(zram, &zram->stats.dedup_saved, clen);
+		clen = 0;
+	}
+
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -241,7 +880,7 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page);
-	cmem = kmap_atomic(zram->table[index].page);
+	cmem = kmap_atomic((struct page *)zram->table[index].handle);
 
 	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
 	kunmap_atomic(cmem);
@@ -255,14 +894,15 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+/* Called with the slot locked */
+static int __zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			    u32 index, int offset, struct bio *bio,
+			    unsigned char *uncmem)
 {
 	int ret;
-	size_t clen;
+	unsigned long handle;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	unsigned char *user_mem, *cmem;
 
 	page = bvec->bv_page;
 
@@ -272,7 +912,7 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	}
 
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].handle)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
 		handle_zero_page(bvec);
@@ -285,35 +925,21 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		return 0;
 	}
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
-	}
-
 	user_mem = kmap_atomic(page);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page) +
-		zram->table[index].offset;
+	handle = zram_entry_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-	ret = DECOMPRESS(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			uncmem, &clen);
+	ret = zram_decompress(zram, cmem, zram->table[index].size, uncmem);
 
-	if (is_partial_io(bvec)) {
+	zs_unmap_object(zram->mem_pool, handle);
+
+	if (is_partial_io(bvec))
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
-	}
 
-	kunmap_atomic(cmem);
 	kunmap_atomic(user_mem);
 
 	/* Should NEVER happen. Return bio error if it does. */
@@ -328,33 +954,77 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	return 0;
 }
 
+static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset, struct bio *bio)
+{
+	int ret;
+	unsigned char *uncmem = NULL;
+
+	if (is_partial_io(bvec)) {
+		/* Use  a temporary buffer to decompress the page */
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+		if (!uncmem) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	zram_slot_lock(zram, index);
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		unsigned char *user_mem, *src;
+		struct page *page;
+
+		zram_touch(zram, index);
+		page = zram_bd_read_slot(zram, index);
+		if (IS_ERR(page)) {
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+			ret = PTR_ERR(page);
+			goto out;
+		}
+		user_mem = kmap_atomic(bvec->bv_page);
+		src = kmap_atomic(page);
+		memcpy(user_mem + bvec->bv_offset, src + offset,
+		       bvec->bv_len);
+		kunmap_atomic(src);
+		kunmap_atomic(user_mem);
+		__free_page(page);
+		flush_dcache_page(bvec->bv_page);
+		ret = 0;
+		goto out;
+	}
+	zram_touch(zram, index);
+	ret = __zram_bvec_read(zram, bvec, index, offset, bio, uncmem);
+	zram_slot_unlock(zram, index);
+
+out:
+	kfree(uncmem);
+	return ret;
+}
+
+/* Called with the slot locked */
 static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
+	unsigned long handle = zram->table[index].handle;
 	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	if (zram_test_flag(zram, index, ZRAM_ZERO) || !handle) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page) +
-		zram->table[index].offset;
-
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic((struct page *)handle);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem);
 		return 0;
 	}
 
-	ret = DECOMPRESS(cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			mem, &clen);
-	kunmap_atomic(cmem);
+	handle = zram_entry_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zram_decompress(zram, cmem, zram->table[index].size, mem);
+	zs_unmap_object(zram->mem_pool, handle);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -366,72 +1036,118 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
-static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
-			   int offset)
+/*
+ * The page is compressed into a stream buffer and copied to newly
+ * allocated memory without holding the slot lock, which is only taken
+ * to read the old contents for a partial write and to swap in the new
+ * object, so writers to different slots run in parallel. Called with
+ * ZRAM_WRITE held, see zram_bvec_write().
+ */
+static int __zram_bvec_write(struct zram *zram, struct bio_vec *bvec,
+			     u32 index, int offset)
 {
 	int ret;
-	u32 store_offset;
 	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	u32 checksum = 0;
+	unsigned long handle;
+	struct zram_entry *entry;
+	struct zram_comp_strm *zstrm;
+	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
-			goto out;
+		zram_slot_lock(zram, index);
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			struct page *bd_page;
+			unsigned char *src;
+
+			bd_page = zram_bd_read_slot(zram, index);
+			if (IS_ERR(bd_page)) {
+				ret = PTR_ERR(bd_page);
+			} else {
+				src = kmap_atomic(bd_page);
+				memcpy(uncmem, src, PAGE_SIZE);
+				kunmap_atomic(src);
+				__free_page(bd_page);
+				ret = 0;
+			}
+		} else {
+			ret = zram_read_before_write(zram, uncmem, index);
+			zram_slot_unlock(zram, index);
 		}
+		if (ret)
+			goto out;
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zram_comp_strm_find(&zram->comp);
 	user_mem = kmap_atomic(page);
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-	else
+		kunmap_atomic(user_mem);
+		user_mem = NULL;
+	} else {
 		uncmem = user_mem;
+	}
 
 	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		zram_comp_strm_release(&zram->comp, zstrm);
+
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_slot_lock(zram, index);
+		zram_free_page(zram, index);
 		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_slot_unlock(zram, index);
+
+		zram_stat_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	COMPRESS(uncmem, PAGE_SIZE, src, &clen,
-		zram->compress_workmem);
-	ret = 0;
+	if (zram->hash) {
+		checksum = zram_checksum(uncmem);
+		zram_stat64_inc(zram, &zram->stats.dedup_lookups);
+
+		/* The stream buffer is free until we compress */
+		entry = zram_dedup_find(zram, uncmem, checksum, zstrm->buffer);
+		if (entry) {
+			if (user_mem)
+				kunmap_atomic(user_mem);
+			zram_comp_strm_release(&zram->comp, zstrm);
+
+			handle = (unsigned long)entry;
+			clen = entry->len;
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			zram_stat64_add(zram, &zram->stats.dedup_saved, clen);
+			goto install;
+		}
+	}
 
-	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	ret = zram_compress(zram, zstrm, uncmem, &clen);
+
+	if (user_mem)
+		kunmap_atomic(user_mem);
 
 	if (unlikely(ret != 0)) {
+		zram_comp_strm_release(&zram->comp, zstrm);
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -442,85 +1158,106 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
+		struct page *page_store;
+
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
+			zram_comp_strm_release(&zram->comp, zstrm);
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page);
-		goto memstore;
-	}
-
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		ret = -ENOMEM;
-		goto out;
-	}
+		src = is_partial_io(bvec) ? uncmem : kmap_atomic(page);
+		cmem = kmap_atomic(page_store);
+		memcpy(cmem, src, PAGE_SIZE);
+		kunmap_atomic(cmem);
+		if (!is_partial_io(bvec))
+			kunmap_atomic(src);
 
-memstore:
-	zram->table[index].offset = store_offset;
+		handle = (unsigned long)page_store;
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (!handle) {
+			zram_comp_strm_release(&zram->comp, zstrm);
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%zu\n", index, clen);
+			ret = -ENOMEM;
+			goto out;
+		}
 
-	cmem = kmap_atomic(zram->table[index].page) +
-		zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, zstrm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+		entry = zram_entry_alloc(zram, handle, clen, checksum);
+		if (!entry) {
+			zs_free(zram->mem_pool, handle);
+			zram_comp_strm_release(&zram->comp, zstrm);
+			ret = -ENOMEM;
+			goto out;
+		}
+		handle = (unsigned long)entry;
 	}
-#endif
-
-	memcpy(cmem, src, clen);
+	zram_comp_strm_release(&zram->comp, zstrm);
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 
-	kunmap_atomic(cmem);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src);
+install:
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_slot_lock(zram, index);
+	zram_free_page(zram, index);
+	zram->table[index].handle = handle;
+	zram->table[index].size = clen;
+	if (unlikely(clen == PAGE_SIZE)) {
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	}
+	zram_touch(zram, index);
+	zram_slot_unlock(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
-	return 0;
+	/* Move incompressible pages out of RAM if we have somewhere to go */
+	if (unlikely(clen == PAGE_SIZE))
+		zram_bd_kick(zram);
 
 out:
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
+			   int offset)
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
+	zram_slot_write_begin(zram, index);
+	ret = __zram_bvec_write(zram, bvec, index, offset);
+	zram_slot_write_end(zram, index);
 
 	return ret;
 }
 
+static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
+			int offset, struct bio *bio, int rw)
+{
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
+
+	return zram_bvec_write(zram, bvec, index, offset);
+}
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -637,34 +1374,39 @@ void __zram_reset_device(struct zram *zram)
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_delayed_work_sync(&zram->wb_work);
+	atomic_set(&zram->wb_huge_pending, 0);
+#endif
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	zram_comp_destroy(&zram->comp);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		unsigned long handle = zram->table[index].handle;
 
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page((struct page *)handle);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zram_entry_put(zram, (struct zram_entry *)handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
+	zram_hash_destroy(zram);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Blocks on the backing device are simply forgotten */
+	if (zram->bd_bitmap)
+		bitmap_zero(zram->bd_bitmap, zram->bd_nr_pages);
+#endif
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -699,18 +1441,10 @@ int zram_init_device(struct zram *zram)
 	if (!zram->disksize)
 		zram_set_disksize(zram, zram_default_disksize_bytes());
 
-	zram->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_comp_create(&zram->comp);
+	if (ret) {
+		pr_err("Error allocating %s compression streams!\n",
+			zram_comp_algs[zram->comp.alg]);
 		goto fail_no_table;
 	}
 
@@ -722,6 +1456,12 @@ int zram_init_device(struct zram *zram)
 		goto fail_no_table;
 	}
 
+	if (zram->use_dedup && zram_hash_create(zram, num_pages)) {
+		pr_err("Error allocating zram dedup hash\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
@@ -729,7 +1469,7 @@ int zram_init_device(struct zram *zram)
 		ret = -ENOMEM;
 		goto fail;
 	}
-	zram->table[0].page = page;
+	zram->table[0].handle = (unsigned long)page;
 	zram_set_flag(zram, 0, ZRAM_UNCOMPRESSED);
 	swap_header = kmap(page);
 	setup_swap_header(zram, swap_header);
@@ -740,7 +1480,8 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -763,13 +1504,208 @@ fail:
 	return ret;
 }
 
+/*
+ * Move compressed objects out of sparsely used zspages and release
+ * the freed pages. Returns the number of pages released.
+ */
+unsigned long zram_compact(struct zram *zram)
+{
+	unsigned long freed = 0;
+
+	down_read(&zram->init_lock);
+	if (zram->init_done)
+		freed = zs_compact(zram->mem_pool);
+	up_read(&zram->init_lock);
+
+	return freed;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static bool zram_wb_candidate(struct zram *zram, size_t index,
+			      enum zram_wb_mode mode)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_ZERO) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return false;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	/* idle_age is bounded by ZRAM_MAX_IDLE_AGE, so this cannot wrap */
+	return time_after(jiffies, zram->table[index].ac_time +
+			  msecs_to_jiffies(zram->idle_age * MSEC_PER_SEC));
+}
+
+/*
+ * Write pages selected by mode to the backing device and free their
+ * memory. Must be called from process context with init_lock held
+ * for reading and the device initialized. Slots are only locked to
+ * copy the page out and to install the block number: a write or
+ * discard of the slot in between clears ZRAM_UNDER_WB and the block
+ * we wrote is simply released again.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	size_t index, nr_pages = zram->disksize >> PAGE_SHIFT;
+	unsigned long blk;
+	struct page *page;
+	char *mem;
+	int ret = 0;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	/* init_lock is held, so reclaim must not write to us */
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	mutex_lock(&zram->wb_mutex);
+	for (index = 0; index < nr_pages; index++) {
+		cond_resched();
+
+		zram_slot_lock(zram, index);
+		if (!zram_wb_candidate(zram, index, mode)) {
+			zram_slot_unlock(zram, index);
+			continue;
+		}
+
+		mem = kmap_atomic(page);
+		ret = zram_read_before_write(zram, mem, index);
+		kunmap_atomic(mem);
+		if (ret) {
+			zram_slot_unlock(zram, index);
+			break;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_slot_unlock(zram, index);
+
+		blk = zram_bd_alloc_blk(zram);
+		if (!blk) {
+			ret = -ENOSPC;
+		} else {
+			ret = zram_bd_rw_page(zram, blk, page, WRITE);
+			if (ret)
+				zram_bd_free_blk(zram, blk);
+		}
+
+		zram_slot_lock(zram, index);
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_slot_unlock(zram, index);
+			if (ret)
+				break;
+			zram_bd_free_blk(zram, blk);
+			continue;
+		}
+		zram_free_page(zram, index);
+		zram->table[index].handle = blk;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_slot_unlock(zram, index);
+
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat64_inc(zram, &zram->stats.bd_pages);
+		zram_stat64_add(zram, &zram->stats.bd_writes, PAGE_SIZE);
+	}
+	mutex_unlock(&zram->wb_mutex);
+
+	__free_page(page);
+	return ret;
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(to_delayed_work(work), struct zram,
+					 wb_work);
+
+	/* A reset in progress cancels us with init_lock held for write */
+	if (!down_read_trylock(&zram->init_lock))
+		return;
+	/* Pages stored from now on are not necessarily seen by this pass */
+	atomic_set(&zram->wb_huge_pending, 0);
+	if (zram->init_done)
+		zram_writeback(zram, ZRAM_WB_HUGE);
+	up_read(&zram->init_lock);
+}
+
+static void zram_release_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->bd_bitmap);
+	kfree(zram->backing_dev);
+	zram->bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->backing_dev = NULL;
+	zram->bd_nr_pages = 0;
+}
+
+/*
+ * Use the block device at path to hold pages written back from this
+ * device. It can only be changed while the device is uninitialized;
+ * "none" releases the current one.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long nr_pages, *bitmap;
+	char *name;
+	int ret = 0;
+
+	down_write(&zram->init_lock);
+	if (zram->init_done) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_release_backing_dev(zram);
+	if (!strcmp(path, "none"))
+		goto out;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	name = kstrdup(path, GFP_KERNEL);
+	if (nr_pages < 2 || !bitmap || !name) {
+		ret = nr_pages < 2 ? -EINVAL : -ENOMEM;
+		kfree(name);
+		vfree(bitmap);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		goto out;
+	}
+
+	zram->bdev = bdev;
+	zram->bd_nr_pages = nr_pages;
+	zram->bd_bitmap = bitmap;
+	zram->backing_dev = name;
+	pr_info("%s: using %s (%lu pages) as backing device\n",
+		zram->disk->disk_name, path, nr_pages);
+
+out:
+	up_write(&zram->init_lock);
+	return ret;
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 static void zram_slot_free_notify(struct block_device *bdev,
 				unsigned long index)
 {
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
+	zram_slot_unlock(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -782,10 +1718,24 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
 
+	spin_lock_init(&zram->comp.lock);
+	INIT_LIST_HEAD(&zram->comp.idle);
+	init_waitqueue_head(&zram->comp.wait);
+	zram->comp.max_strm = num_online_cpus();
+	zram->comp.alg = ZRAM_DEFAULT_COMP;
+	zram->use_dedup = 0;
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bd_bitmap_lock);
+	mutex_init(&zram->wb_mutex);
+	INIT_LIST_HEAD(&zram->bd_reads);
+	INIT_DELAYED_WORK(&zram->wb_work, zram_wb_work);
+	zram->idle_age = ZRAM_DEFAULT_IDLE_AGE;
+#endif
+
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
 		pr_err("Error allocating disk queue for device %d\n",
@@ -867,11 +1817,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_entry_cache = KMEM_CACHE(zram_entry, 0);
+	if (!zram_entry_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	if (!num_devices) {
@@ -901,6 +1857,8 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_cache:
+	kmem_cache_destroy(zram_entry_cache);
 out:
 	return ret;
 }
@@ -916,11 +1874,15 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		zram_release_backing_dev(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(zram_devices);
+	kmem_cache_destroy(zram_entry_cache);
 	pr_debug("Cleanup done!\n");
 }
 
@@ -17,8 +17,12 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +30,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -50,10 +42,20 @@ static const unsigned default_disksize_perc_ram = 25;
 static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ * Pages not accessed for this many seconds are written back by
+ * "echo idle > writeback", see /sys/block/zram<id>/idle_age
  */
+#define ZRAM_DEFAULT_IDLE_AGE	3600
+/* Keeps idle_age in jiffies well inside time_after()'s range */
+#define ZRAM_MAX_IDLE_AGE	(7 * 24 * 3600)
+
+/*
+ * Incompressible pages are written back in the background once this
+ * many have been stored, at most once per ZRAM_WB_HUGE_DELAY jiffies
+ * since each pass scans the whole table.
+ */
+#define ZRAM_WB_HUGE_BATCH	32
+#define ZRAM_WB_HUGE_DELAY	HZ
 
 /*-- End of configurable params */
 
@@ -74,19 +76,60 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Slot lock, see zram_slot_lock() */
+	ZRAM_ACCESS,
+
+	/* Slot is being written, see zram_slot_write_begin() */
+	ZRAM_WRITE,
+
+	/* Page is stored on the backing device, handle is the block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. All fields are protected by the
+ * ZRAM_ACCESS bit lock in flags.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
+	/*
+	 * struct zram_entry *, struct page * if ZRAM_UNCOMPRESSED or
+	 * backing device block if ZRAM_WB
+	 */
+	unsigned long handle;
+	unsigned long flags;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	unsigned long ac_time;	/* jiffies of last access */
+#endif
+	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * A compressed object, shared by all slots holding the same data.
+ * Entries are hashed by a checksum of the uncompressed page when
+ * deduplication is enabled; refcount and node are protected by the
+ * lock of the hash bucket.
+ */
+struct zram_entry {
+	struct hlist_node node;
+	unsigned long handle;	/* zsmalloc handle */
+	u32 checksum;
+	u16 len;		/* compressed size */
+	int refcount;
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -95,20 +138,74 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	u64 dedup_lookups;	/* compressible writes checked for a match */
+	u64 dedup_hits;		/* ... that shared an existing object */
+	u64 dedup_saved;	/* compressed bytes not stored thanks to that */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u64 bd_pages;		/* no. of pages on the backing device */
+	u64 bd_writes;		/* bytes written to the backing device */
+	u64 bd_reads;		/* bytes read back from the backing device */
+	u64 bd_read_ns;		/* total time spent reading them back */
+#endif
+};
+
+/* Which pages zram_writeback() moves to the backing device */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* incompressible pages */
+	ZRAM_WB_IDLE,	/* pages not accessed for idle_age seconds */
+};
+
+/* Compressors selectable through comp_algorithm, see zram_comp_algs */
+enum zram_comp_alg {
+	ZRAM_COMP_LZO,
+	ZRAM_COMP_DEFLATE,
+	ZRAM_COMP_SNAPPY,
+	ZRAM_NR_COMP_ALGS,
+};
+
+/* Compressor transform and output buffer */
+struct zram_comp_strm {
+	struct crypto_comp *tfm;
+	void *buffer;
+	struct list_head list;
+};
+
+/*
+ * Pool of compression streams shared by all writers of a device.
+ * max_strm streams are allocated while the device is initialized;
+ * a writer that finds none idle sleeps on wait. Decompression uses
+ * a per-CPU transform since readers run with a slot lock held.
+ */
+struct zram_comp {
+	spinlock_t lock;	/* protects idle, avail_strm and max_strm */
+	struct list_head idle;
+	int avail_strm;		/* no. of streams allocated */
+	int max_strm;
+	wait_queue_head_t wait;
+	enum zram_comp_alg alg;
+	struct crypto_comp * __percpu *dtfm;
+};
+
+/* Per-algorithm timings, protected by stat64_lock */
+struct zram_comp_stats {
+	u64 comp_pages;
+	u64 comp_ns;
+	u64 decomp_pages;
+	u64 decomp_ns;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_comp comp;
 	struct table *table;
+	struct zram_hash *hash;		/* NULL unless use_dedup */
+	unsigned long hash_mask;
+	int use_dedup;			/* only changed while uninitialized */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -121,6 +218,22 @@ struct zram {
 	u64 disksize;	/* bytes */
 
 	struct zram_stats stats;
+	/* Not cleared on reset, to compare algorithms across resets */
+	struct zram_comp_stats comp_stats[ZRAM_NR_COMP_ALGS];
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Backing device, kept across resets; protected by init_lock */
+	struct block_device *bdev;
+	char *backing_dev;	/* path it was opened with */
+	unsigned long bd_nr_pages;
+	unsigned long *bd_bitmap;	/* allocated blocks, 0 is reserved */
+	spinlock_t bd_bitmap_lock;
+	struct list_head bd_reads;	/* reads in flight, bd_bitmap_lock */
+	struct mutex wb_mutex;		/* serializes zram_writeback() */
+	struct delayed_work wb_work;	/* writes back incompressible pages */
+	atomic_t wb_huge_pending;	/* ... stored since it last ran */
+	unsigned int idle_age;		/* seconds, for ZRAM_WB_IDLE */
+#endif
 };
 
 extern struct zram *zram_devices;
@@ -131,5 +244,12 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+extern const char * const zram_comp_algs[ZRAM_NR_COMP_ALGS];
+extern int zram_comp_set_max_streams(struct zram *zram, int num_strm);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
+extern unsigned long zram_compact(struct zram *zram);
 
 #endif
@@ -0,0 +1,802 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc stores objects of up to PAGE_SIZE bytes in size classes
+ * spaced ZS_SIZE_CLASS_DELTA bytes apart. Each class allocates from
+ * zspages (see zsmalloc_int.h), which are kept on per-class lists by
+ * how full they are; new objects go to the fullest zspage first.
+ *
+ * Users get an opaque handle back from zs_malloc() and must map it
+ * with zs_map_object() to access the object. Only one object may be
+ * mapped per CPU at a time, and the caller must not sleep until it
+ * calls zs_unmap_object().
+ *
+ * Lock order: handle pin bit -> class->lock. Compaction holds the
+ * class lock and only ever trylocks the pin bit.
+ */
+
+#define KMSG_COMPONENT "zsmalloc"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *zs_handle_cachep;
+static struct kset *zs_kset;
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+
+static unsigned int get_size_class_index(int size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the number of pages per zspage that wastes the smallest
+ * fraction of the zspage for objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(int class_size)
+{
+	unsigned int i, max_usedpc = 0, max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int waste = zspage_size % class_size;
+		unsigned int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					      struct zspage *zspage)
+{
+	if (zspage->inuse == 0)
+		return ZS_EMPTY;
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * ZS_ALMOST_FULL_DEN >=
+	    class->objs_per_zspage * ZS_ALMOST_FULL_NUM)
+		return ZS_ALMOST_FULL;
+
+	return ZS_ALMOST_EMPTY;
+}
+
+/*
+ * Move the zspage to the list matching its current usage. Empty and
+ * full zspages are not kept on any list. Called with class->lock held.
+ */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+					      struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness)
+		return newfg;
+
+	if (zspage->fullness < _ZS_NR_FULLNESS_GROUPS)
+		list_del_init(&zspage->list);
+	if (newfg < _ZS_NR_FULLNESS_GROUPS)
+		list_add(&zspage->list, &class->fullness_list[newfg]);
+	zspage->fullness = newfg;
+
+	return newfg;
+}
+
+/* Fullest zspage with a free object, called with class->lock held */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	int i;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		if (!list_empty(&class->fullness_list[i]))
+			return list_first_entry(&class->fullness_list[i],
+						struct zspage, list);
+	}
+
+	return NULL;
+}
+
+static unsigned long obj_location(struct zspage *zspage, unsigned long idx)
+{
+	return (page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS) | idx;
+}
+
+static struct zspage *location_to_zspage(unsigned long loc,
+					 unsigned long *idx)
+{
+	struct page *page = pfn_to_page(loc >> OBJ_INDEX_BITS);
+
+	*idx = loc & OBJ_INDEX_MASK;
+	return (struct zspage *)page_private(page);
+}
+
+static void pin_handle(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_handle(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_handle(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+/* Called with the handle pinned */
+static unsigned long handle_to_location(unsigned long handle)
+{
+	return *(unsigned long *)handle >> OBJ_TAG_BITS;
+}
+
+/*
+ * Called with the handle pinned (or not yet visible to anybody), so
+ * nobody else writes the word; keep the pin bit as it is.
+ */
+static void record_location(unsigned long handle, unsigned long loc)
+{
+	unsigned long *p = (unsigned long *)handle;
+
+	*p = (loc << OBJ_TAG_BITS) | (*p & BIT(HANDLE_PIN_BIT));
+}
+
+/*
+ * The first word of an object never crosses a page boundary since
+ * objects are at least ZS_SIZE_CLASS_DELTA aligned within a zspage.
+ */
+static unsigned long read_obj_head(struct size_class *class,
+				   struct zspage *zspage, unsigned long idx)
+{
+	unsigned long off = idx * class->size;
+	unsigned long *vaddr, head;
+
+	vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+	head = *(unsigned long *)((char *)vaddr + (off & ~PAGE_MASK));
+	kunmap_atomic(vaddr);
+
+	return head;
+}
+
+static void write_obj_head(struct size_class *class, struct zspage *zspage,
+			   unsigned long idx, unsigned long head)
+{
+	unsigned long off = idx * class->size;
+	unsigned long *vaddr;
+
+	vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+	*(unsigned long *)((char *)vaddr + (off & ~PAGE_MASK)) = head;
+	kunmap_atomic(vaddr);
+}
+
+/* Take the first free object of zspage, called with class->lock held */
+static unsigned long obj_malloc(struct size_class *class,
+				struct zspage *zspage, unsigned long handle)
+{
+	unsigned long idx = zspage->freeobj;
+
+	BUG_ON(idx == ZS_NO_OBJ);
+	zspage->freeobj = read_obj_head(class, zspage, idx) >> OBJ_TAG_BITS;
+	write_obj_head(class, zspage, idx, handle | OBJ_ALLOCATED_TAG);
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	return idx;
+}
+
+static void obj_free(struct size_class *class, struct zspage *zspage,
+		     unsigned long idx)
+{
+	write_obj_head(class, zspage, idx, zspage->freeobj << OBJ_TAG_BITS);
+	zspage->freeobj = idx;
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i, nr_pages = zspage->class->pages_per_zspage;
+
+	for (i = 0; i < nr_pages; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+
+	atomic_long_sub(nr_pages, &pool->pages_allocated);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	unsigned int i;
+	unsigned long idx;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = alloc_page(flags);
+
+		if (!page)
+			goto fail;
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+	INIT_LIST_HEAD(&zspage->list);
+
+	/* Link all objects into the free list */
+	for (idx = 0; idx < class->objs_per_zspage; idx++) {
+		unsigned long next = idx + 1;
+
+		if (next == class->objs_per_zspage)
+			next = ZS_NO_OBJ;
+		write_obj_head(class, zspage, idx, next << OBJ_TAG_BITS);
+	}
+	zspage->freeobj = 0;
+
+	return zspage;
+
+fail:
+	while (i--) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+	return NULL;
+}
+
+/**
+ * zs_malloc - Allocate object from pool
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ *
+ * Returns a handle to the new object, or 0 on failure. Objects can
+ * be at most ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE bytes in size.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	unsigned long handle, idx;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cachep,
+					pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	*(unsigned long *)handle = 0;
+
+	class = &pool->size_class[get_size_class_index(size + ZS_HANDLE_SIZE)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(class, pool->flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cachep, (void *)handle);
+			return 0;
+		}
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	idx = obj_malloc(class, zspage, handle);
+	record_location(handle, obj_location(zspage, idx));
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+/**
+ * zs_free - Free object allocated with zs_malloc()
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc(), or 0
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned long idx;
+	struct size_class *class;
+	struct zspage *zspage;
+	enum fullness_group fg;
+
+	if (unlikely(!handle))
+		return;
+
+	pin_handle(handle);
+	zspage = location_to_zspage(handle_to_location(handle), &idx);
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, idx);
+	fg = fix_fullness_group(class, zspage);
+	if (fg == ZS_EMPTY)
+		class->zspages--;
+	spin_unlock(&class->lock);
+	unpin_handle(handle);
+
+	if (fg == ZS_EMPTY)
+		free_zspage(pool, zspage);
+
+	kmem_cache_free(zs_handle_cachep, (void *)handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/*
+ * Copy len bytes from offset off of a zspage to/from buf, page by page.
+ */
+static void zs_copy_from(char *buf, struct zspage *zspage,
+			 unsigned long off, int len)
+{
+	while (len) {
+		int chunk = min_t(int, len, PAGE_SIZE - (off & ~PAGE_MASK));
+		char *vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+
+		memcpy(buf, vaddr + (off & ~PAGE_MASK), chunk);
+		kunmap_atomic(vaddr);
+		buf += chunk;
+		off += chunk;
+		len -= chunk;
+	}
+}
+
+static void zs_copy_to(struct zspage *zspage, unsigned long off,
+		       const char *buf, int len)
+{
+	while (len) {
+		int chunk = min_t(int, len, PAGE_SIZE - (off & ~PAGE_MASK));
+		char *vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+
+		memcpy(vaddr + (off & ~PAGE_MASK), buf, chunk);
+		kunmap_atomic(vaddr);
+		buf += chunk;
+		off += chunk;
+		len -= chunk;
+	}
+}
+
+/**
+ * zs_map_object - Get address of an allocated object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object is going to be accessed
+ *
+ * The object stays pinned, and cannot be moved by compaction or freed,
+ * until zs_unmap_object() is called. The caller must not sleep or map
+ * another object in between.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned long idx, off;
+	struct size_class *class;
+	struct zspage *zspage;
+	struct mapping_area *area;
+
+	BUG_ON(!handle);
+
+	/* This also disables preemption, keeping us on this CPU */
+	pin_handle(handle);
+	zspage = location_to_zspage(handle_to_location(handle), &idx);
+	class = zspage->class;
+	off = idx * class->size;
+
+	area = &__get_cpu_var(zs_map_area);
+	area->mm = mm;
+
+	if ((off & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		/* This object lies within a single page */
+		area->vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+		return area->vaddr + (off & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	/* This object spans two pages, work on a copy of it */
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy_from(area->buf, zspage, off, class->size);
+
+	return area->buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned long idx, off;
+	struct size_class *class;
+	struct zspage *zspage;
+	struct mapping_area *area;
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr);
+		area->vaddr = NULL;
+		goto out;
+	}
+
+	if (area->mm == ZS_MM_RO)
+		goto out;
+
+	zspage = location_to_zspage(handle_to_location(handle), &idx);
+	class = zspage->class;
+	off = idx * class->size;
+
+	/* The handle back-reference in the copy was not touched */
+	zs_copy_to(zspage, off + ZS_HANDLE_SIZE, area->buf + ZS_HANDLE_SIZE,
+		   class->size - ZS_HANDLE_SIZE);
+out:
+	unpin_handle(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/*
+ * Move the objects of an isolated zspage into other zspages of the
+ * same class. Called with class->lock held. Stops early if an object
+ * is pinned (being mapped or freed) or there is no room left.
+ */
+static int zs_migrate_zspage(struct size_class *class, struct zspage *src)
+{
+	unsigned long idx, new_idx, head, handle;
+	struct zspage *dst;
+	char buf[256];
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		unsigned long src_off, dst_off;
+		int len;
+
+		head = read_obj_head(class, src, idx);
+		if (!(head & OBJ_ALLOCATED_TAG))
+			continue;
+
+		handle = head & ~OBJ_ALLOCATED_TAG;
+		if (!trypin_handle(handle))
+			return -EBUSY;
+
+		dst = find_get_zspage(class);
+		if (!dst) {
+			unpin_handle(handle);
+			return -ENOSPC;
+		}
+
+		new_idx = obj_malloc(class, dst, handle);
+
+		/* obj_malloc() already wrote the back-reference */
+		src_off = idx * class->size + ZS_HANDLE_SIZE;
+		dst_off = new_idx * class->size + ZS_HANDLE_SIZE;
+		len = class->size - ZS_HANDLE_SIZE;
+		while (len) {
+			int chunk = min_t(int, len, sizeof(buf));
+
+			zs_copy_from(buf, src, src_off, chunk);
+			zs_copy_to(dst, dst_off, buf, chunk);
+			src_off += chunk;
+			dst_off += chunk;
+			len -= chunk;
+		}
+
+		record_location(handle, obj_location(dst, new_idx));
+		obj_free(class, src, idx);
+		fix_fullness_group(class, dst);
+		unpin_handle(handle);
+	}
+
+	return 0;
+}
+
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				      struct size_class *class)
+{
+	unsigned long nr_free, freed = 0;
+	struct list_head *almost_empty;
+	struct zspage *src;
+	int ret;
+
+	almost_empty = &class->fullness_list[ZS_ALMOST_EMPTY];
+
+	while (1) {
+		spin_lock(&class->lock);
+		if (list_empty(almost_empty)) {
+			spin_unlock(&class->lock);
+			break;
+		}
+		src = list_entry(almost_empty->prev, struct zspage, list);
+
+		/* Only bother if the other zspages can take all of src */
+		nr_free = class->zspages * class->objs_per_zspage -
+				class->objs_inuse;
+		nr_free -= class->objs_per_zspage - src->inuse;
+		if (nr_free < src->inuse) {
+			spin_unlock(&class->lock);
+			break;
+		}
+
+		list_del_init(&src->list);
+		src->fullness = ZS_ISOLATED;
+
+		ret = zs_migrate_zspage(class, src);
+
+		if (fix_fullness_group(class, src) == ZS_EMPTY) {
+			class->zspages--;
+			spin_unlock(&class->lock);
+			free_zspage(pool, src);
+			freed += class->pages_per_zspage;
+		} else {
+			spin_unlock(&class->lock);
+		}
+
+		if (ret)
+			break;
+		cond_resched();
+	}
+
+	return freed;
+}
+
+/**
+ * zs_compact - Release sparsely used zspages of a pool
+ * @pool: pool to compact
+ *
+ * Objects in almost empty zspages are moved into other zspages of the
+ * same size class, and the emptied zspages are freed. Must be called
+ * from process context. Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		freed += zs_compact_class(pool, &pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/*
+ * sysfs: /sys/kernel/mm/zsmalloc/<pool>/
+ *   classes         per-class usage, one line per class in use
+ *   total_size      bytes allocated by the pool
+ *   pages_compacted pages released by zs_compact()
+ */
+#define to_zs_pool(_kobj) container_of(_kobj, struct zs_pool, kobj)
+
+static ssize_t classes_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	struct zs_pool *pool = to_zs_pool(kobj);
+	ssize_t n;
+	int i;
+
+	n = scnprintf(buf, PAGE_SIZE, "%5s %5s %5s %8s %8s %10s %5s\n",
+			"class", "size", "pages", "zspages", "inuse",
+			"wasted", "frag%");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long zspages, inuse, total, wasted;
+
+		spin_lock(&class->lock);
+		zspages = class->zspages;
+		inuse = class->objs_inuse;
+		spin_unlock(&class->lock);
+
+		if (!zspages)
+			continue;
+
+		/* Bytes allocated for this class but not holding objects */
+		total = zspages * class->pages_per_zspage * PAGE_SIZE;
+		wasted = total - inuse * class->size;
+
+		n += scnprintf(buf + n, PAGE_SIZE - n,
+				"%5d %5d %5u %8lu %8lu %10lu %5lu\n",
+				i, class->size, class->pages_per_zspage,
+				zspages, inuse, wasted,
+				wasted * 100 / total);
+	}
+
+	return n;
+}
+
+static ssize_t total_size_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+		zs_get_total_size_bytes(to_zs_pool(kobj)));
+}
+
+static ssize_t pages_compacted_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&to_zs_pool(kobj)->pages_compacted));
+}
+
+static struct kobj_attribute zs_classes_attr = __ATTR_RO(classes);
+static struct kobj_attribute zs_total_size_attr = __ATTR_RO(total_size);
+static struct kobj_attribute zs_pages_compacted_attr =
+	__ATTR_RO(pages_compacted);
+
+static struct attribute *zs_pool_attrs[] = {
+	&zs_classes_attr.attr,
+	&zs_total_size_attr.attr,
+	&zs_pages_compacted_attr.attr,
+	NULL,
+};
+
+static void zs_pool_release(struct kobject *kobj)
+{
+	kfree(to_zs_pool(kobj));
+}
+
+static struct kobj_type zs_pool_ktype = {
+	.release = zs_pool_release,
+	.sysfs_ops = &kobj_sysfs_ops,
+	.default_attrs = zs_pool_attrs,
+};
+
+/**
+ * zs_create_pool - Create a pool of compressed objects
+ * @name: name shown under /sys/kernel/mm/zsmalloc/, must be unique
+ * @flags: allocation flags used when the pool needs more pages
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	int i, ret;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class = &pool->size_class[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->index = i;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+						class->size;
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+	}
+
+	pool->flags = flags;
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	pool->kobj.kset = zs_kset;
+	ret = kobject_init_and_add(&pool->kobj, &zs_pool_ktype, NULL,
+				   "%s", name);
+	if (ret) {
+		pr_err("Error registering pool %s\n", name);
+		kobject_put(&pool->kobj);
+		return NULL;
+	}
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/* The pool must not contain any objects anymore */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->zspages)
+			pr_info("Freeing non-empty class: %d\n", i);
+		WARN_ON(class->zspages);
+	}
+
+	kobject_put(&pool->kobj);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+static void zs_free_map_areas(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu(zs_map_area, cpu).buf);
+}
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	BUILD_BUG_ON(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE
+			>= ZS_NO_OBJ);
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	/* Handles hold a pin bit, so they must be at least 2-byte aligned */
+	zs_handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					     __alignof__(unsigned long), 0,
+					     NULL);
+	if (!zs_handle_cachep)
+		goto fail;
+
+	zs_kset = kset_create_and_add("zsmalloc", NULL, mm_kobj);
+	if (!zs_kset) {
+		kmem_cache_destroy(zs_handle_cachep);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	zs_free_map_areas();
+	return -ENOMEM;
+}
+
+static void __exit zs_exit(void)
+{
+	kset_unregister(zs_kset);
+	kmem_cache_destroy(zs_handle_cachep);
+	zs_free_map_areas();
+}
+
+module_init(zs_init);
+module_exit(zs_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Memory allocator for compressed pages");
@@ -0,0 +1,136 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+
+#include "zsmalloc.h"
+
+/*
+ * Objects are carved out of "zspages": groups of up to
+ * ZS_MAX_PAGES_PER_ZSPAGE 0-order pages that are treated as one
+ * contiguous area, so an object may span two physical pages. The
+ * number of pages per zspage is chosen for each size class so that
+ * the space left over at the end of a zspage is minimal.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * Every allocated object starts with a back-reference to its handle
+ * so that compaction can find and update the handle when it moves the
+ * object. Free objects instead store the index of the next free one.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * The location of an object is encoded as <PFN, obj_idx>, where PFN
+ * is the first page of its zspage. The location is stored in the
+ * handle shifted left by OBJ_TAG_BITS: bit 0 of the handle word is
+ * the pin bit (HANDLE_PIN_BIT), taken while the object is mapped or
+ * freed so that compaction leaves it alone. In the object header
+ * the same bit (OBJ_ALLOCATED_TAG) tells allocated from free objects.
+ */
+#ifndef MAX_PHYSMEM_BITS
+#ifdef CONFIG_HIGHMEM64G
+#define MAX_PHYSMEM_BITS	36
+#else
+#define MAX_PHYSMEM_BITS	BITS_PER_LONG
+#endif
+#endif
+#define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
+#define OBJ_TAG_BITS		1
+#define OBJ_INDEX_BITS		(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
+#define OBJ_INDEX_MASK		((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
+
+#define HANDLE_PIN_BIT		0
+#define OBJ_ALLOCATED_TAG	1
+
+/* Marks the end of a zspage free list */
+#define ZS_NO_OBJ		OBJ_INDEX_MASK
+
+/*
+ * A zspage is "almost full" once at least this fraction of its
+ * objects are in use. Compaction moves objects out of almost empty
+ * zspages into almost full ones.
+ */
+#define ZS_ALMOST_FULL_NUM	3
+#define ZS_ALMOST_FULL_DEN	4
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	_ZS_NR_FULLNESS_GROUPS,
+
+	/* Not kept on any list */
+	ZS_EMPTY,
+	ZS_FULL,
+	ZS_ISOLATED,	/* being emptied by compaction */
+};
+
+struct size_class;
+
+struct zspage {
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	struct size_class *class;
+	unsigned int inuse;		/* no. of allocated objects */
+	unsigned long freeobj;		/* first free object or ZS_NO_OBJ */
+	enum fullness_group fullness;
+	struct list_head list;		/* in class->fullness_list */
+};
+
+struct size_class {
+	spinlock_t lock;
+	/* Object size including the handle back-reference */
+	int size;
+	unsigned int index;
+
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+
+	/* Stats, protected by lock */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	gfp_t flags;	/* allocation flags used when growing the pool */
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+
+	struct kobject kobj;	/* /sys/kernel/mm/zsmalloc/<name> */
+};
+
+/*
+ * Per-CPU state for zs_map_object(). An object that lies within one
+ * page is mapped in place; one that spans two pages is copied to buf.
+ */
+struct mapping_area {
+	char *buf;
+	char *vaddr;		/* kmap_atomic() address or NULL */
+	enum zs_mapmode mm;
+};
+
+#endif
@@ -481,6 +481,7 @@ static void tx_complete(struct usb_ep *ep, struct usb_request *req)
 	dev->net->stats.tx_packets++;
 
 	spin_lock(&dev->req_lock);
+	netdev_completed_queue(dev->net, 1, req->length);
 	list_add(&req->list, &dev->tx_reqs);
 	spin_unlock(&dev->req_lock);
 	dev_kfree_skb_any(skb);
@@ -500,7 +501,7 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 {
 	struct eth_dev		*dev = netdev_priv(net);
 	int			length = skb->len;
-	int			retval;
+	int			retval = 0;
 	struct usb_request	*req = NULL;
 	unsigned long		flags;
 	struct usb_ep		*in;
@@ -606,6 +607,11 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 			? ((atomic_read(&dev->tx_qlen) % qmult) != 0)
 			: 0;
 
+	/*
+	 * Account the bytes before queueing: the request may complete on
+	 * another cpu before usb_ep_queue() returns.
+	 */
+	netdev_sent_queue(net, length);
 	retval = usb_ep_queue(in, req, GFP_ATOMIC);
 	switch (retval) {
 	default:
@@ -621,6 +627,9 @@ static netdev_tx_t eth_start_xmit(struct sk_buff *skb,
 drop:
 		dev->net->stats.tx_dropped++;
 		spin_lock_irqsave(&dev->req_lock, flags);
+		/* a request that never reached the hardware gives its bytes back */
+		if (retval)
+			netdev_completed_queue(net, 1, length);
 		if (list_empty(&dev->tx_reqs))
 			netif_start_queue(net);
 		list_add(&req->list, &dev->tx_reqs);
@@ -640,6 +649,7 @@ static void eth_start(struct eth_dev *dev, gfp_t gfp_flags)
 
 	/* and open the tx floodgates */
 	atomic_set(&dev->tx_qlen, 0);
+	netdev_reset_queue(dev->net);
 	netif_wake_queue(dev->net);
 }
 
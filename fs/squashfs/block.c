@@ -160,7 +160,7 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 	if (compressed) {
 		length = squashfs_decompress(msblk, buffer, bh, b, offset,
 			 length, srclength, pages);
-		if (length < 0)
+		if (length < 0 || length > pages << PAGE_CACHE_SHIFT)
 			goto read_failure;
 	} else {
 		/*
@@ -168,6 +168,10 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 		 */
 		int i, in, pg_offset = 0;
 
+		/* Never copy past the pages supplied by the caller */
+		if (length > pages << PAGE_CACHE_SHIFT)
+			goto block_release;
+
 		for (i = 0; i < b; i++) {
 			wait_on_buffer(bh[i]);
 			if (!buffer_uptodate(bh[i]))
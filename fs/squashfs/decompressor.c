@@ -22,9 +22,13 @@
  */
 
 #include <linux/types.h>
-#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -36,6 +40,28 @@
  * Squashfs, allowing multiple decompressors to be easily supported
  */
 
+/*
+ * Decompressor streams are kept in a per-filesystem pool, so that up to
+ * 'max' blocks can be decompressed in parallel.  The first stream is
+ * allocated at mount time, the others when readers would otherwise have
+ * to wait.  A pool of one stream (the default, "threads=single") behaves
+ * like the original single stream serialised by a mutex.
+ */
+struct squashfs_stream {
+	void			*stream;
+	struct list_head	list;
+};
+
+struct squashfs_stream_pool {
+	spinlock_t		lock;
+	struct list_head	idle;
+	int			avail;
+	int			max;
+	wait_queue_head_t	wait;
+	void			*comp_opts;
+	int			length;
+};
+
 static const struct squashfs_decompressor squashfs_lzma_unsupported_comp_ops = {
 	NULL, NULL, NULL, LZMA_COMPRESSION, "lzma", 0
 };
@@ -83,34 +109,191 @@ const struct squashfs_decompressor *squashfs_lookup_decompressor(int id)
 }
 
 
-void *squashfs_decompressor_init(struct super_block *sb, unsigned short flags)
+/*
+ * Maximum number of streams for "threads=multi"
+ */
+int squashfs_max_decompressors(void)
+{
+	return num_online_cpus() * 2;
+}
+
+
+static struct squashfs_stream *stream_alloc(struct squashfs_sb_info *msblk,
+	struct squashfs_stream_pool *pool)
+{
+	struct squashfs_stream *stream;
+	int err;
+
+	stream = kmalloc(sizeof(*stream), GFP_KERNEL);
+	if (stream == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	stream->stream = msblk->decompressor->init(msblk, pool->comp_opts,
+		pool->length);
+	if (IS_ERR(stream->stream)) {
+		err = PTR_ERR(stream->stream);
+		kfree(stream);
+		return ERR_PTR(err);
+	}
+
+	return stream;
+}
+
+
+static void stream_free(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	msblk->decompressor->free(stream->stream);
+	kfree(stream);
+}
+
+
+/*
+ * Get an idle stream, allocating a new one if the pool is not yet full.
+ * Otherwise wait for another reader to return one.
+ */
+static struct squashfs_stream *get_stream(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream_pool *pool = msblk->stream_pool;
+	struct squashfs_stream *stream;
+
+	while (1) {
+		spin_lock(&pool->lock);
+		if (!list_empty(&pool->idle)) {
+			stream = list_first_entry(&pool->idle,
+				struct squashfs_stream, list);
+			list_del(&stream->list);
+			spin_unlock(&pool->lock);
+			return stream;
+		}
+
+		if (pool->avail < pool->max) {
+			pool->avail++;
+			spin_unlock(&pool->lock);
+
+			stream = stream_alloc(msblk, pool);
+			if (!IS_ERR(stream))
+				return stream;
+
+			/*
+			 * Out of memory, make do with the streams we have.
+			 * There is always at least the one allocated at
+			 * mount time.
+			 */
+			spin_lock(&pool->lock);
+			pool->avail--;
+		}
+		spin_unlock(&pool->lock);
+
+		wait_event(pool->wait, !list_empty(&pool->idle));
+	}
+}
+
+
+static void put_stream(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	struct squashfs_stream_pool *pool = msblk->stream_pool;
+
+	spin_lock(&pool->lock);
+	list_add(&stream->list, &pool->idle);
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wait);
+}
+
+
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_stream *stream = get_stream(msblk);
+	int res;
+
+	res = msblk->decompressor->decompress(msblk, stream->stream, buffer,
+		bh, b, offset, length, srclength, pages);
+	put_stream(msblk, stream);
+
+	return res;
+}
+
+
+int squashfs_decompressor_init(struct super_block *sb, unsigned short flags,
+	int max)
 {
 	struct squashfs_sb_info *msblk = sb->s_fs_info;
-	void *strm, *buffer = NULL;
-	int length = 0;
+	struct squashfs_stream_pool *pool;
+	struct squashfs_stream *stream;
+	void *buffer = NULL;
+	int length = 0, err;
 
 	/*
-	 * Read decompressor specific options from file system if present
+	 * Read decompressor specific options from file system if present,
+	 * they are needed again whenever another stream is allocated
 	 */
 	if (SQUASHFS_COMP_OPTS(flags)) {
 		buffer = kmalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
 		if (buffer == NULL)
-			return ERR_PTR(-ENOMEM);
+			return -ENOMEM;
 
 		length = squashfs_read_data(sb, &buffer,
 			sizeof(struct squashfs_super_block), 0, NULL,
 			PAGE_CACHE_SIZE, 1);
 
 		if (length < 0) {
-			strm = ERR_PTR(length);
-			goto finished;
+			err = length;
+			goto failed;
 		}
 	}
 
-	strm = msblk->decompressor->init(msblk, buffer, length);
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (pool == NULL) {
+		err = -ENOMEM;
+		goto failed;
+	}
+
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->idle);
+	init_waitqueue_head(&pool->wait);
+	pool->max = max;
+	pool->comp_opts = buffer;
+	pool->length = length;
+
+	stream = stream_alloc(msblk, pool);
+	if (IS_ERR(stream)) {
+		err = PTR_ERR(stream);
+		kfree(pool);
+		goto failed;
+	}
+
+	list_add(&stream->list, &pool->idle);
+	pool->avail = 1;
+	msblk->stream_pool = pool;
 
-finished:
+	return 0;
+
+failed:
 	kfree(buffer);
+	return err;
+}
 
-	return strm;
+
+void squashfs_decompressor_destroy(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream_pool *pool = msblk->stream_pool;
+	struct squashfs_stream *stream, *next;
+
+	if (pool == NULL)
+		return;
+
+	list_for_each_entry_safe(stream, next, &pool->idle, list)
+		stream_free(msblk, stream);
+	kfree(pool->comp_opts);
+	kfree(pool);
+	msblk->stream_pool = NULL;
+}
+
+
+int squashfs_max_streams(struct squashfs_sb_info *msblk)
+{
+	return msblk->stream_pool->max;
 }
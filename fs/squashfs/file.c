@@ -47,6 +47,8 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -371,6 +373,188 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/*
+ * Number of pages of the file covered by the datablock starting at page
+ * 'start_index', the last datablock of a file may be short.
+ */
+static int block_pages(struct inode *inode, int start_index)
+{
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_pages = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+		PAGE_CACHE_SHIFT;
+
+	return min(1 << (msblk->block_log - PAGE_CACHE_SHIFT),
+		file_pages - start_index);
+}
+
+
+/*
+ * Decompress a datablock straight into its page cache pages.  Pages that
+ * are missing (NULL) are backed by a scratch page whose contents are thrown
+ * away.  Returns -ENOMEM if the buffers needed to do this could not be
+ * allocated.
+ */
+static int squashfs_read_direct(struct super_block *sb, u64 block, int bsize,
+	struct page **page, int pages, int missing, int highmem)
+{
+	struct page *scratch = NULL;
+	void **data, *vaddr = NULL;
+	int i, res = -ENOMEM, offset;
+
+	data = kmalloc(pages * sizeof(void *), GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+
+	if (missing) {
+		scratch = alloc_page(GFP_KERNEL);
+		if (scratch == NULL)
+			goto out;
+		for (i = 0; i < pages; i++)
+			if (page[i] == NULL)
+				page[i] = scratch;
+	}
+
+	/*
+	 * The decompressors want the output pages mapped for the whole
+	 * call, map highmem pages into one virtually contiguous area.
+	 */
+	if (highmem) {
+		vaddr = vm_map_ram(page, pages, -1, PAGE_KERNEL);
+		if (vaddr == NULL)
+			goto out;
+		for (i = 0; i < pages; i++)
+			data[i] = vaddr + (i << PAGE_CACHE_SHIFT);
+	} else
+		for (i = 0; i < pages; i++)
+			data[i] = page_address(page[i]);
+
+	/*
+	 * The last datablock of a file may be shorter than block_size, and
+	 * data[] only covers the pages of the file it holds.
+	 */
+	res = squashfs_read_data(sb, data, block, bsize, NULL,
+		pages << PAGE_CACHE_SHIFT, pages);
+
+	if (res >= 0) {
+		/* zero whatever the datablock did not fill */
+		for (i = res >> PAGE_CACHE_SHIFT; i < pages; i++) {
+			offset = i == res >> PAGE_CACHE_SHIFT ?
+				res & (PAGE_CACHE_SIZE - 1) : 0;
+			memset(data[i] + offset, 0, PAGE_CACHE_SIZE - offset);
+		}
+		res = 0;
+	}
+
+	if (vaddr) {
+		flush_kernel_vmap_range(vaddr, pages << PAGE_CACHE_SHIFT);
+		vm_unmap_ram(vaddr, pages);
+	}
+
+out:
+	if (scratch) {
+		for (i = 0; i < pages; i++)
+			if (page[i] == scratch)
+				page[i] = NULL;
+		__free_page(scratch);
+	}
+	kfree(data);
+	return res;
+}
+
+
+/*
+ * Decompress a datablock into the read_page cache and copy it into the
+ * pages we have.  Used when there is no memory for squashfs_read_direct().
+ */
+static int squashfs_read_cached(struct super_block *sb, u64 block, int bsize,
+	struct page **page, int pages)
+{
+	struct squashfs_cache_entry *buffer;
+	int i, avail, bytes;
+	void *pageaddr;
+
+	buffer = squashfs_get_datablock(sb, block, bsize);
+	if (buffer->error) {
+		squashfs_cache_put(buffer);
+		return -EIO;
+	}
+
+	bytes = buffer->length;
+	for (i = 0; i < pages; i++, bytes -= PAGE_CACHE_SIZE) {
+		if (page[i] == NULL)
+			continue;
+
+		avail = bytes > 0 ? min_t(int, bytes, PAGE_CACHE_SIZE) : 0;
+		pageaddr = kmap_atomic(page[i], KM_USER0);
+		squashfs_copy_data(pageaddr, buffer, i << PAGE_CACHE_SHIFT,
+			avail);
+		memset(pageaddr + avail, 0, PAGE_CACHE_SIZE - avail);
+		kunmap_atomic(pageaddr, KM_USER0);
+	}
+
+	squashfs_cache_put(buffer);
+	return 0;
+}
+
+
+/*
+ * Fill the 'pages' page cache pages from 'start_index' with the datablock
+ * at 'block'.  page[] holds the pages the caller already has locked, the
+ * rest are grabbed here if they are not already uptodate.
+ *
+ * On return every page other than 'target' has been unlocked and released.
+ * 'target' stays referenced, and is unlocked only on success.
+ */
+static int squashfs_fill_block(struct inode *inode, u64 block, int bsize,
+	struct page **page, int start_index, int pages, struct page *target)
+{
+	int i, res, missing = 0, highmem = 0;
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL) {
+			page[i] = grab_cache_page_nowait(inode->i_mapping,
+				start_index + i);
+			if (page[i] && PageUptodate(page[i])) {
+				unlock_page(page[i]);
+				page_cache_release(page[i]);
+				page[i] = NULL;
+			}
+		}
+
+		if (page[i] == NULL)
+			missing = 1;
+		else if (PageHighMem(page[i]))
+			highmem = 1;
+	}
+
+	res = squashfs_read_direct(inode->i_sb, block, bsize, page, pages,
+		missing, highmem);
+	if (res == -ENOMEM)
+		res = squashfs_read_cached(inode->i_sb, block, bsize, page,
+			pages);
+	if (res)
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL)
+			continue;
+
+		if (res == 0) {
+			flush_dcache_page(page[i]);
+			SetPageUptodate(page[i]);
+		} else if (page[i] == target)
+			continue;
+
+		unlock_page(page[i]);
+		if (page[i] != target)
+			page_cache_release(page[i]);
+	}
+
+	return res;
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
@@ -410,17 +594,26 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			sparse = 1;
 		} else {
 			/*
-			 * Read and decompress datablock.
+			 * Read and decompress datablock directly into the
+			 * page cache.
 			 */
-			buffer = squashfs_get_datablock(inode->i_sb,
-								block, bsize);
-			if (buffer->error) {
-				ERROR("Unable to read page, block %llx, size %x"
-					"\n", block, bsize);
-				squashfs_cache_put(buffer);
+			struct page **push_pages;
+			int pages = block_pages(inode, start_index);
+
+			push_pages = kcalloc(pages, sizeof(*push_pages),
+				GFP_KERNEL);
+			if (push_pages == NULL)
+				goto error_out;
+
+			push_pages[page->index - start_index] = page;
+			if (squashfs_fill_block(inode, block, bsize,
+					push_pages, start_index, pages, page)) {
+				kfree(push_pages);
 				goto error_out;
 			}
-			bytes = buffer->length;
+
+			kfree(push_pages);
+			return 0;
 		}
 	} else {
 		/*
@@ -443,10 +636,10 @@ static int squashfs_readpage(struct file *file, struct page *page)
 	}
 
 	/*
-	 * Loop copying datablock into pages.  As the datablock likely covers
-	 * many PAGE_CACHE_SIZE pages (default block size is 128 KiB) explicitly
-	 * grab the pages from the page cache, except for the page that we've
-	 * been called to fill.
+	 * Loop copying the fragment (or zeros for a hole) into pages.  As the
+	 * block likely covers many PAGE_CACHE_SIZE pages (default block size
+	 * is 128 KiB) explicitly grab the pages from the page cache, except
+	 * for the page that we've been called to fill.
 	 */
 	for (i = start_index; i <= end_index && bytes > 0; i++,
 			bytes -= PAGE_CACHE_SIZE, offset += PAGE_CACHE_SIZE) {
@@ -496,6 +689,79 @@ out:
 }
 
 
+/*
+ * Readahead.  The pages of the readahead window are not yet in the page
+ * cache, add them a datablock at a time and decompress each datablock
+ * straight into them.  Fragments and holes go through squashfs_readpage().
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	struct page **push_pages, *page, *next;
+	int index, start_index, count, bsize;
+	u64 block;
+
+	push_pages = kmalloc((1 << shift) * sizeof(*push_pages), GFP_KERNEL);
+	if (push_pages == NULL)
+		return -ENOMEM;
+
+	/* the list is in descending index order */
+	while (!list_empty(pages)) {
+		page = list_entry(pages->prev, struct page, lru);
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+				GFP_KERNEL)) {
+			page_cache_release(page);
+			continue;
+		}
+
+		index = page->index >> shift;
+		if (index < file_end || squashfs_i(inode)->fragment_block ==
+					SQUASHFS_INVALID_BLK) {
+			block = 0;
+			bsize = read_blocklist(inode, index, &block);
+		} else
+			bsize = 0;
+
+		start_index = index << shift;
+		count = block_pages(inode, start_index);
+		if (bsize <= 0 || page->index - start_index >= count) {
+			squashfs_readpage(file, page);
+			page_cache_release(page);
+			continue;
+		}
+
+		memset(push_pages, 0, count * sizeof(*push_pages));
+		push_pages[page->index - start_index] = page;
+
+		/* take the rest of this datablock's readahead pages */
+		while (!list_empty(pages)) {
+			next = list_entry(pages->prev, struct page, lru);
+			if (next->index >= start_index + count)
+				break;
+			list_del(&next->lru);
+			if (add_to_page_cache_lru(next, mapping, next->index,
+					GFP_KERNEL)) {
+				page_cache_release(next);
+				continue;
+			}
+			push_pages[next->index - start_index] = next;
+		}
+
+		squashfs_fill_block(inode, block, bsize, push_pages,
+			start_index, count, NULL);
+	}
+
+	kfree(push_pages);
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
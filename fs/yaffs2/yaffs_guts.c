@@ -146,6 +146,8 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 {
 	int i, j;
 
+	spin_lock(&dev->rd_lock);
+
 	dev->temp_in_use++;
 	if (dev->temp_in_use > dev->max_temp)
 		dev->max_temp = dev->temp_in_use;
@@ -160,10 +162,14 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 					    dev->temp_buffer[j].line;
 			}
 
+			spin_unlock(&dev->rd_lock);
 			return dev->temp_buffer[i].buffer;
 		}
 	}
 
+	dev->unmanaged_buffer_allocs++;
+	spin_unlock(&dev->rd_lock);
+
 	yaffs_trace(YAFFS_TRACE_BUFFERS,
 		"Out of temp buffers at line %d, other held by lines:",
 		line_no);
@@ -175,7 +181,6 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 	 * This is not good.
 	 */
 
-	dev->unmanaged_buffer_allocs++;
 	return kmalloc(dev->data_bytes_per_chunk, GFP_NOFS);
 
 }
@@ -184,22 +189,28 @@ void yaffs_release_temp_buffer(struct yaffs_dev *dev, u8 * buffer, int line_no)
 {
 	int i;
 
+	spin_lock(&dev->rd_lock);
+
 	dev->temp_in_use--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->temp_buffer[i].buffer == buffer) {
 			dev->temp_buffer[i].line = 0;
+			spin_unlock(&dev->rd_lock);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanaged_buffer_deallocs++;
+	spin_unlock(&dev->rd_lock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		yaffs_trace(YAFFS_TRACE_BUFFERS,
 		  "Releasing unmanaged temp buffer in line %d",
 		   line_no);
 		kfree(buffer);
-		dev->unmanaged_buffer_deallocs++;
 	}
 
 }
@@ -255,6 +266,8 @@ static void yaffs_handle_chunk_update(struct yaffs_dev *dev, int nand_chunk,
 void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 			      struct yaffs_block_info *bi)
 {
+	/* Can be called by concurrent readers */
+	spin_lock(&dev->rd_lock);
 	if (!bi->gc_prioritise) {
 		bi->gc_prioritise = 1;
 		dev->has_pending_prioritised_gc = 1;
@@ -266,6 +279,7 @@ void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 
 		}
 	}
+	spin_unlock(&dev->rd_lock);
 }
 
 static void yaffs_handle_chunk_wr_error(struct yaffs_dev *dev, int nand_chunk,
@@ -1394,10 +1408,40 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Entries in use are hashed by object and chunk id, and all entries are
+ *   kept on an LRU list with the free ones at its head, so lookups and
+ *   replacement don't depend on the number of cache chunks. When an entry
+ *   has to be pushed out, all dirty chunks of its object are written back
+ *   together in chunk order.
  */
 
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	return &dev->cache_hash[(obj->obj_id * 61 + chunk_id) &
+				dev->cache_hash_mask];
+}
+
+/* Give a cache entry to a chunk, making it the most recently used. */
+static void yaffs_set_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			    struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	list_move(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
+	list_move_tail(&cache->lru_link, &dev->cache_lru);
+}
+
+/* Drop a cache entry's contents and make it the next to be reused. */
+static void yaffs_free_cache(struct yaffs_dev *dev, struct yaffs_cache *cache)
+{
+	cache->object = NULL;
+	cache->dirty = 0;
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru_link, &dev->cache_lru);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1414,47 +1458,54 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
+static int yaffs_cache_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(struct yaffs_cache * const *)a;
+	const struct yaffs_cache *cb = *(struct yaffs_cache * const *)b;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
 	int i;
+	int n_dirty = 0;
 	struct yaffs_cache *cache;
 	int chunk_written = 0;
 	int n_caches = obj->my_dev->param.n_caches;
 
 	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
-
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+		/* Gather the dirty chunks of this object and write them out
+		 * in chunk order, so they land sequentially on flash.
+		 */
+		for (i = 0; i < n_caches; i++) {
+			cache = &dev->cache[i];
+			if (cache->object == obj && cache->dirty &&
+			    !cache->locked)
+				dev->cache_flush[n_dirty++] = cache;
+		}
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+		if (n_dirty > 1)
+			sort(dev->cache_flush, n_dirty,
+			     sizeof(struct yaffs_cache *), yaffs_cache_cmp,
+			     NULL);
 
-		} while (cache && chunk_written > 0);
+		for (i = 0; i < n_dirty; i++) {
+			/* Write it out and free it up */
+			cache = dev->cache_flush[i];
+			chunk_written =
+			    yaffs_wr_data_obj(cache->object,
+					      cache->chunk_id,
+					      cache->data,
+					      cache->n_bytes, 1);
+			if (chunk_written <= 0)
+				break;
+			dev->cache_flushes++;
+			yaffs_free_cache(dev, cache);
+		}
 
-		if (cache)
+		if (i < n_dirty)
 			/* Hoosterman, disk full while writing cache out. */
 			yaffs_trace(YAFFS_TRACE_ERROR,
 				"yaffs tragedy: no space during cache write");
@@ -1471,21 +1522,27 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_obj *obj;
+	struct yaffs_obj *last = NULL;
 	int n_caches = dev->param.n_caches;
 	int i;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
+	 * Stop if an object could not be flushed.
 	 */
 	do {
 		obj = NULL;
 		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
+			if (dev->cache[i].object && dev->cache[i].dirty &&
+			    !dev->cache[i].locked)
 				obj = dev->cache[i].object;
 
 		}
-		if (obj)
+		if (obj && obj != last)
 			yaffs_flush_file_cache(obj);
+		else
+			obj = NULL;
+		last = obj;
 
 	} while (obj);
 
@@ -1498,13 +1555,14 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
  */
 static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache;
 
 	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+		/* Free entries are kept at the head of the LRU list */
+		cache = list_first_entry(&dev->cache_lru, struct yaffs_cache,
+					 lru_link);
+		if (!cache->object)
+			return cache;
 	}
 
 	return NULL;
@@ -1513,10 +1571,7 @@ static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
+	struct yaffs_cache *victim;
 
 	if (dev->param.n_caches > 0) {
 		/* Try find a non-dirty one... */
@@ -1524,37 +1579,25 @@ static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 		cache = yaffs_grab_chunk_worker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
+			/* Take the least recently used entry that isn't
+			 * locked. If it is dirty, flush its object, which
+			 * frees all of that object's dirty entries, then
+			 * find again.
 			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
+			victim = NULL;
+			list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+				if (!cache->locked) {
+					victim = cache;
+					break;
 				}
 			}
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+			if (victim && !victim->dirty)
+				return victim;
 
+			if (victim)
+				yaffs_flush_file_cache(victim->object);
+			cache = yaffs_grab_chunk_worker(dev);
 		}
 		return cache;
 	} else {
@@ -1562,43 +1605,65 @@ static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
         }
 }
 
-/* Find a cached chunk */
-static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
-						  int chunk_id)
+/* Find an unused or clean cache entry without flushing anything.
+ * Used by readers, which must not write. Caller holds dev->rd_lock.
+ */
+static struct yaffs_cache *yaffs_grab_clean_chunk_cache(struct yaffs_dev *dev)
+{
+	struct yaffs_cache *cache = yaffs_grab_chunk_worker(dev);
+
+	if (cache)
+		return cache;
+
+	list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+		if (!cache->dirty && !cache->locked)
+			return cache;
+	}
+
+	return NULL;
+}
+
+/* Look up a cached chunk */
+static struct yaffs_cache *yaffs_lookup_chunk_cache(const struct yaffs_obj *obj,
+						    int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache;
 
-				return &dev->cache[i];
-			}
+	if (dev->param.n_caches > 0) {
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj, chunk_id),
+				    hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id)
+				return cache;
 		}
 	}
 	return NULL;
 }
 
+/* Find a cached chunk for a read or write, counting hits and misses */
+static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
+						  int chunk_id)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_cache *cache = yaffs_lookup_chunk_cache(obj, chunk_id);
+
+	if (cache)
+		dev->cache_hits++;
+	else if (dev->param.n_caches > 0)
+		dev->cache_misses++;
+
+	return cache;
+}
+
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
+		list_move_tail(&cache->lru_link, &dev->cache_lru);
 
 		if (is_write)
 			cache->dirty = 1;
@@ -1613,10 +1678,10 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
 	if (object->my_dev->param.n_caches > 0) {
 		struct yaffs_cache *cache =
-		    yaffs_find_chunk_cache(object, chunk_id);
+		    yaffs_lookup_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_free_cache(object->my_dev, cache);
 	}
 }
 
@@ -1632,7 +1697,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_free_cache(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -3221,8 +3286,11 @@ static int yaffs_do_xattrib_fetch(struct yaffs_obj *obj, const YCHAR * name,
 		x_buffer = buffer + x_offs;
 
 		if (!obj->xattr_known) {
+			/* Other readers may be setting flags in the same word */
+			mutex_lock(&dev->lazy_lock);
 			obj->has_xattr = nval_hasvalues(x_buffer, x_size);
 			obj->xattr_known = 1;
+			mutex_unlock(&dev->lazy_lock);
 		}
 
 		if (name)
@@ -3270,8 +3338,14 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 
 	dev = in->my_dev;
 
-	if (in->lazy_loaded && in->hdr_chunk > 0) {
-		in->lazy_loaded = 0;
+	if (!in->lazy_loaded || in->hdr_chunk <= 0) {
+		smp_rmb();	/* details are loaded before the flag clears */
+		return;
+	}
+
+	/* Concurrent lookups may get here for the same object */
+	mutex_lock(&dev->lazy_lock);
+	if (in->lazy_loaded) {
 		chunk_data = yaffs_get_temp_buffer(dev, __LINE__);
 
 		result =
@@ -3291,7 +3365,11 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 		}
 
 		yaffs_release_temp_buffer(dev, chunk_data, __LINE__);
+
+		smp_wmb();
+		in->lazy_loaded = 0;
 	}
+	mutex_unlock(&dev->lazy_lock);
 }
 
 static void yaffs_load_name_from_oh(struct yaffs_dev *dev, YCHAR * name,
@@ -3566,37 +3644,45 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		else
 			n_copy = dev->data_bytes_per_chunk - start;
 
-		cache = yaffs_find_chunk_cache(in, chunk);
-
-		/* If the chunk is already in the cache or it is less than a whole chunk
-		 * or we're using inband tags then use the cache (if there is caching)
-		 * else bypass the cache.
+		/* Readers may run concurrently (the caller may hold the device
+		 * lock shared), so the cache is only touched under rd_lock and
+		 * a reader never flushes: it fills a clean entry or bypasses
+		 * the cache. An entry being filled by another reader is locked.
 		 */
-		if (cache || n_copy != dev->data_bytes_per_chunk
-		    || dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
-
-				/* If we can't find the data in the cache, then load it up. */
+		spin_lock(&dev->rd_lock);
+		cache = yaffs_find_chunk_cache(in, chunk);
 
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
+		if (cache && !cache->locked) {
+			yaffs_use_cache(dev, cache, 0);
+			memcpy(buffer, &cache->data[start], n_copy);
+			spin_unlock(&dev->rd_lock);
+		} else if (cache || n_copy != dev->data_bytes_per_chunk
+			   || dev->param.inband_tags) {
+			/* If the chunk is less than a whole chunk or we're
+			 * using inband tags then use the cache (if there is
+			 * caching) else bypass the cache.
+			 */
+			if (!cache && dev->param.n_caches > 0) {
+				cache = yaffs_grab_clean_chunk_cache(dev);
+				if (cache) {
+					yaffs_set_cache(dev, cache, in, chunk);
 					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					cache->locked = 1;
 					cache->n_bytes = 0;
 				}
+			} else
+				cache = NULL;
+			spin_unlock(&dev->rd_lock);
 
-				yaffs_use_cache(dev, cache, 0);
-
-				cache->locked = 1;
-
+			if (cache) {
+				/* Load it up, it can't be pushed out while locked */
+				yaffs_rd_data_obj(in, chunk, cache->data);
 				memcpy(buffer, &cache->data[start], n_copy);
 
+				spin_lock(&dev->rd_lock);
+				yaffs_use_cache(dev, cache, 0);
 				cache->locked = 0;
+				spin_unlock(&dev->rd_lock);
 			} else {
 				/* Read into the local buffer then copy.. */
 
@@ -3611,6 +3697,7 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 			}
 
 		} else {
+			spin_unlock(&dev->rd_lock);
 
 			/* A full chunk. Read directly into the supplied buffer. */
 			yaffs_rd_data_obj(in, chunk, buffer);
@@ -3707,8 +3794,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
+					yaffs_set_cache(dev, cache, in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_rd_data_obj(in, chunk,
@@ -4934,6 +5020,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->oldest_dirty_seq = 0;
 	dev->oldest_dirty_block = 0;
 
+	spin_lock_init(&dev->rd_lock);
+	mutex_init(&dev->lazy_lock);
+
 	/* Initialise temporary buffers and caches. */
 	if (!yaffs_init_tmp_buffers(dev))
 		init_failed = 1;
@@ -4941,36 +5030,58 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
+	dev->cache_hash = NULL;
+	dev->cache_flush = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		int n_buckets;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+		n_buckets = roundup_pow_of_two(dev->param.n_caches);
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_hash = kmalloc(n_buckets * sizeof(struct list_head),
+					  GFP_NOFS);
+		dev->cache_flush = kmalloc(dev->param.n_caches *
+					   sizeof(struct yaffs_cache *),
+					   GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_hash || !dev->cache_flush)
+			buf = NULL;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		if (buf) {
+			for (i = 0; i < n_buckets; i++)
+				INIT_LIST_HEAD(&dev->cache_hash[i]);
+			dev->cache_hash_mask = n_buckets - 1;
+		}
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru_link,
+				      &dev->cache_lru);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
+	dev->cache_flushes = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -5087,6 +5198,10 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
+		kfree(dev->cache_flush);
+		dev->cache_flush = NULL;
 
 		kfree(dev->gc_cleanup_list);
 
@@ -83,7 +83,8 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_DEFAULT_SHORT_OP_CACHES	10
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -110,11 +111,12 @@
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
 	u8 *data;
+	struct list_head hash_link;	/* In dev->cache_hash, if in use */
+	struct list_head lru_link;	/* In dev->cache_lru */
 };
 
 /* Tags structures in RAM
@@ -506,8 +508,8 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches. Lookups are
+				 * hashed, so larger caches are cheap to search.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -685,7 +687,10 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;	/* Entries in use, by object and chunk */
+	u32 cache_hash_mask;
+	struct list_head cache_lru;	/* Free entries first, then least recently used */
+	struct yaffs_cache **cache_flush;	/* Scratch for yaffs_flush_file_cache() */
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -702,6 +707,14 @@ struct yaffs_dev {
 	int unmanaged_buffer_allocs;
 	int unmanaged_buffer_deallocs;
 
+	/* Readers holding the device lock shared run concurrently.
+	 * rd_lock protects what they may modify: the temp buffers, the
+	 * chunk cache and block error flags. lazy_lock serialises lazy
+	 * loading of object details and the xattr flags readers set.
+	 */
+	spinlock_t rd_lock;
+	struct mutex lazy_lock;
+
 	/* yaffs2 runtime stuff */
 	unsigned seq_number;	/* Sequence number of currently allocating block */
 	unsigned oldest_dirty_seq;
@@ -734,6 +747,8 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
+	u32 cache_flushes;
 
 };
 
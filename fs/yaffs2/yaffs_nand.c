@@ -17,27 +17,36 @@
 
 #include "yaffs_getblockinfo.h"
 
+/*
+ * Read a chunk and its tags without acting on ECC errors. The caller must
+ * pass any tags->ecc_result error on to yaffs_handle_chunk_error().
+ */
+int yaffs_rd_chunk_tags_raw(struct yaffs_dev *dev, int nand_chunk,
+			    u8 * buffer, struct yaffs_ext_tags *tags)
+{
+	int realigned_chunk = nand_chunk - dev->chunk_offset;
+
+	dev->n_page_reads++;
+
+	if (dev->param.read_chunk_tags_fn)
+		return dev->param.read_chunk_tags_fn(dev, realigned_chunk,
+						     buffer, tags);
+	else
+		return yaffs_tags_compat_rd(dev, realigned_chunk, buffer,
+					    tags);
+}
+
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * buffer, struct yaffs_ext_tags *tags)
 {
 	int result;
 	struct yaffs_ext_tags local_tags;
 
-	int realigned_chunk = nand_chunk - dev->chunk_offset;
-
-	dev->n_page_reads++;
-
 	/* If there are no tags provided, use local tags to get prioritised gc working */
 	if (!tags)
 		tags = &local_tags;
 
-	if (dev->param.read_chunk_tags_fn)
-		result =
-		    dev->param.read_chunk_tags_fn(dev, realigned_chunk, buffer,
-						  tags);
-	else
-		result = yaffs_tags_compat_rd(dev,
-					      realigned_chunk, buffer, tags);
+	result = yaffs_rd_chunk_tags_raw(dev, nand_chunk, buffer, tags);
 	if (tags && tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
 
 		struct yaffs_block_info *bi;
@@ -21,6 +21,10 @@
 #include "yaffs_verify.h"
 #include "yaffs_attribs.h"
 
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+
 /*
  * Checkpoints are really no benefit on very small partitions.
  *
@@ -954,6 +958,115 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * Scan read-ahead.
+ *
+ * Reading the tags of every chunk dominates the time taken by a scan. The
+ * blocks have to be processed one after the other in sequence order, but
+ * their tags can be read in advance: workers on the unbound workqueue read
+ * the tags of the next few blocks in parallel while the scan processes the
+ * current one. The workers only read; ECC errors are passed on by the scan
+ * when it consumes the tags, so block info is only changed by the scan.
+ */
+#define YAFFS_SCAN_AHEAD_PER_CPU	2
+#define YAFFS_SCAN_AHEAD_MAX		16
+
+struct yaffs_scan_ahead {
+	struct work_struct work;
+	struct completion done;
+	struct yaffs_dev *dev;
+	int blk;
+	int queued;
+	struct yaffs_ext_tags *tags;	/* tags of each chunk in blk */
+};
+
+static void yaffs2_scan_ahead_fn(struct work_struct *work)
+{
+	struct yaffs_scan_ahead *sa =
+	    container_of(work, struct yaffs_scan_ahead, work);
+	struct yaffs_dev *dev = sa->dev;
+	int c;
+
+	for (c = 0; c < dev->param.chunks_per_block; c++)
+		yaffs_rd_chunk_tags_raw(dev,
+					sa->blk * dev->param.chunks_per_block +
+					c, NULL, &sa->tags[c]);
+
+	complete(&sa->done);
+}
+
+static void yaffs2_scan_ahead_queue(struct yaffs_scan_ahead *sa, int blk)
+{
+	sa->blk = blk;
+	sa->queued = 1;
+	INIT_COMPLETION(sa->done);
+	queue_work(system_unbound_wq, &sa->work);
+}
+
+static struct yaffs_ext_tags *yaffs2_scan_ahead_wait(struct yaffs_scan_ahead
+						     *sa)
+{
+	wait_for_completion(&sa->done);
+	sa->queued = 0;
+	return sa->tags;
+}
+
+static void yaffs2_scan_ahead_free(struct yaffs_scan_ahead *ahead,
+				   int n_ahead)
+{
+	int i;
+
+	for (i = 0; i < n_ahead; i++) {
+		if (ahead[i].queued)
+			yaffs2_scan_ahead_wait(&ahead[i]);
+		kfree(ahead[i].tags);
+	}
+	kfree(ahead);
+}
+
+/*
+ * Set up read-ahead slots and start reading the first blocks to be scanned,
+ * block_index[end_iter] downwards. Returns NULL if read-ahead isn't used.
+ */
+static struct yaffs_scan_ahead *yaffs2_scan_ahead_start(struct yaffs_dev *dev,
+					struct yaffs_block_index *block_index,
+					int end_iter, int *n_ahead)
+{
+	struct yaffs_scan_ahead *ahead;
+	int n = min_t(int, num_online_cpus() * YAFFS_SCAN_AHEAD_PER_CPU,
+		    YAFFS_SCAN_AHEAD_MAX);
+	int i;
+
+	/* The tags compat path marks blocks for retirement as it reads */
+	if (!dev->param.read_chunk_tags_fn || end_iter < 1)
+		return NULL;
+
+	n = min(n, end_iter + 1);
+	ahead = kzalloc(n * sizeof(*ahead), GFP_NOFS);
+	if (!ahead)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		ahead[i].tags = kmalloc(dev->param.chunks_per_block *
+					sizeof(struct yaffs_ext_tags),
+					GFP_NOFS);
+		if (!ahead[i].tags) {
+			yaffs2_scan_ahead_free(ahead, n);
+			return NULL;
+		}
+		ahead[i].dev = dev;
+		INIT_WORK(&ahead[i].work, yaffs2_scan_ahead_fn);
+		init_completion(&ahead[i].done);
+	}
+
+	for (i = 0; i < n; i++)
+		yaffs2_scan_ahead_queue(&ahead[(end_iter - i) % n],
+					block_index[end_iter - i].block);
+
+	*n_ahead = n;
+	return ahead;
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -987,6 +1100,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
 
+	struct yaffs_scan_ahead *ahead, *sa = NULL;
+	struct yaffs_ext_tags *ahead_tags;
+	int n_ahead = 0;
+
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
 		dev->internal_start_block, dev->internal_end_block);
@@ -1086,6 +1203,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	ahead = yaffs2_scan_ahead_start(dev, block_index, end_iter, &n_ahead);
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter; !alloc_failed && block_iter >= start_iter;
 	     block_iter--) {
@@ -1102,6 +1221,12 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		ahead_tags = NULL;
+		if (ahead) {
+			sa = &ahead[block_iter % n_ahead];
+			ahead_tags = yaffs2_scan_ahead_wait(sa);
+		}
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1239,14 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			if (ahead_tags) {
+				tags = ahead_tags[c];
+				if (tags.ecc_result >
+				    YAFFS_ECC_RESULT_NO_ERROR)
+					yaffs_handle_chunk_error(dev, bi);
+			} else
+				result = yaffs_rd_chunk_tags_nand(dev, chunk,
+								  NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1571,8 +1702,16 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			yaffs_block_became_dirty(dev, blk);
 		}
 
+		/* Reuse the slot to read ahead the next block */
+		if (ahead && block_iter - n_ahead >= start_iter)
+			yaffs2_scan_ahead_queue(sa,
+				block_index[block_iter - n_ahead].block);
+
 	}
 
+	if (ahead)
+		yaffs2_scan_ahead_free(ahead, n_ahead);
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
@@ -25,10 +25,13 @@
 #include <linux/vmalloc.h>
 #include <linux/xattr.h>
 #include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/stat.h>
 #include <linux/sort.h>
+#include <linux/log2.h>
 #include <linux/bitops.h>
 
 #define YCHAR char
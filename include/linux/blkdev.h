@@ -196,6 +196,7 @@ struct request_pm_state
 
 typedef void (request_fn_proc) (struct request_queue *q);
 typedef int (make_request_fn) (struct request_queue *q, struct bio *bio);
+typedef void (swq_request_fn) (struct request_queue *q, struct bio_list *bios);
 typedef int (prep_rq_fn) (struct request_queue *, struct request *);
 typedef void (unprep_rq_fn) (struct request_queue *, struct request *);
 
@@ -287,6 +288,12 @@ struct request_queue {
 	dma_drain_needed_fn	*dma_drain_needed;
 	lld_busy_fn		*lld_busy_fn;
 
+	/*
+	 * Per-cpu software submission queues, see blk_queue_swq()
+	 */
+	swq_request_fn		*swq_fn;
+	struct blk_swq_ctx __percpu *swq_ctx;
+
 	/*
 	 * Dispatch queue sorting
 	 */
@@ -814,6 +821,7 @@ extern struct request_queue *blk_init_allocated_queue(struct request_queue *,
 extern void blk_urgent_request(struct request_queue *q, request_fn_proc *fn);
 extern void blk_cleanup_queue(struct request_queue *);
 extern void blk_queue_make_request(struct request_queue *, make_request_fn *);
+extern int blk_queue_swq(struct request_queue *, swq_request_fn *);
 extern void blk_queue_bounce_limit(struct request_queue *, u64);
 extern void blk_limits_max_hw_sectors(struct queue_limits *, unsigned int);
 extern void blk_queue_max_hw_sectors(struct request_queue *, unsigned int);
@@ -66,6 +66,19 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_update(struct task_struct *task);
+extern void lowmem_adj_remove(struct signal_struct *sig);
+#else
+static inline void lowmem_adj_update(struct task_struct *task)
+{
+}
+
+static inline void lowmem_adj_remove(struct signal_struct *sig)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
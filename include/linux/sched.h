@@ -140,7 +140,20 @@ extern unsigned long nr_running(void);
 extern unsigned long nr_uninterruptible(void);
 extern unsigned long nr_iowait(void);
 extern unsigned long avg_nr_running(void);
+extern unsigned long avg_nr_running_cpu(int cpu);
+extern unsigned long nr_running_cpu(int cpu);
 extern unsigned long nr_iowait_cpu(int cpu);
+
+/*
+ * Passed to sched_wake_notifier_head callbacks when @task has been woken
+ * on @dest_cpu. It last ran on @src_cpu.
+ */
+struct sched_wake_hint {
+	struct task_struct *task;
+	int src_cpu;
+	int dest_cpu;
+};
+extern struct atomic_notifier_head sched_wake_notifier_head;
 extern unsigned long this_cpu_load(void);
 
 
@@ -649,6 +662,9 @@ struct signal_struct {
 	int oom_score_adj;	/* OOM kill score adjustment */
 	int oom_score_adj_min;	/* OOM kill score adjustment minimum value.
 				 * Only settable by CAP_SYS_RESOURCE. */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lmk_node;	/* lowmemorykiller oom_adj index */
+#endif
 
 	struct mutex cred_guard_mutex;	/* guard against foreign influences on
 					 * credential calculations
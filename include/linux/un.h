@@ -8,4 +8,31 @@ struct sockaddr_un {
 	char sun_path[UNIX_PATH_MAX];	/* pathname */
 };
 
+/* SOL_UNIX socket options */
+#define UNIX_RX_RING	1
+
+struct unix_ring_req {
+	unsigned int	ur_block_size;	/* Minimal size of contiguous block */
+	unsigned int	ur_block_nr;	/* Number of blocks */
+	unsigned int	ur_frame_size;	/* Size of frame */
+	unsigned int	ur_frame_nr;	/* Total number of frames */
+};
+
+struct unix_frame_hdr {
+	unsigned int	uf_status;
+	unsigned int	uf_len;
+	unsigned int	uf_pid;
+	unsigned int	uf_uid;
+	unsigned int	uf_gid;
+};
+
+/* uf_status */
+#define UNIX_FRAME_KERNEL	0	/* slot belongs to the kernel */
+#define UNIX_FRAME_USER		1	/* slot holds a message for the reader */
+
+#define UNIX_FRAME_ALIGNMENT	16
+#define UNIX_FRAME_ALIGN(x)	(((x) + UNIX_FRAME_ALIGNMENT - 1) & \
+				 ~(UNIX_FRAME_ALIGNMENT - 1))
+#define UNIX_FRAME_HDRLEN	UNIX_FRAME_ALIGN(sizeof(struct unix_frame_hdr))
+
 #endif /* _LINUX_UN_H */
@@ -0,0 +1,32 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/gfp.h>
+#include <linux/types.h>
+
+struct notifier_block;
+
+/* Pressure levels, as a share of scanned pages that were not reclaimed */
+#define VMPRESSURE_LEVEL_MED		60
+#define VMPRESSURE_LEVEL_CRITICAL	95
+
+/* Time allocating tasks spent in direct reclaim */
+struct vmpressure_stall_stats {
+	u64 stalls;
+	u64 stall_ns;
+	u64 max_stall_ns;
+};
+
+extern void vmpressure(gfp_t gfp_mask, unsigned long scanned,
+		       unsigned long reclaimed);
+extern void vmpressure_stall(u64 ns);
+extern void vmpressure_get_stall_stats(struct vmpressure_stall_stats *stats);
+
+/*
+ * Notifiers are called from process context with the pressure, 0 to
+ * 100, of each window of reclaim as the action.
+ */
+extern int vmpressure_register_notifier(struct notifier_block *nb);
+extern int vmpressure_unregister_notifier(struct notifier_block *nb);
+
+#endif /* __LINUX_VMPRESSURE_H */
@@ -32,6 +32,19 @@ struct unix_skb_parms {
 #endif
 };
 
+/* Receive ring shared with user space, see Documentation/networking/unix_mmap.txt */
+struct unix_ring {
+	struct mutex		lock;		/* serialises senders	*/
+	char			**pg_vec;
+	unsigned int		pg_vec_order;
+	unsigned int		pg_vec_pages;
+	unsigned int		pg_vec_len;
+	unsigned int		frames_per_block;
+	unsigned int		frame_size;
+	unsigned int		frame_max;
+	unsigned int		head;
+};
+
 #define UNIXCB(skb) 	(*(struct unix_skb_parms *)&((skb)->cb))
 #define UNIXSID(skb)	(&UNIXCB((skb)).secid)
 
@@ -58,6 +71,7 @@ struct unix_sock {
 	unsigned int		gc_maybe_cycle : 1;
 	unsigned char		recursion_level;
 	struct socket_wq	peer_wq;
+	struct unix_ring	*rx_ring;
 };
 #define unix_sk(__sk) ((struct unix_sock *)__sk)
 
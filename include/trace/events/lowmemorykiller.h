@@ -0,0 +1,62 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+	TP_PROTO(struct task_struct *selected, int oom_adj, int tasksize,
+		 int min_adj, int minfree, int other_free, int other_file,
+		 int pressure, int scanned, u64 latency_ns),
+	TP_ARGS(selected, oom_adj, tasksize, min_adj, minfree, other_free,
+		other_file, pressure, scanned, latency_ns),
+
+	TP_STRUCT__entry(
+	    __array(char,        comm, TASK_COMM_LEN )
+	    __field(pid_t,       pid                 )
+	    __field(int,         oom_adj             )
+	    __field(int,         tasksize            )
+	    __field(int,         min_adj             )
+	    __field(int,         minfree             )
+	    __field(int,         other_free          )
+	    __field(int,         other_file          )
+	    __field(int,         pressure            )
+	    __field(int,         scanned             )
+	    __field(u64,         latency_ns          )
+	),
+
+	TP_fast_assign(
+	    if (selected) {
+		    memcpy(__entry->comm, selected->comm, TASK_COMM_LEN);
+		    __entry->pid = selected->pid;
+	    } else {
+		    __entry->comm[0] = '\0';
+		    __entry->pid = 0;
+	    }
+	    __entry->oom_adj = oom_adj;
+	    __entry->tasksize = tasksize;
+	    __entry->min_adj = min_adj;
+	    __entry->minfree = minfree;
+	    __entry->other_free = other_free;
+	    __entry->other_file = other_file;
+	    __entry->pressure = pressure;
+	    __entry->scanned = scanned;
+	    __entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("pid=%d comm=%s adj=%d size=%d reason: free=%d file=%d "
+		  "below minfree=%d for adj>=%d pressure=%d, scanned=%d "
+		  "in %llu ns",
+		  __entry->pid, __entry->comm, __entry->oom_adj,
+		  __entry->tasksize, __entry->other_free, __entry->other_file,
+		  __entry->minfree, __entry->min_adj, __entry->pressure,
+		  __entry->scanned, __entry->latency_ns)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -1395,6 +1395,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	cgroup_post_fork(p);
 	if (clone_flags & CLONE_THREAD)
 		threadgroup_fork_read_unlock(current);
+	else
+		lowmem_adj_update(p);
 	perf_event_fork(p);
 	return p;
 
@@ -59,6 +59,8 @@
 #include <linux/magic.h>
 #include <linux/pid.h>
 #include <linux/nsproxy.h>
+#include <linux/bootmem.h>
+#include <linux/log2.h>
 
 #include <asm/futex.h>
 
@@ -66,7 +68,14 @@
 
 int __read_mostly futex_cmpxchg_enabled;
 
+/*
+ * Buckets per possible CPU. The table is sized at boot, limited to one
+ * bucket per FUTEX_HASH_RAM_PAGES pages of memory but never smaller than
+ * 1 << FUTEX_HASHBITS.
+ */
 #define FUTEX_HASHBITS (CONFIG_BASE_SMALL ? 4 : 8)
+#define FUTEX_HASH_PER_CPU (CONFIG_BASE_SMALL ? 16 : 256)
+#define FUTEX_HASH_RAM_PAGES 16
 
 /*
  * Futex flags used to encode options to functions and preserve them across
@@ -145,9 +154,10 @@ static const struct futex_q futex_q_init = {
 struct futex_hash_bucket {
 	spinlock_t lock;
 	struct plist_head chain;
-};
+} ____cacheline_aligned_in_smp;
 
-static struct futex_hash_bucket futex_queues[1<<FUTEX_HASHBITS];
+static unsigned long __read_mostly futex_hashsize;
+static struct futex_hash_bucket __read_mostly *futex_queues;
 
 /*
  * We hash on the keys returned from get_futex_key (see below).
@@ -157,7 +167,7 @@ static struct futex_hash_bucket *hash_futex(union futex_key *key)
 	u32 hash = jhash2((u32*)&key->both.word,
 			  (sizeof(key->both.word)+sizeof(key->both.ptr))/4,
 			  key->both.offset);
-	return &futex_queues[hash & ((1 << FUTEX_HASHBITS)-1)];
+	return &futex_queues[hash & (futex_hashsize - 1)];
 }
 
 /*
@@ -2723,7 +2733,24 @@ SYSCALL_DEFINE6(futex, u32 __user *, uaddr, int, op, u32, val,
 static int __init futex_init(void)
 {
 	u32 curval;
-	int i;
+	unsigned long i;
+	unsigned long size;
+	unsigned int futex_shift;
+
+	/*
+	 * Spread the buckets with the number of CPUs that may contend on
+	 * them, without letting the table take a noticeable share of RAM.
+	 */
+	size = FUTEX_HASH_PER_CPU * num_possible_cpus();
+	size = min(size, totalram_pages / FUTEX_HASH_RAM_PAGES);
+	size = max(size, 1UL << FUTEX_HASHBITS);
+	size = roundup_pow_of_two(size);
+
+	futex_queues = alloc_large_system_hash("futex",
+					       sizeof(*futex_queues),
+					       size, 0, 0,
+					       &futex_shift, NULL, size);
+	futex_hashsize = 1UL << futex_shift;
 
 	/*
 	 * This will fail and we want it. Some arch implementations do
@@ -2738,7 +2765,7 @@ static int __init futex_init(void)
 	if (cmpxchg_futex_value_locked(&curval, NULL, 0, 0) == -EFAULT)
 		futex_cmpxchg_enabled = 1;
 
-	for (i = 0; i < ARRAY_SIZE(futex_queues); i++) {
+	for (i = 0; i < futex_hashsize; i++) {
 		plist_head_init(&futex_queues[i].chain);
 		spin_lock_init(&futex_queues[i].lock);
 	}
@@ -862,7 +862,17 @@ static const char recursion_bug_msg [] =
 		KERN_CRIT "BUG: recent printk recursion!\n";
 static int recursion_bug;
 static int new_text_line = 1;
-static char printk_buf[1024];
+
+/*
+ * Messages are formatted into a per-cpu staging buffer before logbuf_lock
+ * is taken, so that the lock only covers copying the text into log_buf.
+ * 'busy' catches printk recursing while the buffer is in use.
+ */
+struct printk_stage {
+	int busy;
+	char buf[1024];
+};
+static DEFINE_PER_CPU(struct printk_stage, printk_stage);
 
 int printk_delay_msec __read_mostly;
 
@@ -884,9 +894,12 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 	int current_log_level = default_message_loglevel;
 	unsigned long flags;
 	int this_cpu;
+	struct printk_stage *stage;
 	char *p;
 	size_t plen;
 	char special;
+	char tbuf[50];
+	unsigned tlen = 0;
 
 	boot_delay_msec();
 	printk_delay();
@@ -895,6 +908,7 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 	/* This stops the holder of console_sem just where we want him */
 	raw_local_irq_save(flags);
 	this_cpu = smp_processor_id();
+	stage = &per_cpu(printk_stage, this_cpu);
 
 	/*
 	 * Ouch, printk recursed into itself!
@@ -914,24 +928,48 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 		zap_locks();
 	}
 
-	lockdep_off();
-	spin_lock(&logbuf_lock);
-	printk_cpu = this_cpu;
+	/*
+	 * Recursion while formatting: the staging buffer is in use, so this
+	 * message has nowhere to go. Flag it and return - unless we are
+	 * oopsing, then take the buffer over: the interrupted message is
+	 * lost anyway, and its owner may never come back to release it.
+	 */
+	if (unlikely(stage->busy) && !oops_in_progress) {
+		recursion_bug = 1;
+		goto out_restore_irqs;
+	}
 
-	if (recursion_bug) {
-		recursion_bug = 0;
-		strcpy(printk_buf, recursion_bug_msg);
+	stage->busy = 1;
+
+	if (xchg(&recursion_bug, 0)) {
+		strcpy(stage->buf, recursion_bug_msg);
 		printed_len = strlen(recursion_bug_msg);
 	}
-	/* Emit the output into the temporary buffer */
-	printed_len += vscnprintf(printk_buf + printed_len,
-				  sizeof(printk_buf) - printed_len, fmt, args);
+	/* Emit the output into the staging buffer */
+	printed_len += vscnprintf(stage->buf + printed_len,
+				  sizeof(stage->buf) - printed_len, fmt, args);
 
 #ifdef	CONFIG_DEBUG_LL
-	printascii(printk_buf);
+	printascii(stage->buf);
 #endif
 
-	p = printk_buf;
+	if (printk_time) {
+		/* The time stamp for any lines this message starts */
+		unsigned long long t;
+		unsigned long nanosec_rem;
+
+		t = cpu_clock(this_cpu);
+		nanosec_rem = do_div(t, 1000000000);
+		tlen = sprintf(tbuf, "[%5lu.%06lu] ",
+				(unsigned long) t,
+				nanosec_rem / 1000);
+	}
+
+	lockdep_off();
+	spin_lock(&logbuf_lock);
+	printk_cpu = this_cpu;
+
+	p = stage->buf;
 
 	/* Read log level and handle special printk prefix */
 	plen = log_prefix(p, &current_log_level, &special);
@@ -965,7 +1003,7 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 				int i;
 
 				for (i = 0; i < plen; i++)
-					emit_log_char(printk_buf[i]);
+					emit_log_char(stage->buf[i]);
 				printed_len += plen;
 			} else {
 				/* Add log prefix */
@@ -975,18 +1013,9 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 				printed_len += 3;
 			}
 
-			if (printk_time) {
-				/* Add the current time stamp */
-				char tbuf[50], *tp;
-				unsigned tlen;
-				unsigned long long t;
-				unsigned long nanosec_rem;
-
-				t = cpu_clock(printk_cpu);
-				nanosec_rem = do_div(t, 1000000000);
-				tlen = sprintf(tbuf, "[%5lu.%06lu] ",
-						(unsigned long) t,
-						nanosec_rem / 1000);
+			if (tlen) {
+				/* Add the time stamp */
+				char *tp;
 
 				for (tp = tbuf; tp < tbuf + tlen; tp++)
 					emit_log_char(*tp);
@@ -1015,6 +1044,7 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 	if (console_trylock_for_printk(this_cpu))
 		console_unlock();
 
+	stage->busy = 0;
 	lockdep_on();
 out_restore_irqs:
 	raw_local_irq_restore(flags);
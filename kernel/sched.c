@@ -2690,6 +2690,14 @@ static int ttwu_activate_remote(struct task_struct *p, int wake_flags)
 #endif /* __ARCH_WANT_INTERRUPTS_ON_CTXSW */
 #endif /* CONFIG_SMP */
 
+/*
+ * Called after a task has been woken and queued on a cpu, from the
+ * waker's context with no scheduler locks held. Lets cpufreq governors
+ * react to work arriving on a cpu. See struct sched_wake_hint.
+ */
+ATOMIC_NOTIFIER_HEAD(sched_wake_notifier_head);
+EXPORT_SYMBOL_GPL(sched_wake_notifier_head);
+
 static void ttwu_queue(struct task_struct *p, int cpu)
 {
 	struct rq *rq = cpu_rq(cpu);
@@ -2727,6 +2735,8 @@ try_to_wake_up(struct task_struct *p, unsigned int state, int wake_flags)
 {
 	unsigned long flags;
 	int cpu, success = 0;
+	struct sched_wake_hint hint;
+	int notify = 0;
 
 	smp_wmb();
 	raw_spin_lock_irqsave(&p->pi_lock, flags);
@@ -2735,6 +2745,7 @@ try_to_wake_up(struct task_struct *p, unsigned int state, int wake_flags)
 
 	success = 1; /* we're going to change ->state */
 	cpu = task_cpu(p);
+	hint.src_cpu = cpu;
 
 	if (p->on_rq && ttwu_remote(p, wake_flags))
 		goto stat;
@@ -2778,11 +2789,18 @@ try_to_wake_up(struct task_struct *p, unsigned int state, int wake_flags)
 #endif /* CONFIG_SMP */
 
 	ttwu_queue(p, cpu);
+	notify = 1;
 stat:
 	ttwu_stat(p, cpu, wake_flags);
 out:
 	raw_spin_unlock_irqrestore(&p->pi_lock, flags);
 
+	if (notify && rcu_access_pointer(sched_wake_notifier_head.head)) {
+		hint.dest_cpu = cpu;
+		hint.task = p;
+		atomic_notifier_call_chain(&sched_wake_notifier_head, 0, &hint);
+	}
+
 	return success;
 }
 
@@ -3294,33 +3312,44 @@ unsigned long nr_iowait(void)
 	return sum;
 }
 
-unsigned long avg_nr_running(void)
+unsigned long avg_nr_running_cpu(int cpu)
 {
-	unsigned long i, sum = 0;
+	struct rq *q = cpu_rq(cpu);
 	unsigned int seqcnt, ave_nr_running;
 
-	for_each_online_cpu(i) {
-		struct rq *q = cpu_rq(i);
+	/*
+	 * Update average to avoid reading stalled value if there were
+	 * no run-queue changes for a long time. On the other hand if
+	 * the changes are happening right now, just read current value
+	 * directly.
+	 */
+	seqcnt = read_seqcount_begin(&q->ave_seqcnt);
+	ave_nr_running = do_avg_nr_running(q);
+	if (read_seqcount_retry(&q->ave_seqcnt, seqcnt)) {
+		read_seqcount_begin(&q->ave_seqcnt);
+		ave_nr_running = q->ave_nr_running;
+	}
 
-		/*
-		 * Update average to avoid reading stalled value if there were
-		 * no run-queue changes for a long time. On the other hand if
-		 * the changes are happening right now, just read current value
-		 * directly.
-		 */
-		seqcnt = read_seqcount_begin(&q->ave_seqcnt);
-		ave_nr_running = do_avg_nr_running(q);
-		if (read_seqcount_retry(&q->ave_seqcnt, seqcnt)) {
-			read_seqcount_begin(&q->ave_seqcnt);
-			ave_nr_running = q->ave_nr_running;
-		}
+	return ave_nr_running;
+}
+EXPORT_SYMBOL_GPL(avg_nr_running_cpu);
 
-		sum += ave_nr_running;
-	}
+unsigned long avg_nr_running(void)
+{
+	unsigned long i, sum = 0;
+
+	for_each_online_cpu(i)
+		sum += avg_nr_running_cpu(i);
 
 	return sum;
 }
 
+unsigned long nr_running_cpu(int cpu)
+{
+	return cpu_rq(cpu)->nr_running;
+}
+EXPORT_SYMBOL_GPL(nr_running_cpu);
+
 unsigned long nr_iowait_cpu(int cpu)
 {
 	struct rq *this = cpu_rq(cpu);
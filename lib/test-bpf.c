@@ -0,0 +1,464 @@
+/*
+ * Runtime checks for the BPF socket filter interpreter and JIT.
+ *
+ * Each filter below is attached to a kernel socket, which compiles it
+ * when net.core.bpf_jit_enable is set, and run against a test packet
+ * both by sk_run_filter() and by the compiled code. Results differing
+ * from the expected value or from each other are reported. With
+ * runs=N every filter is run N times and both are timed.
+ */
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/filter.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/in.h>
+#include <linux/net.h>
+#include <linux/ktime.h>
+#include <net/sock.h>
+#include <asm/uaccess.h>
+
+static unsigned int runs = 1;
+module_param(runs, uint, 0444);
+MODULE_PARM_DESC(runs, "Times to run each filter, timed if more than 1");
+
+#define TEST_DEV	0x01	/* skb->dev is the loopback device */
+#define TEST_FRAG	0x02	/* only the link header is in the head */
+
+/* Ethernet, IPv4 192.168.0.1 -> 192.168.0.2, TCP 1234 -> 80, payload */
+static const u8 test_pkt[64] __initconst = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0x88, 0x99, 0xaa, 0xbb, 0x08, 0x00,
+	0x45, 0x00, 0x00, 0x32, 0x12, 0x34, 0x40, 0x00,
+	0x40, 0x06, 0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01,
+	0xc0, 0xa8, 0x00, 0x02,
+	0x04, 0xd2, 0x00, 0x50, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x50, 0x02, 0xff, 0xff,
+	0x00, 0x00, 0x00, 0x00,
+	0xde, 0xad, 0xbe, 0xef, 0x01, 0x02, 0x03, 0x04,
+	0x05, 0x06,
+};
+
+#define RET_A		BPF_STMT(BPF_RET | BPF_A, 0)
+#define RET_K(k)	BPF_STMT(BPF_RET | BPF_K, k)
+#define LD_IMM(k)	BPF_STMT(BPF_LD | BPF_IMM, k)
+#define LDX_IMM(k)	BPF_STMT(BPF_LDX | BPF_IMM, k)
+#define ALU_K(op, k)	BPF_STMT(BPF_ALU | op | BPF_K, k)
+#define ALU_X(op)	BPF_STMT(BPF_ALU | op | BPF_X, 0)
+/* A op k: return 1 if true, 2 if not */
+#define JMP_K(op, k)	BPF_JUMP(BPF_JMP | op | BPF_K, k, 0, 1), \
+			RET_K(1), RET_K(2)
+#define JMP_X(op)	BPF_JUMP(BPF_JMP | op | BPF_X, 0, 0, 1), \
+			RET_K(1), RET_K(2)
+
+static struct sock_filter ret_k[] __initdata = {
+	RET_K(0x12345),
+};
+
+static struct sock_filter ld_imm[] __initdata = {
+	LD_IMM(0xdeadbeef), RET_A,
+};
+
+static struct sock_filter ldx_imm[] __initdata = {
+	LDX_IMM(0x42), BPF_STMT(BPF_MISC | BPF_TXA, 0), RET_A,
+};
+
+static struct sock_filter tax[] __initdata = {
+	LD_IMM(9), BPF_STMT(BPF_MISC | BPF_TAX, 0), LD_IMM(1),
+	BPF_STMT(BPF_MISC | BPF_TXA, 0), RET_A,
+};
+
+static struct sock_filter alu_k[] __initdata = {
+	LD_IMM(10), ALU_K(BPF_ADD, 5), ALU_K(BPF_SUB, 3), ALU_K(BPF_MUL, 7),
+	ALU_K(BPF_DIV, 4), ALU_K(BPF_OR, 0x100), ALU_K(BPF_AND, 0xff0),
+	ALU_K(BPF_LSH, 4), ALU_K(BPF_RSH, 8), BPF_STMT(BPF_ALU | BPF_NEG, 0),
+	RET_A,
+};
+
+static struct sock_filter alu_x[] __initdata = {
+	LDX_IMM(3), LD_IMM(10), ALU_X(BPF_ADD), ALU_X(BPF_SUB), ALU_X(BPF_MUL),
+	ALU_X(BPF_DIV), ALU_X(BPF_OR), ALU_X(BPF_AND), ALU_X(BPF_LSH),
+	ALU_X(BPF_RSH), RET_A,
+};
+
+/* sk_chk_filter() turns K into a reciprocal, which rounds this one up */
+static struct sock_filter div_k[] __initdata = {
+	LD_IMM(0xfffffffe), ALU_K(BPF_DIV, 3), RET_A,
+};
+
+static struct sock_filter div_x_zero[] __initdata = {
+	LDX_IMM(0), LD_IMM(10), ALU_X(BPF_DIV), RET_K(1),
+};
+
+static struct sock_filter jeq_k[] __initdata = {
+	LD_IMM(5), JMP_K(BPF_JEQ, 5),
+};
+
+static struct sock_filter jgt_k[] __initdata = {
+	LD_IMM(5), JMP_K(BPF_JGT, 5),
+};
+
+static struct sock_filter jgt_k_unsigned[] __initdata = {
+	LD_IMM(0xffffffff), JMP_K(BPF_JGT, 1),
+};
+
+static struct sock_filter jge_k[] __initdata = {
+	LD_IMM(5), JMP_K(BPF_JGE, 5),
+};
+
+static struct sock_filter jset_k[] __initdata = {
+	LD_IMM(5), JMP_K(BPF_JSET, 2),
+};
+
+static struct sock_filter jeq_x[] __initdata = {
+	LDX_IMM(7), LD_IMM(7), JMP_X(BPF_JEQ),
+};
+
+static struct sock_filter jgt_x[] __initdata = {
+	LDX_IMM(7), LD_IMM(8), JMP_X(BPF_JGT),
+};
+
+static struct sock_filter jge_x[] __initdata = {
+	LDX_IMM(9), LD_IMM(8), JMP_X(BPF_JGE),
+};
+
+static struct sock_filter jset_x[] __initdata = {
+	LDX_IMM(12), LD_IMM(4), JMP_X(BPF_JSET),
+};
+
+static struct sock_filter ja[] __initdata = {
+	BPF_STMT(BPF_JMP | BPF_JA, 1), RET_K(0), RET_K(7),
+};
+
+static struct sock_filter scratch[] __initdata = {
+	LD_IMM(0x1234), BPF_STMT(BPF_ST, 3), LDX_IMM(7), BPF_STMT(BPF_STX, 15),
+	BPF_STMT(BPF_LDX | BPF_MEM, 3), BPF_STMT(BPF_LD | BPF_MEM, 15),
+	ALU_X(BPF_ADD), RET_A,
+};
+
+static struct sock_filter ld_abs_b[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23), RET_A,
+};
+
+static struct sock_filter ld_abs_h[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12), RET_A,
+};
+
+static struct sock_filter ld_abs_w[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 26), RET_A,
+};
+
+static struct sock_filter ld_abs_w_split[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12), RET_A,
+};
+
+static struct sock_filter ld_abs_oob[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 62), RET_K(1),
+};
+
+static struct sock_filter ld_len[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0), RET_A,
+};
+
+static struct sock_filter ldx_len[] __initdata = {
+	BPF_STMT(BPF_LDX | BPF_W | BPF_LEN, 0),
+	BPF_STMT(BPF_MISC | BPF_TXA, 0), RET_A,
+};
+
+static struct sock_filter ldx_msh[] __initdata = {
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+	BPF_STMT(BPF_MISC | BPF_TXA, 0), RET_A,
+};
+
+static struct sock_filter tcp_dport[] __initdata = {
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16), RET_A,
+};
+
+static struct sock_filter ld_ind_b[] __initdata = {
+	LDX_IMM(20), BPF_STMT(BPF_LD | BPF_B | BPF_IND, 3), RET_A,
+};
+
+static struct sock_filter ld_ind_w[] __initdata = {
+	LDX_IMM(20), BPF_STMT(BPF_LD | BPF_W | BPF_IND, 10), RET_A,
+};
+
+static struct sock_filter ld_ind_oob[] __initdata = {
+	LDX_IMM(60), BPF_STMT(BPF_LD | BPF_W | BPF_IND, 2), RET_K(1),
+};
+
+static struct sock_filter ld_net_off[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF + 9), RET_A,
+};
+
+static struct sock_filter ld_ll_off[] __initdata = {
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_LL_OFF + 12), RET_A,
+};
+
+static struct sock_filter ld_ind_net_off[] __initdata = {
+	LDX_IMM(9), BPF_STMT(BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF), RET_A,
+};
+
+#define LD_ANC(what)	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + what)
+
+static struct sock_filter anc_protocol[] __initdata = {
+	LD_ANC(SKF_AD_PROTOCOL), RET_A,
+};
+
+static struct sock_filter anc_pkttype[] __initdata = {
+	LD_ANC(SKF_AD_PKTTYPE), RET_A,
+};
+
+static struct sock_filter anc_ifindex[] __initdata = {
+	LD_ANC(SKF_AD_IFINDEX), RET_A,
+};
+
+static struct sock_filter anc_mark[] __initdata = {
+	LD_ANC(SKF_AD_MARK), RET_A,
+};
+
+static struct sock_filter anc_queue[] __initdata = {
+	LD_ANC(SKF_AD_QUEUE), RET_A,
+};
+
+static struct sock_filter anc_hatype[] __initdata = {
+	LD_ANC(SKF_AD_HATYPE), RET_A,
+};
+
+static struct sock_filter anc_rxhash[] __initdata = {
+	LD_ANC(SKF_AD_RXHASH), RET_A,
+};
+
+static struct sock_filter anc_cpu[] __initdata = {
+	LD_ANC(SKF_AD_CPU), BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, NR_CPUS, 0, 1),
+	RET_K(0), RET_K(1),
+};
+
+struct bpf_test {
+	const char *name;
+	struct sock_filter *insns;
+	unsigned short len;
+	unsigned short flags;
+	u32 result;
+};
+
+#define BPF_TEST(prog, flags, result)	\
+	{ #prog, prog, ARRAY_SIZE(prog), flags, result }
+
+static const struct bpf_test tests[] __initconst = {
+	BPF_TEST(ret_k,			0,		0x12345),
+	BPF_TEST(ld_imm,		0,		0xdeadbeef),
+	BPF_TEST(ldx_imm,		0,		0x42),
+	BPF_TEST(tax,			0,		9),
+	BPF_TEST(alu_k,			0,		0xffffffef),
+	BPF_TEST(alu_x,			0,		3),
+	BPF_TEST(div_k,			0,		0x55555555),
+	BPF_TEST(div_x_zero,		0,		0),
+	BPF_TEST(jeq_k,			0,		1),
+	BPF_TEST(jgt_k,			0,		2),
+	BPF_TEST(jgt_k_unsigned,	0,		1),
+	BPF_TEST(jge_k,			0,		1),
+	BPF_TEST(jset_k,		0,		2),
+	BPF_TEST(jeq_x,			0,		1),
+	BPF_TEST(jgt_x,			0,		1),
+	BPF_TEST(jge_x,			0,		2),
+	BPF_TEST(jset_x,		0,		1),
+	BPF_TEST(ja,			0,		7),
+	BPF_TEST(scratch,		0,		0x123b),
+	BPF_TEST(ld_abs_b,		0,		6),
+	BPF_TEST(ld_abs_h,		0,		0x0800),
+	BPF_TEST(ld_abs_w,		0,		0xc0a80001),
+	BPF_TEST(ld_abs_w,		TEST_FRAG,	0xc0a80001),
+	BPF_TEST(ld_abs_w_split,	0,		0x08004500),
+	BPF_TEST(ld_abs_w_split,	TEST_FRAG,	0x08004500),
+	BPF_TEST(ld_abs_oob,		0,		0),
+	BPF_TEST(ld_len,		0,		64),
+	BPF_TEST(ld_len,		TEST_FRAG,	64),
+	BPF_TEST(ldx_len,		0,		64),
+	BPF_TEST(ldx_msh,		0,		20),
+	BPF_TEST(tcp_dport,		0,		80),
+	BPF_TEST(tcp_dport,		TEST_FRAG,	80),
+	BPF_TEST(ld_ind_b,		0,		6),
+	BPF_TEST(ld_ind_w,		0,		0xc0a80002),
+	BPF_TEST(ld_ind_w,		TEST_FRAG,	0xc0a80002),
+	BPF_TEST(ld_ind_oob,		0,		0),
+	BPF_TEST(ld_net_off,		0,		6),
+	/* the network header is past the linear part */
+	BPF_TEST(ld_net_off,		TEST_FRAG,	0),
+	BPF_TEST(ld_ll_off,		0,		0x0800),
+	BPF_TEST(ld_ind_net_off,	0,		6),
+	BPF_TEST(anc_protocol,		0,		ETH_P_IP),
+	BPF_TEST(anc_pkttype,		0,		PACKET_OTHERHOST),
+	BPF_TEST(anc_ifindex,		0,		0),
+	/* loopback is the first device registered in init_net */
+	BPF_TEST(anc_ifindex,		TEST_DEV,	1),
+	BPF_TEST(anc_mark,		0,		0xabcd),
+	BPF_TEST(anc_queue,		0,		3),
+	BPF_TEST(anc_hatype,		0,		0),
+	BPF_TEST(anc_hatype,		TEST_DEV,	ARPHRD_LOOPBACK),
+	BPF_TEST(anc_rxhash,		0,		0x11223344),
+	BPF_TEST(anc_cpu,		0,		1),
+};
+
+static struct sk_buff *__init test_skb(unsigned int flags)
+{
+	unsigned int head = flags & TEST_FRAG ? ETH_HLEN : sizeof(test_pkt);
+	unsigned int rest = sizeof(test_pkt) - head;
+	struct sk_buff *skb;
+	struct page *page;
+
+	skb = alloc_skb(head, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+	memcpy(skb_put(skb, head), test_pkt, head);
+
+	if (rest) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			kfree_skb(skb);
+			return NULL;
+		}
+		memcpy(page_address(page), test_pkt + head, rest);
+		skb_fill_page_desc(skb, 0, page, 0, rest);
+		skb->len += rest;
+		skb->data_len += rest;
+		skb->truesize += PAGE_SIZE;
+	}
+
+	skb_reset_mac_header(skb);
+	skb_set_network_header(skb, ETH_HLEN);
+	skb->protocol = htons(ETH_P_IP);
+	skb->pkt_type = PACKET_OTHERHOST;
+	skb->mark = 0xabcd;
+	skb->queue_mapping = 3;
+	skb->rxhash = 0x11223344;
+	if (flags & TEST_DEV)
+		skb->dev = init_net.loopback_dev;
+
+	return skb;
+}
+
+static u32 __init run_filter(unsigned int (*func)(const struct sk_buff *,
+						  const struct sock_filter *),
+			     const struct sk_buff *skb,
+			     const struct sock_filter *insns, u64 *ns)
+{
+	ktime_t start;
+	unsigned int i;
+	u32 ret = 0;
+
+	start = ktime_get();
+	preempt_disable();
+	for (i = 0; i < runs; i++)
+		ret = func(skb, insns);
+	preempt_enable();
+	*ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	return ret;
+}
+
+static int __init run_test(struct socket *sock, const struct bpf_test *t,
+			   int *jited)
+{
+	struct sock *sk = sock->sk;
+	struct sock_fprog fprog;
+	struct sk_filter *fp;
+	struct sk_buff *skb;
+	mm_segment_t oldfs;
+	u32 interp, jit;
+	u64 interp_ns, jit_ns;
+	int err;
+
+	skb = test_skb(t->flags);
+	if (!skb)
+		return -ENOMEM;
+
+	fprog.len = t->len;
+	fprog.filter = (struct sock_filter __user *)t->insns;
+
+	lock_sock(sk);
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = sk_attach_filter(&fprog, sk);
+	set_fs(oldfs);
+	if (err) {
+		pr_err("test_bpf: %s: filter rejected: %d\n", t->name, err);
+		goto out;
+	}
+	fp = rcu_dereference_protected(sk->sk_filter, sock_owned_by_user(sk));
+
+	interp = run_filter(sk_run_filter, skb, fp->insns, &interp_ns);
+	if (interp != t->result) {
+		pr_err("test_bpf: %s (flags %#x): interpreter returned %#x, expected %#x\n",
+		       t->name, t->flags, interp, t->result);
+		err = -EINVAL;
+	}
+
+	*jited = fp->bpf_func != sk_run_filter;
+	if (*jited) {
+		jit = run_filter(fp->bpf_func, skb, fp->insns, &jit_ns);
+		if (jit != interp) {
+			pr_err("test_bpf: %s (flags %#x): JIT returned %#x, interpreter %#x\n",
+			       t->name, t->flags, jit, interp);
+			err = -EINVAL;
+		}
+	}
+
+	if (runs > 1) {
+		if (*jited)
+			pr_info("test_bpf: %s (flags %#x): %llu ns interpreted, %llu ns compiled\n",
+				t->name, t->flags, div_u64(interp_ns, runs),
+				div_u64(jit_ns, runs));
+		else
+			pr_info("test_bpf: %s (flags %#x): %llu ns interpreted\n",
+				t->name, t->flags, div_u64(interp_ns, runs));
+	}
+
+	sk_detach_filter(sk);
+out:
+	release_sock(sk);
+	kfree_skb(skb);
+	return err;
+}
+
+static int __init test_bpf_init(void)
+{
+	struct socket *sock;
+	int i, jited, n_jited = 0, failed = 0;
+	int err;
+
+	if (!runs)
+		runs = 1;
+
+	err = sock_create_kern(PF_INET, SOCK_DGRAM, IPPROTO_UDP, &sock);
+	if (err)
+		return err;
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		jited = 0;
+		if (run_test(sock, &tests[i], &jited))
+			failed++;
+		n_jited += jited;
+	}
+
+	sock_release(sock);
+
+	pr_info("test_bpf: %d tests, %d compiled, %d failed\n",
+		(int)ARRAY_SIZE(tests), n_jited, failed);
+	if (!n_jited)
+		pr_info("test_bpf: no filter was compiled, set net.core.bpf_jit_enable to test the JIT\n");
+
+	return failed ? -EINVAL : 0;
+}
+module_init(test_bpf_init);
+
+static void __exit test_bpf_exit(void)
+{
+}
+module_exit(test_bpf_exit);
+
+MODULE_LICENSE("GPL");
@@ -57,6 +57,7 @@
 #include <linux/ftrace_event.h>
 #include <linux/memcontrol.h>
 #include <linux/prefetch.h>
+#include <linux/vmpressure.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -1958,6 +1959,7 @@ __alloc_pages_direct_reclaim(gfp_t gfp_mask, unsigned int order,
 	struct page *page = NULL;
 	struct reclaim_state reclaim_state;
 	bool drained = false;
+	u64 start;
 
 	cond_resched();
 
@@ -1968,7 +1970,9 @@ __alloc_pages_direct_reclaim(gfp_t gfp_mask, unsigned int order,
 	reclaim_state.reclaimed_slab = 0;
 	current->reclaim_state = &reclaim_state;
 
+	start = local_clock();
 	*did_some_progress = try_to_free_pages(zonelist, order, gfp_mask, nodemask);
+	vmpressure_stall(local_clock() - start);
 
 	current->reclaim_state = NULL;
 	lockdep_clear_current_reclaim_state();
@@ -0,0 +1,126 @@
+/*
+ * Memory pressure from reclaim efficiency
+ *
+ * vmscan reports how many pages each pass over a zone scanned and
+ * reclaimed. Once vmpressure_win pages were scanned, the share of
+ * them that could not be reclaimed is the pressure of that window,
+ * 0 meaning everything scanned was freed and 100 meaning nothing
+ * was. It is passed to the registered notifiers from a work item,
+ * since reclaim runs with locks held and must not be slowed down.
+ *
+ * This file is released under the GPL v2.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/vmpressure.h>
+#include <linux/workqueue.h>
+
+/* Same window as SWAP_CLUSTER_MAX-sized batches over 16 passes */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+static struct vmpressure_stall_stats vmpressure_stall_stats;
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+static unsigned long vmpressure_calc(unsigned long scanned,
+				     unsigned long reclaimed)
+{
+	/* Reclaim can free more than it scanned, e.g. through slab */
+	if (reclaimed >= scanned)
+		return 0;
+
+	return 100 - reclaimed * 100 / scanned;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	unsigned long scanned, reclaimed;
+
+	spin_lock(&vmpressure_lock);
+	scanned = vmpressure_scanned;
+	reclaimed = vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	if (!scanned)
+		return;
+
+	blocking_notifier_call_chain(&vmpressure_notifier,
+				     vmpressure_calc(scanned, reclaimed), NULL);
+}
+
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+/**
+ * vmpressure() - account reclaim efficiency
+ * @gfp_mask:	allocation mask of the reclaim
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called by vmscan after each pass over a zone, for global reclaim.
+ */
+void vmpressure(gfp_t gfp_mask, unsigned long scanned,
+		unsigned long reclaimed)
+{
+	bool full;
+
+	/*
+	 * Reclaim for allocations that cannot do I/O or use highmem or
+	 * movable pages says little about the pressure on the system.
+	 */
+	if (!(gfp_mask & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	full = vmpressure_scanned >= vmpressure_win;
+	spin_unlock(&vmpressure_lock);
+
+	if (full)
+		schedule_work(&vmpressure_work);
+}
+
+/* Account time an allocating task spent in direct reclaim */
+void vmpressure_stall(u64 ns)
+{
+	struct vmpressure_stall_stats *st = &vmpressure_stall_stats;
+
+	spin_lock(&vmpressure_lock);
+	st->stalls++;
+	st->stall_ns += ns;
+	if (ns > st->max_stall_ns)
+		st->max_stall_ns = ns;
+	spin_unlock(&vmpressure_lock);
+}
+
+void vmpressure_get_stall_stats(struct vmpressure_stall_stats *stats)
+{
+	spin_lock(&vmpressure_lock);
+	*stats = vmpressure_stall_stats;
+	spin_unlock(&vmpressure_lock);
+}
+EXPORT_SYMBOL_GPL(vmpressure_get_stall_stats);
+
+int vmpressure_register_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_register_notifier);
+
+int vmpressure_unregister_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_unregister_notifier);
@@ -11,8 +11,12 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock_types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -149,6 +153,16 @@ static inline tag_t make_atag_from_value(uint32_t value)
  */
 #define DEFAULT_MAX_SOCK_TAGS 1024
 
+/*
+ * The packet path does not take any of the global locks: it finds the
+ * sock_tag, the tag_stat and the tag_counter_set through these RCU hashes.
+ * The rb-trees are kept for the ctrl/stats readers and are only walked
+ * with the matching lock held.
+ */
+#define SOCK_TAG_HASH_BITS 8
+#define TAG_COUNTER_SET_HASH_BITS 6
+#define TAG_STAT_HASH_BITS 5
+
 /*
  * For now we only track 2 sets of counters.
  * The default set is 0.
@@ -179,20 +193,36 @@ struct data_counters {
 	struct byte_packet_counters bpc[IFS_MAX_COUNTER_SETS][IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
 };
 
+/*
+ * Each cpu bills its own copy of the counters, without any lock.
+ * They are only summed up when read, see data_counters_fold().
+ */
+struct data_counters_cpu {
+	struct data_counters dc;
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
+void data_counters_fold(const struct data_counters_cpu *pcpu,
+			struct data_counters *dc);
+
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
 	struct rb_node node;
+	/* Only used by the nodes that are also looked up from the packet path */
+	struct hlist_node hash_node;
 	tag_t tag;
 };
 
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
+	struct rcu_head rcu;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct data_counters_cpu *parent_counters;
+	/* nr_cpu_ids entries, indexed by cpu */
+	struct data_counters_cpu counters[0];
 };
 
 struct iface_stat {
@@ -219,6 +249,8 @@ struct iface_stat {
 
 	struct rb_root tag_stat_tree;
 	spinlock_t tag_stat_list_lock;
+	/* Same entries as tag_stat_tree, for lockless lookups */
+	struct hlist_head tag_stat_hash[1 << TAG_STAT_HASH_BITS];
 };
 
 /* This is needed to create proc_dir_entries from atomic context. */
@@ -235,6 +267,7 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	struct hlist_node hash_node;  /* in sock_tag_hash */
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -242,7 +275,10 @@ struct sock_tag {
 	struct list_head list;   /* in proc_qtu_data.sock_tag_list */
 	pid_t pid;
 
+	/* A re-tag changes the tag under lockless readers */
+	seqcount_t tag_seq;
 	tag_t tag;
+	struct rcu_head rcu;
 };
 
 struct qtaguid_event_counts {
@@ -279,6 +315,7 @@ struct qtaguid_event_counts {
 struct tag_counter_set {
 	struct tag_node tn;
 	int active_set;
+	struct rcu_head rcu;
 };
 
 /*----------------------------------------------*/
@@ -114,6 +114,9 @@
 #include <linux/mount.h>
 #include <net/checksum.h>
 #include <linux/security.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <asm/cacheflush.h>
 
 static struct hlist_head unix_socket_table[UNIX_HASH_SIZE + 1];
 static DEFINE_SPINLOCK(unix_table_lock);
@@ -172,6 +175,71 @@ static inline int unix_recvq_full(struct sock const *sk)
 	return skb_queue_len(&sk->sk_receive_queue) > sk->sk_max_ack_backlog;
 }
 
+/*
+ *	Memory mapped receive ring.  The ring is owned by the receiving
+ *	socket and never changes once installed, so anyone holding a
+ *	reference to the socket may look it up without locking; only
+ *	filling a slot takes ring->lock.
+ */
+
+static inline struct unix_ring *unix_rx_ring(struct sock *sk)
+{
+	struct unix_ring *ring = ACCESS_ONCE(unix_sk(sk)->rx_ring);
+
+	smp_read_barrier_depends();
+	return ring;
+}
+
+static inline __pure struct page *unix_ring_page(void *addr)
+{
+	if (is_vmalloc_addr(addr))
+		return vmalloc_to_page(addr);
+	return virt_to_page(addr);
+}
+
+static struct unix_frame_hdr *unix_ring_frame(struct unix_ring *ring,
+					      unsigned int pos)
+{
+	unsigned int idx = pos / ring->frames_per_block;
+	unsigned int off = pos % ring->frames_per_block;
+
+	return (struct unix_frame_hdr *)(ring->pg_vec[idx] +
+					 off * ring->frame_size);
+}
+
+static unsigned int unix_ring_get_status(struct unix_frame_hdr *h)
+{
+	smp_rmb();
+	flush_dcache_page(unix_ring_page(&h->uf_status));
+	return h->uf_status;
+}
+
+static void unix_ring_set_status(struct unix_frame_hdr *h, unsigned int status)
+{
+	h->uf_status = status;
+	flush_dcache_page(unix_ring_page(&h->uf_status));
+	smp_wmb();
+}
+
+static inline int unix_ring_full(struct unix_ring *ring)
+{
+	return unix_ring_get_status(unix_ring_frame(ring,
+				ACCESS_ONCE(ring->head))) != UNIX_FRAME_KERNEL;
+}
+
+/* The reader consumes frames in order, so the ring holds unread
+ * messages exactly when the most recently filled slot is still
+ * owned by user space.
+ */
+static inline int unix_ring_readable(struct unix_ring *ring)
+{
+	unsigned int head = ACCESS_ONCE(ring->head);
+
+	head = head ? head - 1 : ring->frame_max;
+	return unix_ring_get_status(unix_ring_frame(ring, head)) !=
+		UNIX_FRAME_KERNEL;
+}
+
 static struct sock *unix_peer_get(struct sock *s)
 {
 	struct sock *peer;
@@ -344,11 +412,77 @@ static void unix_dgram_disconnected(struct sock *sk, struct sock *other)
 	}
 }
 
+static void unix_free_ring(struct unix_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < ring->pg_vec_len; i++) {
+		char *buffer = ring->pg_vec[i];
+
+		if (!buffer)
+			continue;
+		if (is_vmalloc_addr(buffer))
+			vfree(buffer);
+		else
+			free_pages((unsigned long)buffer, ring->pg_vec_order);
+	}
+	kfree(ring->pg_vec);
+	kfree(ring);
+}
+
+static char *unix_alloc_ring_block(unsigned int order)
+{
+	gfp_t gfp_flags = GFP_KERNEL | __GFP_COMP |
+			  __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY;
+	char *buffer;
+
+	buffer = (char *)__get_free_pages(gfp_flags, order);
+	if (buffer)
+		return buffer;
+
+	return vzalloc((1 << order) * PAGE_SIZE);
+}
+
+static struct unix_ring *unix_alloc_ring(struct unix_ring_req *req)
+{
+	struct unix_ring *ring;
+	int i;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+
+	ring->pg_vec = kcalloc(req->ur_block_nr, sizeof(char *), GFP_KERNEL);
+	if (!ring->pg_vec) {
+		kfree(ring);
+		return NULL;
+	}
+
+	mutex_init(&ring->lock);
+	ring->pg_vec_order = get_order(req->ur_block_size);
+	ring->pg_vec_pages = req->ur_block_size / PAGE_SIZE;
+	ring->pg_vec_len = req->ur_block_nr;
+	ring->frames_per_block = req->ur_block_size / req->ur_frame_size;
+	ring->frame_size = req->ur_frame_size;
+	ring->frame_max = req->ur_frame_nr - 1;
+
+	for (i = 0; i < ring->pg_vec_len; i++) {
+		ring->pg_vec[i] = unix_alloc_ring_block(ring->pg_vec_order);
+		if (!ring->pg_vec[i]) {
+			unix_free_ring(ring);
+			return NULL;
+		}
+	}
+	return ring;
+}
+
 static void unix_sock_destructor(struct sock *sk)
 {
 	struct unix_sock *u = unix_sk(sk);
 
 	skb_queue_purge(&sk->sk_receive_queue);
+	if (u->rx_ring)
+		unix_free_ring(u->rx_ring);
 
 	WARN_ON(atomic_read(&sk->sk_wmem_alloc));
 	WARN_ON(!sk_unhashed(sk));
@@ -511,6 +645,10 @@ static unsigned int unix_poll(struct file *, struct socket *, poll_table *);
 static unsigned int unix_dgram_poll(struct file *, struct socket *,
 				    poll_table *);
 static int unix_ioctl(struct socket *, unsigned int, unsigned long);
+static int unix_setsockopt(struct socket *, int, int, char __user *,
+			   unsigned int);
+static int unix_mmap(struct file *, struct socket *,
+		     struct vm_area_struct *);
 static int unix_shutdown(struct socket *, int);
 static int unix_stream_sendmsg(struct kiocb *, struct socket *,
 			       struct msghdr *, size_t);
@@ -561,11 +699,11 @@ static const struct proto_ops unix_dgram_ops = {
 	.ioctl =	unix_ioctl,
 	.listen =	sock_no_listen,
 	.shutdown =	unix_shutdown,
-	.setsockopt =	sock_no_setsockopt,
+	.setsockopt =	unix_setsockopt,
 	.getsockopt =	sock_no_getsockopt,
 	.sendmsg =	unix_dgram_sendmsg,
 	.recvmsg =	unix_dgram_recvmsg,
-	.mmap =		sock_no_mmap,
+	.mmap =		unix_mmap,
 	.sendpage =	sock_no_sendpage,
 };
 
@@ -582,11 +720,11 @@ static const struct proto_ops unix_seqpacket_ops = {
 	.ioctl =	unix_ioctl,
 	.listen =	unix_listen,
 	.shutdown =	unix_shutdown,
-	.setsockopt =	sock_no_setsockopt,
+	.setsockopt =	unix_setsockopt,
 	.getsockopt =	sock_no_getsockopt,
 	.sendmsg =	unix_seqpacket_sendmsg,
 	.recvmsg =	unix_seqpacket_recvmsg,
-	.mmap =		sock_no_mmap,
+	.mmap =		unix_mmap,
 	.sendpage =	sock_no_sendpage,
 };
 
@@ -632,6 +770,7 @@ static struct sock *unix_create1(struct net *net, struct socket *sock)
 	INIT_LIST_HEAD(&u->link);
 	mutex_init(&u->readlock); /* single task reading lock */
 	init_waitqueue_head(&u->peer_wait);
+	u->rx_ring = NULL;
 	unix_insert_socket(unix_sockets_unbound, sk);
 out:
 	if (sk == NULL)
@@ -1020,7 +1159,8 @@ out:
 	return err;
 }
 
-static long unix_wait_for_peer(struct sock *other, long timeo)
+static long unix_wait_for_peer(struct sock *other, struct unix_ring *ring,
+			       long timeo)
 {
 	struct unix_sock *u = unix_sk(other);
 	int sched;
@@ -1030,7 +1170,7 @@ static long unix_wait_for_peer(struct sock *other, long timeo)
 
 	sched = !sock_flag(other, SOCK_DEAD) &&
 		!(other->sk_shutdown & RCV_SHUTDOWN) &&
-		unix_recvq_full(other);
+		(ring ? unix_ring_full(ring) : unix_recvq_full(other));
 
 	unix_state_unlock(other);
 
@@ -1111,7 +1251,7 @@ restart:
 		if (!timeo)
 			goto out_unlock;
 
-		timeo = unix_wait_for_peer(other, timeo);
+		timeo = unix_wait_for_peer(other, NULL, timeo);
 
 		err = sock_intr_errno(timeo);
 		if (signal_pending(current))
@@ -1391,6 +1531,48 @@ static int unix_scm_to_skb(struct scm_cookie *scm, struct sk_buff *skb, bool sen
 	return err;
 }
 
+/*
+ *	Copy a datagram straight into the receiver's ring.  Returns -EAGAIN
+ *	if another sender took the last free slot first.
+ */
+static int unix_ring_send(struct unix_ring *ring, struct msghdr *msg,
+			  size_t len, struct scm_cookie *scm)
+{
+	struct unix_frame_hdr *h;
+	int err;
+
+	mutex_lock(&ring->lock);
+	h = unix_ring_frame(ring, ring->head);
+	err = -EAGAIN;
+	if (unix_ring_get_status(h) != UNIX_FRAME_KERNEL)
+		goto out;
+
+	err = memcpy_fromiovec((u8 *)h + UNIX_FRAME_HDRLEN, msg->msg_iov, len);
+	if (err)
+		goto out;
+
+	h->uf_len = len;
+	h->uf_pid = scm->creds.pid;
+	h->uf_uid = scm->creds.uid;
+	h->uf_gid = scm->creds.gid;
+
+#if ARCH_IMPLEMENTS_FLUSH_DCACHE_PAGE == 1
+	{
+		u8 *start, *end;
+
+		end = (u8 *)PAGE_ALIGN((unsigned long)h + UNIX_FRAME_HDRLEN + len);
+		for (start = (u8 *)h; start < end; start += PAGE_SIZE)
+			flush_dcache_page(unix_ring_page(start));
+	}
+#endif
+	smp_wmb();
+	unix_ring_set_status(h, UNIX_FRAME_USER);
+	ring->head = ring->head != ring->frame_max ? ring->head + 1 : 0;
+out:
+	mutex_unlock(&ring->lock);
+	return err;
+}
+
 /*
  *	Send AF_UNIX data.
  */
@@ -1407,10 +1589,11 @@ static int unix_dgram_sendmsg(struct kiocb *kiocb, struct socket *sock,
 	int namelen = 0; /* fake GCC */
 	int err;
 	unsigned hash;
-	struct sk_buff *skb;
+	struct sk_buff *skb = NULL;
+	struct unix_ring *ring = NULL;
 	long timeo;
 	struct scm_cookie tmp_scm;
-	int max_level;
+	int max_level = 0;
 
 	if (NULL == siocb->scm)
 		siocb->scm = &tmp_scm;
@@ -1444,20 +1627,33 @@ static int unix_dgram_sendmsg(struct kiocb *kiocb, struct socket *sock,
 	if (len > sk->sk_sndbuf - 32)
 		goto out;
 
-	skb = sock_alloc_send_skb(sk, len, msg->msg_flags&MSG_DONTWAIT, &err);
-	if (skb == NULL)
-		goto out;
+	/* A connected peer with a receive ring takes the message without
+	 * an skb, unless it carries descriptors or must pass a filter.
+	 */
+	if (other && !siocb->scm->fp) {
+		ring = unix_rx_ring(other);
+		if (ring && (len > ring->frame_size - UNIX_FRAME_HDRLEN ||
+			     rcu_access_pointer(other->sk_filter)))
+			ring = NULL;
+	}
 
-	err = unix_scm_to_skb(siocb->scm, skb, true);
-	if (err < 0)
-		goto out_free;
-	max_level = err + 1;
-	unix_get_secdata(siocb->scm, skb);
+	if (!ring) {
+		skb = sock_alloc_send_skb(sk, len, msg->msg_flags&MSG_DONTWAIT,
+					  &err);
+		if (skb == NULL)
+			goto out;
 
-	skb_reset_transport_header(skb);
-	err = memcpy_fromiovec(skb_put(skb, len), msg->msg_iov, len);
-	if (err)
-		goto out_free;
+		err = unix_scm_to_skb(siocb->scm, skb, true);
+		if (err < 0)
+			goto out_free;
+		max_level = err + 1;
+		unix_get_secdata(siocb->scm, skb);
+
+		skb_reset_transport_header(skb);
+		err = memcpy_fromiovec(skb_put(skb, len), msg->msg_iov, len);
+		if (err)
+			goto out_free;
+	}
 
 	timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
 
@@ -1473,7 +1669,7 @@ restart:
 			goto out_free;
 	}
 
-	if (sk_filter(other, skb) < 0) {
+	if (skb && sk_filter(other, skb) < 0) {
 		/* Toss the packet but do not return any error to the sender */
 		err = len;
 		goto out_free;
@@ -1521,13 +1717,14 @@ restart:
 			goto out_unlock;
 	}
 
-	if (unix_peer(other) != sk && unix_recvq_full(other)) {
+	if (ring ? unix_ring_full(ring) :
+	    unix_peer(other) != sk && unix_recvq_full(other)) {
 		if (!timeo) {
 			err = -EAGAIN;
 			goto out_unlock;
 		}
 
-		timeo = unix_wait_for_peer(other, timeo);
+		timeo = unix_wait_for_peer(other, ring, timeo);
 
 		err = sock_intr_errno(timeo);
 		if (signal_pending(current))
@@ -1536,6 +1733,19 @@ restart:
 		goto restart;
 	}
 
+	if (ring) {
+		unix_state_unlock(other);
+		err = unix_ring_send(ring, msg, len, siocb->scm);
+		if (err == -EAGAIN)
+			goto restart;
+		if (err)
+			goto out_free;
+		other->sk_data_ready(other, len);
+		sock_put(other);
+		scm_destroy(siocb->scm);
+		return len;
+	}
+
 	if (sock_flag(other, SOCK_RCVTSTAMP))
 		__net_timestamp(skb);
 	skb_queue_tail(&other->sk_receive_queue, skb);
@@ -2078,6 +2288,103 @@ static int unix_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg)
 	return err;
 }
 
+static int unix_set_rx_ring(struct sock *sk, struct unix_ring_req *req)
+{
+	struct unix_sock *u = unix_sk(sk);
+	struct unix_ring *ring;
+	int err;
+
+	/* Sanity tests and some calculations */
+	if (unlikely(!req->ur_block_nr))
+		return -EINVAL;
+	if (unlikely((int)req->ur_block_size <= 0))
+		return -EINVAL;
+	if (unlikely(req->ur_block_size & (PAGE_SIZE - 1)))
+		return -EINVAL;
+	if (unlikely(req->ur_frame_size < UNIX_FRAME_HDRLEN))
+		return -EINVAL;
+	if (unlikely(req->ur_frame_size & (UNIX_FRAME_ALIGNMENT - 1)))
+		return -EINVAL;
+	if (unlikely(req->ur_frame_size > req->ur_block_size))
+		return -EINVAL;
+
+	/* The ring takes the place of the receive queue, so it is
+	 * bounded by the same limit.
+	 */
+	if ((u64)req->ur_block_size * req->ur_block_nr > sk->sk_rcvbuf)
+		return -ENOBUFS;
+
+	if (unlikely(req->ur_block_size / req->ur_frame_size *
+		     req->ur_block_nr != req->ur_frame_nr))
+		return -EINVAL;
+
+	lock_sock(sk);
+	err = -EBUSY;
+	if (u->rx_ring)
+		goto out;
+
+	err = -ENOMEM;
+	ring = unix_alloc_ring(req);
+	if (!ring)
+		goto out;
+
+	smp_wmb();
+	u->rx_ring = ring;
+	err = 0;
+out:
+	release_sock(sk);
+	return err;
+}
+
+static int unix_setsockopt(struct socket *sock, int level, int optname,
+			   char __user *optval, unsigned int optlen)
+{
+	struct unix_ring_req req;
+
+	if (level != SOL_UNIX)
+		return -ENOPROTOOPT;
+
+	switch (optname) {
+	case UNIX_RX_RING:
+		if (optlen < sizeof(req))
+			return -EINVAL;
+		if (copy_from_user(&req, optval, sizeof(req)))
+			return -EFAULT;
+		return unix_set_rx_ring(sock->sk, &req);
+	default:
+		return -ENOPROTOOPT;
+	}
+}
+
+static int unix_mmap(struct file *file, struct socket *sock,
+		     struct vm_area_struct *vma)
+{
+	struct unix_ring *ring = unix_rx_ring(sock->sk);
+	unsigned long start;
+	int i, pg_num, err;
+
+	if (vma->vm_pgoff || !ring)
+		return -EINVAL;
+
+	if (vma->vm_end - vma->vm_start !=
+	    (unsigned long)ring->pg_vec_len * ring->pg_vec_pages * PAGE_SIZE)
+		return -EINVAL;
+
+	start = vma->vm_start;
+	for (i = 0; i < ring->pg_vec_len; i++) {
+		char *kaddr = ring->pg_vec[i];
+
+		for (pg_num = 0; pg_num < ring->pg_vec_pages; pg_num++) {
+			err = vm_insert_page(vma, start, unix_ring_page(kaddr));
+			if (unlikely(err))
+				return err;
+			start += PAGE_SIZE;
+			kaddr += PAGE_SIZE;
+		}
+	}
+	return 0;
+}
+
 static unsigned int unix_poll(struct file *file, struct socket *sock, poll_table *wait)
 {
 	struct sock *sk = sock->sk;
@@ -2117,6 +2424,7 @@ static unsigned int unix_dgram_poll(struct file *file, struct socket *sock,
 				    poll_table *wait)
 {
 	struct sock *sk = sock->sk, *other;
+	struct unix_ring *ring;
 	unsigned int mask, writable;
 
 	sock_poll_wait(file, sk_sleep(sk), wait);
@@ -2134,6 +2442,20 @@ static unsigned int unix_dgram_poll(struct file *file, struct socket *sock,
 	if (!skb_queue_empty(&sk->sk_receive_queue))
 		mask |= POLLIN | POLLRDNORM;
 
+	ring = unix_rx_ring(sk);
+	if (ring) {
+		if (unix_ring_readable(ring))
+			mask |= POLLIN | POLLRDNORM;
+		/* User space frees slots without telling us; the reader
+		 * coming back to poll is our cue to release blocked senders.
+		 */
+		if (!unix_ring_full(ring) &&
+		    waitqueue_active(&unix_sk(sk)->peer_wait))
+			wake_up_interruptible_sync_poll(&unix_sk(sk)->peer_wait,
+							POLLOUT | POLLWRNORM |
+							POLLWRBAND);
+	}
+
 	/* Connection-based need to check for termination and startup */
 	if (sk->sk_type == SOCK_SEQPACKET) {
 		if (sk->sk_state == TCP_CLOSE)
@@ -2150,9 +2472,10 @@ static unsigned int unix_dgram_poll(struct file *file, struct socket *sock,
 	writable = unix_writable(sk);
 	other = unix_peer_get(sk);
 	if (other) {
-		if (unix_peer(other) != sk) {
+		ring = unix_rx_ring(other);
+		if (unix_peer(other) != sk || ring) {
 			sock_poll_wait(file, &unix_sk(other)->peer_wait, wait);
-			if (unix_recvq_full(other))
+			if (ring ? unix_ring_full(ring) : unix_recvq_full(other))
 				writable = 0;
 		}
 		sock_put(other);
@@ -0,0 +1,201 @@
+/*
+ * ashmem-bench.c -- pin/unpin throughput on ashmem areas
+ *
+ * Runs 1, 2, 4, ... up to -t threads. Each thread unpins a random range
+ * of its own area and pins it back, as fast as it can for -T seconds.
+ * With -S all threads share one area instead. Before the threads start,
+ * every other page of each area outside the ranges the threads use is
+ * unpinned, so that each area already holds -r disjoint unpinned ranges
+ * and the cost of finding a range shows. The number of pin+unpin pairs
+ * per second is printed for each thread count.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o ashmem-bench ashmem-bench.c -lpthread */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/types.h>
+
+#include "../../../include/linux/ashmem.h"
+
+/* Pages at the start of an area that the threads pin and unpin */
+#define WORK_PAGES	64
+
+static const char *device = "/dev/ashmem";
+static unsigned int max_threads = 4;
+static unsigned int seconds = 5;
+static unsigned int ranges = 1024;
+static int shared;
+
+static size_t page_size;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned int seed;
+	unsigned long long ops;
+};
+
+static int area_create(void)
+{
+	size_t size = (WORK_PAGES + 2 * ranges) * page_size;
+	struct ashmem_pin pin;
+	unsigned int i;
+	void *map;
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+		perror("ASHMEM_SET_SIZE");
+		exit(1);
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	/* Leave the mapping in place, pin and unpin need it */
+	for (i = 0; i < ranges; i++) {
+		pin.offset = (WORK_PAGES + 2 * i + 1) * page_size;
+		pin.len = page_size;
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0) {
+			perror("ASHMEM_UNPIN");
+			exit(1);
+		}
+	}
+
+	return fd;
+}
+
+static void *pinner(void *arg)
+{
+	struct worker *w = arg;
+	struct ashmem_pin pin;
+	unsigned int first, nr;
+
+	while (!stop) {
+		first = rand_r(&w->seed) % WORK_PAGES;
+		nr = 1 + rand_r(&w->seed) % (WORK_PAGES - first);
+		pin.offset = first * page_size;
+		pin.len = nr * page_size;
+
+		if (ioctl(w->fd, ASHMEM_UNPIN, &pin) < 0) {
+			perror("ASHMEM_UNPIN");
+			exit(1);
+		}
+		if (ioctl(w->fd, ASHMEM_PIN, &pin) < 0) {
+			perror("ASHMEM_PIN");
+			exit(1);
+		}
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static void run(unsigned int nr)
+{
+	struct worker *workers;
+	unsigned long long total = 0;
+	unsigned int i;
+	int fd = -1;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	if (shared)
+		fd = area_create();
+	for (i = 0; i < nr; i++) {
+		workers[i].fd = shared ? fd : area_create();
+		workers[i].seed = i + 1;
+	}
+
+	stop = 0;
+	for (i = 0; i < nr; i++)
+		if (pthread_create(&workers[i].thread, NULL, pinner,
+				   &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ops;
+		if (!shared)
+			close(workers[i].fd);
+	}
+	if (shared)
+		close(fd);
+
+	printf("%3u threads: %12.0f pin+unpin/s %12.0f per thread\n", nr,
+	       (double)total / seconds, (double)total / seconds / nr);
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-t max_threads] [-r ranges] [-T seconds] [-S]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:r:T:S")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'r':
+			ranges = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_threads || !seconds)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	for (nr = 1; nr < max_threads; nr *= 2)
+		run(nr);
+	run(max_threads);
+
+	return 0;
+}
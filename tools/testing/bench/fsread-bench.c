@@ -0,0 +1,228 @@
+/*
+ * fsread-bench.c -- concurrent small reads on one filesystem
+ *
+ * Opens the regular files in a directory and runs 1, 2, 4, ... up to -t
+ * threads for -T seconds each. Every iteration reads -s bytes at a random
+ * page of a random file; -R adds a full readdir of the directory and -X
+ * a getxattr of "user.bench" on the file. The page cache is not dropped,
+ * so the reads are mostly served from it and what is timed is how well
+ * readers on the same filesystem run alongside each other, as with the
+ * yaffs device lock. Iterations per second are printed for each thread
+ * count.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o fsread-bench fsread-bench.c -lpthread */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+struct file {
+	char path[PATH_MAX];
+	int fd;
+	off_t pages;
+};
+
+static const char *dir;
+static unsigned int max_threads = 4;
+static unsigned int seconds = 5;
+static size_t read_size = 4096;
+static int do_readdir, do_xattr;
+
+static struct file *files;
+static unsigned int nr_files;
+static size_t page_size;
+
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long long ops;
+};
+
+static void read_dir(void)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		exit(1);
+	}
+	while ((de = readdir(d)))
+		;
+	closedir(d);
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	struct file *f;
+	char value[64];
+	char *buf;
+
+	buf = malloc(read_size);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+
+	while (!stop) {
+		f = &files[rand_r(&w->seed) % nr_files];
+		if (pread(f->fd, buf, read_size,
+			  (off_t)(rand_r(&w->seed) % f->pages) * page_size) < 0) {
+			perror(f->path);
+			exit(1);
+		}
+		if (do_readdir)
+			read_dir();
+		/* The attribute need not exist, the lookup is what counts */
+		if (do_xattr &&
+		    getxattr(f->path, "user.bench", value, sizeof(value)) < 0 &&
+		    errno != ENODATA && errno != ENOTSUP) {
+			perror(f->path);
+			exit(1);
+		}
+		w->ops++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void run(unsigned int nr)
+{
+	struct worker *workers;
+	unsigned long long total = 0;
+	unsigned int i;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	stop = 0;
+	for (i = 0; i < nr; i++) {
+		workers[i].seed = i + 1;
+		if (pthread_create(&workers[i].thread, NULL, reader,
+				   &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ops;
+	}
+
+	printf("%3u threads: %12.0f ops/s %12.0f per thread\n", nr,
+	       (double)total / seconds, (double)total / seconds / nr);
+	free(workers);
+}
+
+static void open_files(void)
+{
+	struct dirent *de;
+	struct stat st;
+	struct file *f;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		exit(1);
+	}
+
+	while ((de = readdir(d))) {
+		files = realloc(files, (nr_files + 1) * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			exit(1);
+		}
+		f = &files[nr_files];
+		snprintf(f->path, sizeof(f->path), "%s/%s", dir, de->d_name);
+		f->fd = open(f->path, O_RDONLY);
+		if (f->fd < 0)
+			continue;
+		if (fstat(f->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+		    !st.st_size) {
+			close(f->fd);
+			continue;
+		}
+		f->pages = (st.st_size + page_size - 1) / page_size;
+		nr_files++;
+	}
+	closedir(d);
+
+	if (!nr_files) {
+		fprintf(stderr, "%s: no readable files\n", dir);
+		exit(1);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t max_threads] [-s read_bytes] [-T seconds] [-R] [-X] dir\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:T:RX")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			read_size = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		case 'R':
+			do_readdir = 1;
+			break;
+		case 'X':
+			do_xattr = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_threads || !read_size || !seconds || optind != argc - 1)
+		usage(argv[0]);
+	dir = argv[optind];
+
+	page_size = sysconf(_SC_PAGESIZE);
+	open_files();
+
+	for (nr = 1; nr < max_threads; nr *= 2)
+		run(nr);
+	run(max_threads);
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * futex-bench.c -- futex hash table contention
+ *
+ * Runs 1, 2, 4, ... up to -t threads. Each thread owns -f futexes and
+ * calls FUTEX_WAKE on them in turn for -T seconds. Nobody waits, so
+ * every call is a hash lookup plus a bucket lock round trip, and threads
+ * only slow each other down when their futexes share hash buckets. The
+ * number of calls per second is printed for each thread count. -S uses
+ * shared instead of private futexes, which hash on the page rather than
+ * on the mm.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o futex-bench futex-bench.c -lpthread */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static unsigned int max_threads = 4;
+static unsigned int seconds = 5;
+static unsigned int nr_futexes = 1024;
+static int shared;
+
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned long long ops;
+};
+
+static void *waker(void *arg)
+{
+	struct worker *w = arg;
+	int op = shared ? FUTEX_WAKE : FUTEX_WAKE | FUTEX_PRIVATE_FLAG;
+	unsigned int i = 0;
+	int *futexes;
+
+	futexes = calloc(nr_futexes, sizeof(*futexes));
+	if (!futexes) {
+		perror("calloc");
+		exit(1);
+	}
+
+	while (!stop) {
+		if (syscall(SYS_futex, &futexes[i], op, 1, NULL, NULL, 0) < 0) {
+			perror("FUTEX_WAKE");
+			exit(1);
+		}
+		if (++i == nr_futexes)
+			i = 0;
+		w->ops++;
+	}
+
+	free(futexes);
+	return NULL;
+}
+
+static void run(unsigned int nr)
+{
+	struct worker *workers;
+	unsigned long long total = 0;
+	unsigned int i;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	stop = 0;
+	for (i = 0; i < nr; i++)
+		if (pthread_create(&workers[i].thread, NULL, waker,
+				   &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ops;
+	}
+
+	printf("%3u threads: %12.0f wakes/s %12.0f per thread\n", nr,
+	       (double)total / seconds, (double)total / seconds / nr);
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t max_threads] [-f futexes] [-T seconds] [-S]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:f:T:S")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'f':
+			nr_futexes = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_threads || !nr_futexes || !seconds)
+		usage(argv[0]);
+
+	for (nr = 1; nr < max_threads; nr *= 2)
+		run(nr);
+	run(max_threads);
+
+	return 0;
+}
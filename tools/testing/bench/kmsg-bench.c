@@ -0,0 +1,150 @@
+/*
+ * kmsg-bench.c -- concurrent printk() through /dev/kmsg
+ *
+ * Runs 1, 2, 4, ... up to -t threads, each writing lines of -s bytes to
+ * /dev/kmsg (every write is one printk() call) for -T seconds, and
+ * prints the number of lines written per second for each thread count.
+ * The lines are logged at KERN_DEBUG, so with a console loglevel below 8
+ * ("dmesg -n 1") they only go to the log buffer and the numbers show the
+ * cost of printk() itself rather than that of the console.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o kmsg-bench kmsg-bench.c -lpthread */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *device = "/dev/kmsg";
+static unsigned int max_threads = 4;
+static unsigned int seconds = 5;
+static size_t line_size = 80;
+
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	unsigned long long ops;
+};
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	char *line;
+	int fd, len;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	line = malloc(line_size + 1);
+	if (!line) {
+		perror("malloc");
+		exit(1);
+	}
+	/* The prefix is well below the 32 byte minimum line size */
+	len = snprintf(line, line_size + 1, "<7>kmsg-bench %u: ", w->id);
+	memset(line + len, 'x', line_size - len - 1);
+	line[line_size - 1] = '\n';
+	len = line_size;
+
+	while (!stop) {
+		if (write(fd, line, len) < 0 && errno != EINTR) {
+			perror("write");
+			exit(1);
+		}
+		w->ops++;
+	}
+
+	free(line);
+	close(fd);
+	return NULL;
+}
+
+static void run(unsigned int nr)
+{
+	struct worker *workers;
+	unsigned long long total = 0;
+	unsigned int i;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	stop = 0;
+	for (i = 0; i < nr; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, writer,
+				   &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ops;
+	}
+
+	printf("%3u threads: %12.0f lines/s %12.0f per thread\n", nr,
+	       (double)total / seconds, (double)total / seconds / nr);
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-t max_threads] [-s line_bytes] [-T seconds]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:s:T:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			line_size = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	/* printk() truncates at 1024 bytes */
+	if (!max_threads || !seconds || line_size < 32 || line_size > 1000)
+		usage(argv[0]);
+
+	for (nr = 1; nr < max_threads; nr *= 2)
+		run(nr);
+	run(max_threads);
+
+	return 0;
+}
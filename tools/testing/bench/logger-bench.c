@@ -0,0 +1,154 @@
+/*
+ * logger-bench.c -- concurrent writers on an Android logger device
+ *
+ * Runs 1, 2, 4, ... up to -t writer threads, each with its own fd, as
+ * separate apps would have. Every thread writes log entries (priority,
+ * tag and a message of -s bytes) for -T seconds, and the number of
+ * entries written per second is printed for each thread count. Keep
+ * logcat running or not, but the same for every comparison.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o logger-bench logger-bench.c -lpthread */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+static const char *device = "/dev/log/main";
+static unsigned int max_threads = 4;
+static unsigned int seconds = 5;
+static size_t msg_size = 64;
+
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned long long ops;
+};
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char prio = 4;		/* ANDROID_LOG_INFO */
+	char tag[] = "logger-bench";
+	struct iovec iov[3];
+	char *msg;
+	int fd;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	msg = malloc(msg_size);
+	if (!msg) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(msg, 'x', msg_size - 1);
+	msg[msg_size - 1] = '\0';
+
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = tag;
+	iov[1].iov_len = sizeof(tag);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = msg_size;
+
+	while (!stop) {
+		if (writev(fd, iov, 3) < 0 && errno != EINTR) {
+			perror("writev");
+			exit(1);
+		}
+		w->ops++;
+	}
+
+	free(msg);
+	close(fd);
+	return NULL;
+}
+
+static void run(unsigned int nr)
+{
+	struct worker *workers;
+	unsigned long long total = 0;
+	unsigned int i;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	stop = 0;
+	for (i = 0; i < nr; i++)
+		if (pthread_create(&workers[i].thread, NULL, writer,
+				   &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ops;
+	}
+
+	printf("%3u threads: %12.0f entries/s %12.0f per thread\n", nr,
+	       (double)total / seconds, (double)total / seconds / nr);
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-t max_threads] [-s msg_bytes] [-T seconds]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:s:T:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_threads || !seconds || msg_size < 1 || msg_size > 4000)
+		usage(argv[0]);
+
+	for (nr = 1; nr < max_threads; nr *= 2)
+		run(nr);
+	run(max_threads);
+
+	return 0;
+}
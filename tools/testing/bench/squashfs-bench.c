@@ -0,0 +1,195 @@
+/*
+ * squashfs-bench.c -- cold-cache read throughput with several readers
+ *
+ * Reads the files given on the command line with 1, 2, 4, ... up to -t
+ * threads. The files are cut into chunks of -s bytes (the squashfs block
+ * size by default) and thread i reads chunks i, i + n, i + 2n, ... of
+ * all of them, so the threads keep asking for different blocks at the
+ * same time. The page cache is dropped before each pass and the read
+ * rate is printed for each thread count. Point it at files on a squashfs
+ * mount and compare the threads= mount options.
+ *
+ * Dropping the caches needs root; without it only the files' own pages
+ * are dropped, and a warning is printed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o squashfs-bench squashfs-bench.c -lpthread */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct file {
+	const char *name;
+	int fd;
+	off_t size;
+	unsigned long first_chunk;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	unsigned long long bytes;
+};
+
+static unsigned int max_threads = 4;
+static size_t chunk_size = 128 * 1024;
+
+static struct file *files;
+static unsigned int nr_files;
+static unsigned long nr_chunks;
+static unsigned int nr_threads;
+
+static void drop_caches(void)
+{
+	static int warned;
+	unsigned int i;
+	int fd;
+
+	sync();
+	for (i = 0; i < nr_files; i++)
+		posix_fadvise(files[i].fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1) {
+		if (!warned++)
+			fprintf(stderr, "cannot drop caches, only dropping file pages\n");
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long chunk;
+	unsigned int f = 0;
+	ssize_t ret;
+	char *buf;
+
+	buf = malloc(chunk_size);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (chunk = w->id; chunk < nr_chunks; chunk += nr_threads) {
+		while (f + 1 < nr_files && chunk >= files[f + 1].first_chunk)
+			f++;
+
+		ret = pread(files[f].fd, buf, chunk_size,
+			    (off_t)(chunk - files[f].first_chunk) * chunk_size);
+		if (ret < 0) {
+			perror(files[f].name);
+			exit(1);
+		}
+		w->bytes += ret;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void run(unsigned int nr)
+{
+	struct worker *workers;
+	unsigned long long total = 0;
+	struct timespec start, end;
+	double elapsed;
+	unsigned int i;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	drop_caches();
+
+	nr_threads = nr;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, reader,
+				   &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].bytes;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%3u threads: %10.1f MB/s (%llu bytes in %.3f s)\n", nr,
+	       total / elapsed / (1024 * 1024), total, elapsed);
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t max_threads] [-s chunk_bytes] file...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+	unsigned int i, nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			chunk_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_threads || !chunk_size || optind == argc)
+		usage(argv[0]);
+
+	nr_files = argc - optind;
+	files = calloc(nr_files, sizeof(*files));
+	if (!files) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < nr_files; i++) {
+		files[i].name = argv[optind + i];
+		files[i].fd = open(files[i].name, O_RDONLY);
+		if (files[i].fd < 0 || fstat(files[i].fd, &st) < 0) {
+			perror(files[i].name);
+			exit(1);
+		}
+		files[i].size = st.st_size;
+		files[i].first_chunk = nr_chunks;
+		nr_chunks += (st.st_size + chunk_size - 1) / chunk_size;
+	}
+
+	for (nr = 1; nr < max_threads; nr *= 2)
+		run(nr);
+	run(max_threads);
+
+	return 0;
+}
@@ -0,0 +1,462 @@
+/*
+ * tun-bench.c -- packet rate through a multiqueue tun device
+ *
+ * For 1, 2, 4, ... up to -q queues, a tun device with that many queues
+ * is created, given 10.99.0.1/24 and brought up, and two tests run for
+ * -T seconds each:
+ *
+ *  write: one thread per queue writes IPv4/UDP frames of -s payload
+ *         bytes from 10.99.0.2 to 10.99.0.1, each thread its own flow,
+ *         and a UDP socket on 10.99.0.1 counts what the stack delivers.
+ *         With -b N every writev() carries N frames (IFF_MULTI_FRAME),
+ *         and -N passes them to the stack through NAPI/GRO (IFF_NAPI).
+ *  read:  one UDP socket per queue sends to 10.99.0.2 from its own
+ *         port, so the flows spread over the queues, and one thread per
+ *         queue reads the frames back from the tun device.
+ *
+ * Frames written or sent and frames received or read are printed per
+ * second; the difference was dropped on the way. Needs CAP_NET_ADMIN.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o tun-bench tun-bench.c -lpthread */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "../../../include/linux/if_tun.h"
+
+#define LOCAL_ADDR	"10.99.0.1"
+#define PEER_ADDR	"10.99.0.2"
+#define NETMASK		"255.255.255.0"
+#define RX_PORT		9000
+#define TX_PORT		10000
+
+#define MAX_QUEUES	8
+#define MAX_BATCH	64
+
+struct frame {
+	unsigned char	ver_ihl;
+	unsigned char	tos;
+	unsigned short	tot_len;
+	unsigned short	id;
+	unsigned short	frag_off;
+	unsigned char	ttl;
+	unsigned char	protocol;
+	unsigned short	check;
+	unsigned int	saddr;
+	unsigned int	daddr;
+	unsigned short	source;
+	unsigned short	dest;
+	unsigned short	len;
+	unsigned short	udp_check;
+	unsigned char	payload[];
+} __attribute__((packed));
+
+static unsigned int max_queues = 4;
+static unsigned int seconds = 5;
+static unsigned int batch = 1;
+static size_t payload_size = 64;
+static int napi;
+
+static volatile int stop, done;
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	int fd;
+	volatile unsigned long ops;
+};
+
+static void start(struct worker *w, void *(*fn)(void *))
+{
+	if (pthread_create(&w->thread, NULL, fn, w)) {
+		fprintf(stderr, "pthread_create failed\n");
+		exit(1);
+	}
+}
+
+static unsigned short ip_checksum(const void *data, size_t len)
+{
+	const unsigned short *p = data;
+	unsigned int sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static size_t frame_size(void)
+{
+	return sizeof(struct frame) + payload_size;
+}
+
+static void frame_init(struct frame *f, unsigned short sport)
+{
+	memset(f, 0, frame_size());
+	f->ver_ihl = 0x45;
+	f->tot_len = htons(frame_size());
+	f->ttl = 64;
+	f->protocol = IPPROTO_UDP;
+	f->saddr = inet_addr(PEER_ADDR);
+	f->daddr = inet_addr(LOCAL_ADDR);
+	f->check = ip_checksum(f, 20);
+	f->source = htons(sport);
+	f->dest = htons(RX_PORT);
+	f->len = htons(8 + payload_size);
+	/* A zero UDP checksum means none */
+}
+
+static void set_addr(int fd, const char *name, int req, const char *addr)
+{
+	struct sockaddr_in *sin;
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	sin = (struct sockaddr_in *)&ifr.ifr_addr;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = inet_addr(addr);
+	if (ioctl(fd, req, &ifr) < 0) {
+		perror(name);
+		exit(1);
+	}
+}
+
+/* Create a device with nr queues, returns one fd per queue in fds */
+static void tun_create(unsigned int nr, int *fds)
+{
+	char name[IFNAMSIZ] = "tunbench%d";
+	struct ifreq ifr;
+	unsigned int i;
+	int ctl;
+
+	for (i = 0; i < nr; i++) {
+		fds[i] = open("/dev/net/tun", O_RDWR);
+		if (fds[i] < 0) {
+			perror("/dev/net/tun");
+			exit(1);
+		}
+
+		memset(&ifr, 0, sizeof(ifr));
+		memcpy(ifr.ifr_name, name, IFNAMSIZ);
+		ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+		if (max_queues > 1)
+			ifr.ifr_flags |= IFF_MULTI_QUEUE;
+		if (batch > 1)
+			ifr.ifr_flags |= IFF_MULTI_FRAME;
+		if (napi)
+			ifr.ifr_flags |= IFF_NAPI;
+		if (ioctl(fds[i], TUNSETIFF, &ifr) < 0) {
+			perror("TUNSETIFF");
+			exit(1);
+		}
+		memcpy(name, ifr.ifr_name, IFNAMSIZ);
+	}
+
+	ctl = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ctl < 0) {
+		perror("socket");
+		exit(1);
+	}
+	set_addr(ctl, name, SIOCSIFADDR, LOCAL_ADDR);
+	set_addr(ctl, name, SIOCSIFNETMASK, NETMASK);
+
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, name, IFNAMSIZ);
+	if (ioctl(ctl, SIOCGIFFLAGS, &ifr) < 0) {
+		perror("SIOCGIFFLAGS");
+		exit(1);
+	}
+	ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+	if (ioctl(ctl, SIOCSIFFLAGS, &ifr) < 0) {
+		perror("SIOCSIFFLAGS");
+		exit(1);
+	}
+	close(ctl);
+}
+
+static int udp_socket(unsigned short port)
+{
+	struct timeval tv = { .tv_usec = 100000 };
+	struct sockaddr_in sin;
+	int fd, val = 4 << 20;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+	/* Wake up now and then to notice the end of a run */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(LOCAL_ADDR);
+	sin.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	return fd;
+}
+
+static void *tun_writer(void *arg)
+{
+	struct worker *w = arg;
+	struct iovec iov[MAX_BATCH];
+	struct frame *f;
+	unsigned int i;
+	ssize_t ret;
+
+	f = malloc(frame_size());
+	if (!f) {
+		perror("malloc");
+		exit(1);
+	}
+	frame_init(f, TX_PORT + w->id);
+	for (i = 0; i < batch; i++) {
+		iov[i].iov_base = f;
+		iov[i].iov_len = frame_size();
+	}
+
+	while (!stop) {
+		ret = writev(w->fd, iov, batch);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("tun write");
+			exit(1);
+		}
+		w->ops += ret / frame_size();
+	}
+
+	free(f);
+	return NULL;
+}
+
+static void *udp_receiver(void *arg)
+{
+	struct worker *w = arg;
+	char buf[2048];
+
+	while (!done)
+		if (recv(w->fd, buf, sizeof(buf), 0) >= 0)
+			w->ops++;
+
+	return NULL;
+}
+
+static void *udp_sender(void *arg)
+{
+	struct worker *w = arg;
+	struct sockaddr_in sin;
+	char *payload;
+
+	payload = calloc(1, payload_size);
+	if (!payload) {
+		perror("calloc");
+		exit(1);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(PEER_ADDR);
+	sin.sin_port = htons(RX_PORT);
+	if (connect(w->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	/* A full tun queue drops after send() returned, read/s shows it */
+	while (!stop)
+		if (send(w->fd, payload, payload_size, 0) >= 0)
+			w->ops++;
+
+	free(payload);
+	return NULL;
+}
+
+static void *tun_reader(void *arg)
+{
+	struct worker *w = arg;
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+	char buf[2048];
+
+	while (!done) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (read(w->fd, buf, sizeof(buf)) >= 0)
+			w->ops++;
+	}
+
+	return NULL;
+}
+
+static unsigned long run_pair(unsigned int nr, void *(*tx)(void *),
+			      int *tx_fds, void *(*rx)(void *), int *rx_fds,
+			      unsigned int nr_rx, unsigned long *sent)
+{
+	struct worker tx_workers[MAX_QUEUES], rx_workers[MAX_QUEUES];
+	unsigned long received = 0;
+	unsigned int i;
+
+	memset(tx_workers, 0, sizeof(tx_workers));
+	memset(rx_workers, 0, sizeof(rx_workers));
+
+	stop = done = 0;
+	for (i = 0; i < nr_rx; i++) {
+		rx_workers[i].fd = rx_fds[i];
+		start(&rx_workers[i], rx);
+	}
+	for (i = 0; i < nr; i++) {
+		tx_workers[i].id = i;
+		tx_workers[i].fd = tx_fds[i];
+		start(&tx_workers[i], tx);
+	}
+
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nr_rx; i++)
+		received += rx_workers[i].ops;
+
+	*sent = 0;
+	for (i = 0; i < nr; i++) {
+		pthread_join(tx_workers[i].thread, NULL);
+		*sent += tx_workers[i].ops;
+	}
+	done = 1;
+	for (i = 0; i < nr_rx; i++)
+		pthread_join(rx_workers[i].thread, NULL);
+
+	return received;
+}
+
+static void run(unsigned int nr)
+{
+	int tun_fds[MAX_QUEUES], udp_fds[MAX_QUEUES];
+	unsigned long sent, received;
+	unsigned int i;
+
+	tun_create(nr, tun_fds);
+
+	udp_fds[0] = udp_socket(RX_PORT);
+	received = run_pair(nr, tun_writer, tun_fds, udp_receiver, udp_fds,
+			    1, &sent);
+	close(udp_fds[0]);
+	printf("%u queues, write: %10.0f written/s %10.0f received/s\n", nr,
+	       (double)sent / seconds, (double)received / seconds);
+
+	for (i = 0; i < nr; i++)
+		udp_fds[i] = udp_socket(TX_PORT + i);
+	received = run_pair(nr, udp_sender, udp_fds, tun_reader, tun_fds,
+			    nr, &sent);
+	printf("%u queues, read:  %10.0f sent/s    %10.0f read/s\n", nr,
+	       (double)sent / seconds, (double)received / seconds);
+
+	for (i = 0; i < nr; i++) {
+		close(udp_fds[i]);
+		close(tun_fds[i]);
+	}
+}
+
+/*
+ * Without these flags, writev() would glue a batch into one bogus frame
+ * and the numbers would mean nothing.
+ */
+static void check_features(void)
+{
+	unsigned int want = 0, features;
+	int fd;
+
+	if (max_queues > 1)
+		want |= IFF_MULTI_QUEUE;
+	if (batch > 1)
+		want |= IFF_MULTI_FRAME;
+	if (napi)
+		want |= IFF_NAPI;
+
+	fd = open("/dev/net/tun", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/net/tun");
+		exit(1);
+	}
+	if (ioctl(fd, TUNGETFEATURES, &features) < 0) {
+		perror("TUNGETFEATURES");
+		exit(1);
+	}
+	close(fd);
+
+	if ((features & want) != want) {
+		fprintf(stderr, "tun does not support flags %#x\n",
+			want & ~features);
+		exit(1);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-q max_queues] [-b batch] [-N] [-s payload_bytes] [-T seconds]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "q:b:Ns:T:")) != -1) {
+		switch (opt) {
+		case 'q':
+			max_queues = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'N':
+			napi = 1;
+			break;
+		case 's':
+			payload_size = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_queues || max_queues > MAX_QUEUES || !batch ||
+	    batch > MAX_BATCH || payload_size > 1400 || !seconds)
+		usage(argv[0]);
+
+	check_features();
+
+	for (nr = 1; nr < max_queues; nr *= 2)
+		run(nr);
+	run(max_queues);
+
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * udp-rtt-bench.c -- round trip time under load
+ *
+ * Measures the queueing delay that byte queue limits and fq_codel are
+ * meant to remove. Start the server on the far side of the link:
+ *
+ *	udp-rtt-bench -s
+ *
+ * It echoes probes sent to -p port and drops the bulk traffic sent to
+ * the port after it. Then run the client on the device:
+ *
+ *	udp-rtt-bench -c <server> [-f flood_threads] [-T seconds]
+ *
+ * The -f threads send 1400 byte datagrams to the server as fast as the
+ * socket lets them, filling the qdisc and the driver's ring, while one
+ * thread sends a small probe every -i milliseconds and waits for its
+ * echo. The client prints the bulk rate and the probe round trip time
+ * percentiles. Compare the same link with the default qdisc and with
+ * "tc qdisc replace dev <dev> root fq_codel", and with and without BQL
+ * on the driver (byte_queue_limits/limit_max under
+ * /sys/class/net/<dev>/queues/tx-0/).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o udp-rtt-bench udp-rtt-bench.c -lpthread */
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define BULK_SIZE	1400
+#define MAX_PROBES	(1 << 20)
+
+struct probe {
+	uint32_t	seq;
+	uint64_t	sent_ns;
+};
+
+static const char *server;
+static unsigned short port = 9100;
+static unsigned int flooders = 1;
+static unsigned int seconds = 10;
+static unsigned int interval_ms = 10;
+
+static struct sockaddr_in server_addr;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned long long bytes;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int udp_socket(unsigned short bind_port)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (!bind_port)
+		return fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(bind_port);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	return fd;
+}
+
+static void run_server(void)
+{
+	struct pollfd pfd[2];
+	struct sockaddr_in from;
+	socklen_t len;
+	char buf[2048];
+	ssize_t ret;
+
+	pfd[0].fd = udp_socket(port);
+	pfd[1].fd = udp_socket(port + 1);
+	pfd[0].events = pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+		if (pfd[0].revents & POLLIN) {
+			len = sizeof(from);
+			ret = recvfrom(pfd[0].fd, buf, sizeof(buf), 0,
+				       (struct sockaddr *)&from, &len);
+			if (ret > 0)
+				sendto(pfd[0].fd, buf, ret, 0,
+				       (struct sockaddr *)&from, len);
+		}
+		/* Bulk traffic is read only so that it draws no ICMP */
+		if (pfd[1].revents & POLLIN)
+			recv(pfd[1].fd, buf, sizeof(buf), 0);
+	}
+}
+
+static void *flooder(void *arg)
+{
+	struct worker *w = arg;
+	struct sockaddr_in sin = server_addr;
+	char buf[BULK_SIZE];
+	int fd;
+
+	memset(buf, 0, sizeof(buf));
+	sin.sin_port = htons(port + 1);
+	fd = udp_socket(0);
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	/* ENOBUFS means a full qdisc, which is the point */
+	while (!stop)
+		if (send(fd, buf, sizeof(buf), 0) > 0)
+			w->bytes += sizeof(buf);
+
+	close(fd);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run_client(void)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct worker *workers;
+	struct probe p, echo;
+	unsigned long long bytes = 0;
+	unsigned int i, lost = 0;
+	uint64_t *rtt, start, end, deadline, sent;
+	size_t nr_rtt = 0;
+	int fd;
+
+	workers = calloc(flooders, sizeof(*workers));
+	rtt = calloc(MAX_PROBES, sizeof(*rtt));
+	if (!workers || !rtt) {
+		perror("calloc");
+		exit(1);
+	}
+
+	fd = udp_socket(0);
+	/* A probe not back within a second counts as lost */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(fd, (struct sockaddr *)&server_addr,
+		    sizeof(server_addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	start = now_ns();
+	for (i = 0; i < flooders; i++)
+		if (pthread_create(&workers[i].thread, NULL, flooder,
+				   &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	/* Let the queues fill before probing */
+	sleep(1);
+
+	deadline = now_ns() + (uint64_t)seconds * 1000000000;
+	for (p.seq = 0; now_ns() < deadline && nr_rtt < MAX_PROBES; p.seq++) {
+		p.sent_ns = sent = now_ns();
+		if (send(fd, &p, sizeof(p), 0) < 0) {
+			if (errno != ENOBUFS) {
+				perror("send");
+				exit(1);
+			}
+			lost++;
+			continue;
+		}
+
+		for (;;) {
+			if (recv(fd, &echo, sizeof(echo), 0) < 0) {
+				lost++;
+				break;
+			}
+			/* Skip echoes of probes already counted as lost */
+			if (echo.seq == p.seq) {
+				rtt[nr_rtt++] = now_ns() - sent;
+				break;
+			}
+		}
+		usleep(interval_ms * 1000);
+	}
+
+	stop = 1;
+	end = now_ns();
+	for (i = 0; i < flooders; i++) {
+		pthread_join(workers[i].thread, NULL);
+		bytes += workers[i].bytes;
+	}
+
+	printf("bulk: %.1f Mbit/s from %u threads\n",
+	       bytes * 8.0 * 1000 / (end - start), flooders);
+	if (!nr_rtt) {
+		printf("no probe came back, %u lost\n", lost);
+		exit(1);
+	}
+	qsort(rtt, nr_rtt, sizeof(*rtt), cmp_u64);
+	printf("rtt: %zu probes, %u lost, p50 %.2f ms, p90 %.2f ms, "
+	       "p99 %.2f ms, max %.2f ms\n", nr_rtt, lost,
+	       rtt[nr_rtt / 2] / 1e6, rtt[nr_rtt * 9 / 10] / 1e6,
+	       rtt[nr_rtt * 99 / 100] / 1e6, rtt[nr_rtt - 1] / 1e6);
+
+	close(fd);
+	free(rtt);
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -s [-p port]\n"
+		"       %s -c server [-p port] [-f flood_threads] [-i probe_ms] [-T seconds]\n",
+		prog, prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints, *res;
+	int server_mode = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "sc:p:f:i:T:")) != -1) {
+		switch (opt) {
+		case 's':
+			server_mode = 1;
+			break;
+		case 'c':
+			server = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'f':
+			flooders = atoi(optarg);
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (server_mode == !!server || !port || !seconds)
+		usage(argv[0]);
+
+	if (server_mode)
+		run_server();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(server, NULL, &hints, &res)) {
+		fprintf(stderr, "%s: unknown host\n", server);
+		exit(1);
+	}
+	server_addr = *(struct sockaddr_in *)res->ai_addr;
+	server_addr.sin_port = htons(port);
+	freeaddrinfo(res);
+
+	run_client();
+	return 0;
+}
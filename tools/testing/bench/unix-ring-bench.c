@@ -0,0 +1,431 @@
+/*
+ * unix-ring-bench.c -- AF_UNIX datagram throughput and latency, with
+ *                      and without the UNIX_RX_RING receive ring
+ *
+ * For 1, 2, 4, ... up to -t sender threads sharing one end of a datagram
+ * socketpair, a single reader on the other end counts messages of -s
+ * bytes for -T seconds, once reading with recv() and once from a ring of
+ * -r bytes. Then one thread bounces a message off another for -T seconds
+ * in each mode and the average round trip time is printed.
+ *
+ * The ring reader follows Documentation/networking/unix_mmap.txt: it
+ * polls before it sleeps, so senders waiting for a full ring are woken.
+ * Rings larger than the default rmem_max need root (SO_RCVBUFFORCE).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o unix-ring-bench unix-ring-bench.c -lpthread */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/*
+ * From include/linux/un.h, which cannot be included next to the C
+ * library's <sys/socket.h>.
+ */
+#ifndef SOL_UNIX
+#define SOL_UNIX	280
+#endif
+#define UNIX_RX_RING	1
+
+struct unix_ring_req {
+	unsigned int	ur_block_size;
+	unsigned int	ur_block_nr;
+	unsigned int	ur_frame_size;
+	unsigned int	ur_frame_nr;
+};
+
+struct unix_frame_hdr {
+	unsigned int	uf_status;
+	unsigned int	uf_len;
+	unsigned int	uf_pid;
+	unsigned int	uf_uid;
+	unsigned int	uf_gid;
+};
+
+#define UNIX_FRAME_KERNEL	0
+#define UNIX_FRAME_USER		1
+
+#define UNIX_FRAME_ALIGNMENT	16
+#define UNIX_FRAME_ALIGN(x)	(((x) + UNIX_FRAME_ALIGNMENT - 1) & \
+				 ~(UNIX_FRAME_ALIGNMENT - 1))
+#define UNIX_FRAME_HDRLEN	UNIX_FRAME_ALIGN(sizeof(struct unix_frame_hdr))
+
+static unsigned int max_threads = 4;
+static unsigned int seconds = 5;
+static size_t msg_size = 128;
+static size_t ring_bytes = 256 * 1024;
+
+static size_t page_size;
+static volatile int stop, done;
+
+struct endpoint {
+	int fd;
+	char *ring;
+	struct unix_ring_req req;
+	unsigned int pos;
+	char *buf;
+};
+
+struct worker {
+	pthread_t thread;
+	struct endpoint *ep;
+	volatile unsigned long ops;
+};
+
+static void ring_setup(struct endpoint *ep)
+{
+	struct unix_ring_req *req = &ep->req;
+	size_t size;
+	int val;
+
+	req->ur_frame_size = UNIX_FRAME_ALIGN(UNIX_FRAME_HDRLEN + msg_size);
+	req->ur_block_size = (req->ur_frame_size + page_size - 1) &
+			     ~(page_size - 1);
+	req->ur_block_nr = ring_bytes / req->ur_block_size;
+	if (!req->ur_block_nr)
+		req->ur_block_nr = 1;
+	req->ur_frame_nr = req->ur_block_nr *
+			   (req->ur_block_size / req->ur_frame_size);
+	size = (size_t)req->ur_block_size * req->ur_block_nr;
+
+	/* The kernel doubles the value, the ring only has to fit */
+	val = size;
+	if (setsockopt(ep->fd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) &&
+	    setsockopt(ep->fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val))) {
+		perror("SO_RCVBUF");
+		exit(1);
+	}
+	if (setsockopt(ep->fd, SOL_UNIX, UNIX_RX_RING, req, sizeof(*req))) {
+		perror("UNIX_RX_RING");
+		exit(1);
+	}
+
+	ep->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			ep->fd, 0);
+	if (ep->ring == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+}
+
+static void endpoint_init(struct endpoint *ep, int fd, int ring)
+{
+	struct timeval tv = { .tv_usec = 100000 };
+
+	memset(ep, 0, sizeof(*ep));
+	ep->fd = fd;
+	ep->buf = malloc(msg_size);
+	if (!ep->buf) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* Wake up now and then to notice the end of a run */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+		perror("SO_RCVTIMEO");
+		exit(1);
+	}
+	if (ring)
+		ring_setup(ep);
+}
+
+static void endpoint_exit(struct endpoint *ep)
+{
+	if (ep->ring)
+		munmap(ep->ring,
+		       (size_t)ep->req.ur_block_size * ep->req.ur_block_nr);
+	free(ep->buf);
+	close(ep->fd);
+}
+
+static unsigned int frame_status(struct unix_frame_hdr *h)
+{
+	return *(volatile unsigned int *)&h->uf_status;
+}
+
+static struct unix_frame_hdr *ring_frame(struct endpoint *ep)
+{
+	unsigned int per_block = ep->req.ur_block_size / ep->req.ur_frame_size;
+
+	return (struct unix_frame_hdr *)(ep->ring +
+		(ep->pos / per_block) * ep->req.ur_block_size +
+		(ep->pos % per_block) * ep->req.ur_frame_size);
+}
+
+/* Take one message, returns 0 if none came within the receive timeout */
+static int receive(struct endpoint *ep)
+{
+	struct unix_frame_hdr *h;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	if (!ep->ring) {
+		ret = recv(ep->fd, ep->buf, msg_size, 0);
+		if (ret >= 0)
+			return 1;
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		perror("recv");
+		exit(1);
+	}
+
+	h = ring_frame(ep);
+	if (frame_status(h) != UNIX_FRAME_USER) {
+		pfd.fd = ep->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+		if (frame_status(h) != UNIX_FRAME_USER)
+			return 0;
+	}
+	__sync_synchronize();
+
+	/* Read the message in place, that is what the ring is for */
+	if (h->uf_len != msg_size) {
+		fprintf(stderr, "bad frame length %u\n", h->uf_len);
+		exit(1);
+	}
+
+	__sync_synchronize();
+	*(volatile unsigned int *)&h->uf_status = UNIX_FRAME_KERNEL;
+	if (++ep->pos == ep->req.ur_frame_nr)
+		ep->pos = 0;
+	return 1;
+}
+
+static void transmit(int fd, const char *msg)
+{
+	while (send(fd, msg, msg_size, 0) < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			perror("send");
+			exit(1);
+		}
+	}
+}
+
+static void *sender(void *arg)
+{
+	struct worker *w = arg;
+	char *msg;
+
+	msg = calloc(1, msg_size);
+	if (!msg) {
+		perror("calloc");
+		exit(1);
+	}
+
+	while (!stop) {
+		transmit(w->ep->fd, msg);
+		w->ops++;
+	}
+
+	free(msg);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!done)
+		w->ops += receive(w->ep);
+
+	return NULL;
+}
+
+static void *pinger(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!stop) {
+		transmit(w->ep->fd, w->ep->buf);
+		while (!receive(w->ep))
+			;
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static void *ponger(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!done)
+		if (receive(w->ep))
+			transmit(w->ep->fd, w->ep->buf);
+
+	return NULL;
+}
+
+static void start(struct worker *w, void *(*fn)(void *))
+{
+	if (pthread_create(&w->thread, NULL, fn, w)) {
+		fprintf(stderr, "pthread_create failed\n");
+		exit(1);
+	}
+}
+
+static void socket_pair(struct endpoint *tx, int tx_ring,
+			struct endpoint *rx, int rx_ring)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	}
+	endpoint_init(tx, sv[0], tx_ring);
+	endpoint_init(rx, sv[1], rx_ring);
+}
+
+static void run_throughput(unsigned int nr, int ring)
+{
+	struct endpoint tx, rx;
+	struct worker *senders, recv_worker = { .ep = &rx };
+	unsigned long received;
+	unsigned int i;
+
+	senders = calloc(nr, sizeof(*senders));
+	if (!senders) {
+		perror("calloc");
+		exit(1);
+	}
+	socket_pair(&tx, 0, &rx, ring);
+
+	stop = done = 0;
+	start(&recv_worker, reader);
+	for (i = 0; i < nr; i++) {
+		senders[i].ep = &tx;
+		start(&senders[i], sender);
+	}
+
+	sleep(seconds);
+	stop = 1;
+	received = recv_worker.ops;
+
+	/* Keep reading until no sender is stuck on a full queue or ring */
+	for (i = 0; i < nr; i++)
+		pthread_join(senders[i].thread, NULL);
+	done = 1;
+	pthread_join(recv_worker.thread, NULL);
+
+	printf("%3u senders, %-4s: %12.0f msgs/s %10.1f MB/s\n", nr,
+	       ring ? "ring" : "recv", (double)received / seconds,
+	       (double)received * msg_size / seconds / (1024 * 1024));
+
+	endpoint_exit(&tx);
+	endpoint_exit(&rx);
+	free(senders);
+}
+
+static void run_latency(int ring)
+{
+	struct endpoint a, b;
+	struct worker ping = { .ep = &a }, pong = { .ep = &b };
+
+	socket_pair(&a, ring, &b, ring);
+
+	stop = done = 0;
+	start(&pong, ponger);
+	start(&ping, pinger);
+
+	sleep(seconds);
+	stop = 1;
+	pthread_join(ping.thread, NULL);
+	done = 1;
+	pthread_join(pong.thread, NULL);
+
+	printf("round trip, %-4s: %12.2f us\n", ring ? "ring" : "recv",
+	       ping.ops ? seconds * 1e6 / ping.ops : 0.0);
+
+	endpoint_exit(&a);
+	endpoint_exit(&b);
+}
+
+/* Tell whether this kernel has UNIX_RX_RING at all */
+static int have_ring(void)
+{
+	struct unix_ring_req req = { 0 };
+	int sv[2], ret;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	}
+	ret = setsockopt(sv[1], SOL_UNIX, UNIX_RX_RING, &req, sizeof(req));
+	close(sv[0]);
+	close(sv[1]);
+
+	/* An empty request is refused, but only by a kernel that knows it */
+	return ret == 0 || (errno != ENOPROTOOPT && errno != EOPNOTSUPP);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t max_threads] [-s msg_bytes] [-r ring_bytes] [-T seconds]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr;
+	int ring, opt;
+
+	while ((opt = getopt(argc, argv, "t:s:r:T:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'r':
+			ring_bytes = atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_threads || !seconds || !msg_size || !ring_bytes)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	ring = have_ring();
+	if (!ring)
+		fprintf(stderr, "no UNIX_RX_RING in this kernel, recv() only\n");
+
+	for (nr = 1; ; nr *= 2) {
+		if (nr > max_threads)
+			nr = max_threads;
+		run_throughput(nr, 0);
+		if (ring)
+			run_throughput(nr, 1);
+		if (nr == max_threads)
+			break;
+	}
+	run_latency(0);
+	if (ring)
+		run_latency(1);
+
+	return 0;
+}